@@ -0,0 +1,591 @@
+#ifdef __linux__
+#define _GNU_SOURCE // large buffers and the dTLB counter
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_HAVE_PERF
+#elif defined(__unix__) || defined(__APPLE__)
+#define _XOPEN_SOURCE 600
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define BENCH_HAVE_RUSAGE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Benchmark suite. Generates synthetic corpora and times phase 1, phase 2 and accessor workloads on them.
+//
+//	bench [megabytes per corpus, default 16] [runs, default 5]
+//
+// Prints one json object per line, for regression tracking:
+//	{"corpus":"wide","workload":"phase1","bytes":...,"values":...,"seconds":...,"gb_per_s":...,"ns_per_value":...,"allocations":...,"peak_rss_kb":...}
+// seconds is the best of the runs. values counts table entries (keys and values), or lookups for find_key.
+// allocations is per run, peak_rss_kb is for the whole process so far (-1 where unavailable).
+// dtlb_misses is per run for the random_access workloads, -1 for the others and where perf events aren't allowed.
+
+static size_t bench_allocations = 0;
+
+static void* bench_malloc(size_t size)
+{
+	bench_allocations++;
+	return malloc(size);
+}
+
+#define MUJSON_MALLOC(x) bench_malloc(x)
+#define MUJSON_LARGE_BUFFERS
+#include <mujson.c>
+
+typedef struct
+{
+	char* data;
+	size_t size;
+	size_t capacity;
+} buffer;
+
+static void append(buffer* b, const char* text)
+{
+	size_t length = strlen(text);
+	if (b->size + length + 1 > b->capacity)
+	{
+		b->capacity = (b->size + length + 1)*2;
+		b->data = (char*)realloc(b->data, b->capacity);
+	}
+	memcpy(b->data + b->size, text, length+1);
+	b->size += length;
+}
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void)
+{
+	random_state = random_state*1103515245u + 12345u;
+	return random_state >> 8;
+}
+
+// Corpora
+
+// One object with many keys and mixed values
+static buffer make_wide(size_t target)
+{
+	buffer b = {NULL, 0, 0};
+	char member[128];
+	append(&b, "{");
+	for( size_t i=0; b.size < target; i++)
+	{
+		const char* separator = i ? "," : "";
+		switch (i%4)
+		{
+			case 0: snprintf(member, sizeof(member), "%s\"key%07d\":%d", separator, (int)i, (int)next_random()); break;
+			case 1: snprintf(member, sizeof(member), "%s\"key%07d\":\"value %d\"", separator, (int)i, (int)i); break;
+			case 2: snprintf(member, sizeof(member), "%s\"key%07d\":%s", separator, (int)i, (i%8 == 2) ? "true" : "null"); break;
+			default: snprintf(member, sizeof(member), "%s\"key%07d\":%d.%03de-%d", separator, (int)i, (int)(next_random()%1000), (int)(i%1000), (int)(i%20)); break;
+		}
+		append(&b, member);
+	}
+	append(&b, "}");
+	return b;
+}
+
+// Chains of nested arrays and objects, 512 levels deep
+static buffer make_deep(size_t target)
+{
+	const size_t depth = 512;
+	buffer b = {NULL, 0, 0};
+	append(&b, "[");
+	for( size_t c=0; b.size < target; c++)
+	{
+		append(&b, c ? "," : "");
+		for( size_t d=0; d<depth; d++)
+			append(&b, (d%2) ? "{\"k\":" : "[1,");
+		append(&b, "null");
+		for( size_t d=depth; d>0; d--)
+			append(&b, ((d-1)%2) ? "}" : "]");
+	}
+	append(&b, "]");
+	return b;
+}
+
+static buffer make_numbers(size_t target)
+{
+	buffer b = {NULL, 0, 0};
+	char number[64];
+	append(&b, "[");
+	for( size_t i=0; b.size < target; i++)
+	{
+		uint32_t r = next_random();
+		switch (i%3)
+		{
+			case 0: snprintf(number, sizeof(number), "%s%d", i ? "," : "", (int)(r%2000000) - 1000000); break;
+			case 1: snprintf(number, sizeof(number), "%s%d.%05d", i ? "," : "", (int)(r%1000) - 500, (int)(r%100000)); break;
+			default: snprintf(number, sizeof(number), "%s%d.%de%s%d", i ? "," : "", (int)(r%9)+1, (int)(r%1000), (r%2) ? "-" : "+", (int)(r%300)); break;
+		}
+		append(&b, number);
+	}
+	append(&b, "]");
+	return b;
+}
+
+// Long strings, one in sixteen has escapes
+static buffer make_strings(size_t target)
+{
+	buffer b = {NULL, 0, 0};
+	char text[256];
+	append(&b, "[");
+	for( size_t i=0; b.size < target; i++)
+	{
+		size_t length = 20 + next_random()%180;
+		for( size_t j=0; j<length; j++)
+			text[j] = (char)('a' + (j*7 + i)%26);
+		text[length] = 0;
+		if (i%16 == 0)
+			memcpy(text + length/2, "\\n\\u00e9\\\"", 10);
+		append(&b, i ? ",\"" : "\"");
+		append(&b, text);
+		append(&b, "\"");
+	}
+	append(&b, "]");
+	return b;
+}
+
+// Newline delimited records, each its own document
+static buffer make_ndjson(size_t target)
+{
+	buffer b = {NULL, 0, 0};
+	char record[256];
+	for( size_t i=0; b.size < target; i++)
+	{
+		snprintf(record, sizeof(record), "{\"id\":%d,\"name\":\"record %d\",\"score\":%d.5,\"active\":%s,\"tags\":[\"a\",\"b\"]}\n", (int)i, (int)i, (int)(i%100), (i%2) ? "true" : "false");
+		append(&b, record);
+	}
+	return b;
+}
+
+// Reporting
+
+static long peak_rss_kb(void)
+{
+#ifdef BENCH_HAVE_RUSAGE
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef __APPLE__
+		return (long)(usage.ru_maxrss/1024);
+#else
+		return (long)usage.ru_maxrss;
+#endif
+#endif
+	return -1;
+}
+
+static long long dtlb_misses = -1;
+static int dtlb_counter = -1;
+
+// Counts data TLB load misses in user space from now until dtlb_counter_stop
+static void dtlb_counter_start(void)
+{
+#ifdef BENCH_HAVE_PERF
+	if (dtlb_counter < 0)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		dtlb_counter = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	if (dtlb_counter >= 0)
+	{
+		ioctl(dtlb_counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(dtlb_counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static void dtlb_counter_stop(int runs)
+{
+	dtlb_misses = -1;
+#ifdef BENCH_HAVE_PERF
+	long long count;
+	if (dtlb_counter >= 0)
+	{
+		ioctl(dtlb_counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(dtlb_counter, &count, sizeof(count)) == (ssize_t)sizeof(count))
+			dtlb_misses = count/runs;
+	}
+#else
+	(void)runs;
+#endif
+}
+
+static void report(const char* corpus, const char* workload, size_t bytes, size_t values, double seconds, size_t allocations)
+{
+	if (seconds <= 0)
+		seconds = 1e-9;
+	printf("{\"corpus\":\"%s\",\"workload\":\"%s\",\"bytes\":%lu,\"values\":%lu,\"seconds\":%.6f,\"gb_per_s\":%.3f,\"ns_per_value\":%.2f,\"allocations\":%lu,\"peak_rss_kb\":%ld,\"dtlb_misses\":%lld}\n",
+		corpus, workload, (unsigned long)bytes, (unsigned long)values, seconds, (double)bytes/seconds/1e9, seconds*1e9/(double)(values ? values : 1),
+		(unsigned long)allocations, peak_rss_kb(), dtlb_misses);
+	dtlb_misses = -1;
+	fflush(stdout);
+}
+
+static double seconds_since(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Workloads
+
+static void reset_compressed_json(muj_compressed_json json)
+{
+	*json.json_write_pos = 0;
+	*json.json_read_pos = 0;
+	*json.table_size = 0;
+}
+
+static muj_document load(FILE* f, size_t size)
+{
+	rewind(f);
+	muj_compressed_json target = muj_allocate_compressed_json(size);
+	muj_source source;
+	source.file = f;
+	muj_phase1(source, target);
+	muj_document document = muj_make_document(target, muj_allocate_document_table(target));
+	muj_phase2(document);
+	return document;
+}
+
+static size_t iterate(MUJ_INDEX value, muj_document document)
+{
+	size_t count = 1;
+	const MUJ_INDEX* table = document.table.table;
+	if (muj_is_object(value, document) && !muj_is_object_empty(value, document))
+	{
+		for( MUJ_INDEX key = value+2;; key = table[key+3])
+		{
+			count += 1 + iterate(key+2, document);
+			if (table[key+3] == 0)
+				break;
+		}
+	}
+	else if (muj_is_array(value, document) && !muj_is_array_empty(value, document))
+	{
+		for( MUJ_INDEX element = value+2; element != 0; element = table[element+1])
+			count += iterate(element, document);
+	}
+	return count;
+}
+
+static void bench_document(const char* corpus, buffer json, int runs)
+{
+	FILE* f = tmpfile();
+	fwrite(json.data, 1, json.size, f);
+
+	double best = 1e30;
+	size_t allocations = 0;
+	for( int r=0; r<runs; r++)
+	{
+		size_t before = bench_allocations;
+		clock_t start = clock();
+		muj_document loaded = load(f, json.size);
+		muj_unload_document(loaded);
+		double seconds = seconds_since(start);
+		best = (seconds < best) ? seconds : best;
+		allocations = bench_allocations - before;
+	}
+	muj_document document = load(f, json.size);
+	if (muj_get_last_error())
+	{
+		printf("{\"corpus\":\"%s\",\"error\":\"parse failed\"}\n", corpus);
+		muj_unload_document(document);
+		fclose(f);
+		return;
+	}
+	size_t values = *document.table.current_write_pos/2;
+	report(corpus, "load", json.size, values, best, allocations);
+
+	best = 1e30;
+	for( int r=0; r<runs; r++)
+	{
+		rewind(f);
+		reset_compressed_json(document.json);
+		muj_source source;
+		source.file = f;
+		clock_t start = clock();
+		muj_phase1(source, document.json);
+		double seconds = seconds_since(start);
+		best = (seconds < best) ? seconds : best;
+	}
+	report(corpus, "phase1", json.size, values, best, 0);
+
+	muj_document recursive = muj_make_document(document.json, muj_allocate_document_table(document.json));
+	const char* phase2_names[2] = {"phase2", "phase2_recursive"};
+	for( int version=0; version<2; version++)
+	{
+		muj_document target = version ? recursive : document;
+		best = 1e30;
+		for( int r=0; r<runs; r++)
+		{
+			*target.json.json_read_pos = 0;
+			*target.table.current_write_pos = 0;
+			clock_t start = clock();
+			if (version)
+				muj_phase2_recursive(target);
+			else
+				muj_phase2(target);
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+		}
+		report(corpus, phase2_names[version], *document.json.json_write_pos, values, best, 0);
+	}
+	if (memcmp(document.table.table, recursive.table.table, values*2*sizeof(MUJ_INDEX)) != 0)
+		printf("{\"corpus\":\"%s\",\"error\":\"phase 2 tables differ\"}\n", corpus);
+	muj_free_document_table(recursive.table);
+
+	MUJ_INDEX root = muj_get_root_object(document.table);
+	size_t count = iterate(root, document);
+	if (count != values)
+		printf("{\"corpus\":\"%s\",\"error\":\"iteration visited %lu of %lu\"}\n", corpus, (unsigned long)count, (unsigned long)values);
+
+	// The same type checks and walks with and without type tags, each pair timed back to back
+	muj_compressed_json tagged_json = document.json;
+	tagged_json.record_type_tags = true;
+	muj_document tagged = muj_make_document(tagged_json, muj_allocate_document_table(tagged_json));
+	*tagged.json.json_read_pos = 0;
+	muj_phase2(tagged);
+	const char* scan_names[2] = {"type_scan", "type_scan_tagged"};
+	const char* iterate_names[2] = {"iterate", "iterate_tagged"};
+	size_t num_strings[2] = {0, 0};
+	for( int version=0; version<2; version++)
+	{
+		muj_document target = version ? tagged : document;
+		best = 1e30;
+		for( int r=0; r<runs; r++)
+		{
+			num_strings[version] = 0;
+			clock_t start = clock();
+			for( MUJ_INDEX i=0; i<values*2; i+=2)
+				num_strings[version] += muj_is_string(i, target);
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+		}
+		report(corpus, scan_names[version], *document.json.json_write_pos, values, best, 0);
+		best = 1e30;
+		for( int r=0; r<runs; r++)
+		{
+			clock_t start = clock();
+			iterate(root, target);
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+		}
+		report(corpus, iterate_names[version], *document.json.json_write_pos, values, best, 0);
+	}
+	if (num_strings[0] != num_strings[1])
+		printf("{\"corpus\":\"%s\",\"error\":\"type tags differ\"}\n", corpus);
+
+	// Type checks and skips in random order, so nearly every one needs another page of the table and the json.
+	// Its own generator keeps the corpora the same.
+	MUJ_INDEX* order = (MUJ_INDEX*)malloc(values*sizeof(MUJ_INDEX));
+	uint64_t shuffle_state = 1;
+	for( size_t i=0; i<values; i++)
+		order[i] = (MUJ_INDEX)(i*2);
+	for( size_t i=values-1; i>0; i--)
+	{
+		shuffle_state = shuffle_state*6364136223846793005ull + 1442695040888963407ull;
+		size_t j = (size_t)((shuffle_state >> 33) % (i+1));
+		MUJ_INDEX swap = order[i];
+		order[i] = order[j];
+		order[j] = swap;
+	}
+	muj_large_buffers large = {1, true, muj_get_numa_node()};
+	muj_set_large_buffers(large);
+	muj_document huge = load(f, json.size);
+	muj_large_buffers off = {0, false, -1};
+	muj_set_large_buffers(off);
+	const char* random_names[2] = {"random_access", "random_access_huge_pages"};
+	size_t checksums[2] = {0, 0};
+	for( int version=0; version<2; version++)
+	{
+		muj_document target = version ? huge : document;
+		best = 1e30;
+		dtlb_counter_start();
+		for( int r=0; r<runs; r++)
+		{
+			checksums[version] = 0;
+			clock_t start = clock();
+			for( size_t i=0; i<values; i++)
+				checksums[version] += muj_is_string(order[i], target) + target.table.table[order[i]+1];
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+		}
+		dtlb_counter_stop(runs);
+		report(corpus, random_names[version], *document.json.json_write_pos, values, best, 0);
+	}
+	if (checksums[0] != checksums[1])
+		printf("{\"corpus\":\"%s\",\"error\":\"large buffers differ\"}\n", corpus);
+	muj_unload_document(huge);
+
+	// Only the type in random order, which is where a tag saves a load from the json
+	const char* type_random_names[2] = {"type_random", "type_random_tagged"};
+	size_t type_sums[2] = {0, 0};
+	for( int version=0; version<2; version++)
+	{
+		muj_document target = version ? tagged : document;
+		best = 1e30;
+		for( int r=0; r<runs; r++)
+		{
+			type_sums[version] = 0;
+			clock_t start = clock();
+			for( size_t i=0; i<values; i++)
+				type_sums[version] += (size_t)muj_get_type(order[i], target);
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+		}
+		report(corpus, type_random_names[version], *document.json.json_write_pos, values, best, 0);
+	}
+	if (type_sums[0] != type_sums[1])
+		printf("{\"corpus\":\"%s\",\"error\":\"type tags differ\"}\n", corpus);
+	muj_free_document_table(tagged.table);
+	free(order);
+
+	if (muj_is_object(root, document))
+	{
+		// Lookups spread over the object, each one walks the keys up to the match
+		const size_t lookups = 200;
+		size_t num_keys = muj_object_count_number_of_children(root, document);
+		char key[32];
+		best = 1e30;
+		for( int r=0; r<runs; r++)
+		{
+			size_t found = 0;
+			clock_t start = clock();
+			for( size_t i=0; i<lookups; i++)
+			{
+				snprintf(key, sizeof(key), "key%07d", (int)((i*num_keys)/lookups));
+				found += (muj_find_value_of_key_in_object(root, key, document) != 0);
+			}
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+			if (found != lookups)
+				printf("{\"corpus\":\"%s\",\"error\":\"found %lu of %lu keys\"}\n", corpus, (unsigned long)found, (unsigned long)lookups);
+		}
+		report(corpus, "find_key", *document.json.json_write_pos, lookups, best, 0);
+	}
+	else if (muj_is_array(root, document) && muj_is_number(root+2, document))
+	{
+		best = 1e30;
+		double sum = 0;
+		size_t num_numbers = 0;
+		for( int r=0; r<runs; r++)
+		{
+			num_numbers = 0;
+			clock_t start = clock();
+			for( MUJ_INDEX element = root+2; element != 0; element = document.table.table[element+1])
+			{
+				sum += muj_get_double(element, document);
+				num_numbers++;
+			}
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+		}
+		if (sum != sum)
+			printf("{\"corpus\":\"%s\",\"error\":\"not a number\"}\n", corpus);
+		report(corpus, "get_double", *document.json.json_write_pos, num_numbers, best, 0);
+	}
+
+	muj_unload_document(document);
+	fclose(f);
+}
+
+// Every line is parsed into the same buffers, sized for the longest line
+static void bench_ndjson(const char* corpus, buffer json, int runs)
+{
+	FILE* f = tmpfile();
+	fwrite(json.data, 1, json.size, f);
+	size_t longest = 0;
+	for( size_t begin=0, i=0; i<json.size; i++)
+	{
+		if (json.data[i] == '\n')
+		{
+			longest = (i - begin > longest) ? i - begin : longest;
+			begin = i+1;
+		}
+	}
+
+	// Without and with a shape cache, which sees the same keys in the same order on every line
+	const char* load_names[2] = {"load", "load_shaped"};
+	for( int shaped=0; shaped<2; shaped++)
+	{
+		double best = 1e30;
+		size_t values = 0;
+		size_t allocations = 0;
+		muj_shape_cache cache;
+		for( int r=0; r<runs; r++)
+		{
+			rewind(f);
+			size_t before = bench_allocations;
+			clock_t start = clock();
+			muj_compressed_json target = muj_allocate_compressed_json(longest);
+			muj_init_shape_cache(&cache);
+			target.shape_cache = shaped ? &cache : NULL;
+			muj_source source;
+			source.file = f;
+			muj_document_table table;
+			memset(&table, 0, sizeof(table));
+			values = 0;
+			char byte;
+			for(;;)
+			{
+				skip_whitespace(source);
+				if (!muj_peek_byte(source, &byte))
+					break;
+				reset_compressed_json(target);
+				muj_phase1(source, target);
+				if (table.table == NULL || table.table_size_in_indices < *target.table_size)
+				{
+					muj_free_document_table(table);
+					table = muj_allocate_document_table(target);
+				}
+				*table.current_write_pos = 0;
+				muj_phase2(muj_make_document(target, table));
+				values += *table.current_write_pos/2;
+			}
+			double seconds = seconds_since(start);
+			best = (seconds < best) ? seconds : best;
+			allocations = bench_allocations - before;
+			muj_free_document_table(table);
+			muj_free_compressed_json(target);
+		}
+		if (muj_get_last_error())
+			printf("{\"corpus\":\"%s\",\"error\":\"parse failed\"}\n", corpus);
+		if (shaped && cache.misses > cache.hits/100)
+			printf("{\"corpus\":\"%s\",\"error\":\"shape cache hits %lu, misses %lu\"}\n", corpus, (unsigned long)cache.hits, (unsigned long)cache.misses);
+		report(corpus, load_names[shaped], json.size, values, best, allocations);
+	}
+	fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+	size_t megabytes = (argc > 1) ? (size_t)atoi(argv[1]) : 16;
+	int runs = (argc > 2) ? atoi(argv[2]) : 5;
+	size_t target = megabytes*1024*1024;
+	if (runs < 1)
+		runs = 1;
+
+	buffer corpus;
+	corpus = make_wide(target); bench_document("wide", corpus, runs); free(corpus.data);
+	corpus = make_deep(target); bench_document("deep", corpus, runs); free(corpus.data);
+	corpus = make_numbers(target); bench_document("numbers", corpus, runs); free(corpus.data);
+	corpus = make_strings(target); bench_document("strings", corpus, runs); free(corpus.data);
+	corpus = make_ndjson(target); bench_ndjson("ndjson", corpus, runs); free(corpus.data);
+	return 0;
+}
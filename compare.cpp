@@ -0,0 +1,367 @@
+// Compares mujson with other json parsers on the same inputs.
+//
+//	compare [runs] file.json...
+//
+// Prints one json object per line and parser:
+//	{"file":"...","parser":"mujson","bytes":...,"ok":true,"parse_seconds":...,"mb_per_s":...,"first_field_seconds":...,"peak_kb":...}
+// parse_seconds is the best of the runs for a complete parse, first_field_seconds until the first member (or element)
+// of the root has been reached. peak_kb is how much a single parse raised the peak resident set size, measured in a
+// child process on POSIX systems (-1 elsewhere). It is page granular, so it is most telling for large inputs.
+//
+// mujson is always included. nlohmann/json 3.11.2 (header only) is vendored in third_party/nlohmann_json and enabled in
+// compare.project with MUJSON_COMPARE_NLOHMANN and -Ithird_party/nlohmann_json/include. Other parsers aren't part of
+// this repository. Define one or more of these and put the parser on the include and library paths:
+//	MUJSON_COMPARE_RAPIDJSON (header only)
+//	MUJSON_COMPARE_SIMDJSON (simdjson.h and simdjson.cpp, C++17)
+//	MUJSON_COMPARE_YAJL (link with -lyajl)
+//
+// Example: g++ -O2 -std=c++17 -DMUJSON_USE_CPP_INTERFACE -DMUJSON_COMPARE_NLOHMANN -DMUJSON_COMPARE_RAPIDJSON -idirafter . -Ithird_party/nlohmann_json/include
+//	-I/path/to/rapidjson/include compare.cpp mujson.cpp -o compare
+// (-idirafter: the version file at the root would otherwise be found for #include <version>)
+
+#include <mujson.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define COMPARE_FORK
+#endif
+
+#ifdef MUJSON_COMPARE_NLOHMANN
+#include <nlohmann/json.hpp>
+#endif
+#ifdef MUJSON_COMPARE_RAPIDJSON
+#include <rapidjson/document.h>
+#endif
+#ifdef MUJSON_COMPARE_SIMDJSON
+#include <simdjson.h>
+#endif
+#ifdef MUJSON_COMPARE_YAJL
+#include <yajl/yajl_tree.h>
+#endif
+
+namespace
+{
+
+// Adapters. parse does a complete parse, firstField stops as soon as the first member or element of the root is there.
+
+struct Parser
+{
+	const char* name;
+	bool (*parse)(const std::string& json);
+	bool (*firstField)(const std::string& json);
+};
+
+// Reads from the string without copying it
+class MemoryBuffer
+	: public std::streambuf
+{
+public:
+	explicit MemoryBuffer(const std::string& json)
+	{
+		char* begin = const_cast<char*>(json.data());
+		setg(begin, begin, begin + json.size());
+	}
+};
+
+bool mujsonLoad(const std::string& json, bool firstField)
+{
+	MemoryBuffer buffer(json);
+	std::istream stream(&buffer);
+	muj_source source;
+	source.file = &stream;
+	muj_compressed_json target = muj_allocate_compressed_json(json.size());
+	muj_phase1(source, target);
+	muj_document document = muj_make_document(target, muj_allocate_document_table(target));
+	bool ok = (muj_get_last_error() == 0);
+	if (ok)
+	{
+		muj_phase2(document);
+		ok = (muj_get_last_error() == 0);
+	}
+	if (ok && firstField)
+	{
+		// Both phases have to finish before anything can be read, the first member's value follows its key
+		MUJ_INDEX root = muj_get_root_object(document.table);
+		if (muj_is_object(root, document) && !muj_is_object_empty(root, document))
+			ok = muj_is_string(root+2, document) && root+4 < *document.table.current_write_pos;
+		else if (muj_is_array(root, document) && !muj_is_array_empty(root, document))
+			ok = root+2 < *document.table.current_write_pos;
+	}
+	muj_free_document_table(document.table);
+	muj_free_compressed_json(target);
+	return ok;
+}
+
+bool mujsonParse(const std::string& json)
+{
+	return mujsonLoad(json, false);
+}
+
+bool mujsonFirstField(const std::string& json)
+{
+	return mujsonLoad(json, true);
+}
+
+#ifdef MUJSON_COMPARE_NLOHMANN
+bool nlohmannParse(const std::string& json)
+{
+	nlohmann::json document = nlohmann::json::parse(json, nullptr, false);
+	return !document.is_discarded();
+}
+
+bool nlohmannFirstField(const std::string& json)
+{
+	nlohmann::json document = nlohmann::json::parse(json, nullptr, false);
+	if (document.is_discarded())
+		return false;
+	if (document.is_object() && !document.empty())
+		(void)document.begin()->type();
+	else if (document.is_array() && !document.empty())
+		(void)document[0].type();
+	return true;
+}
+#endif
+
+#ifdef MUJSON_COMPARE_RAPIDJSON
+bool rapidjsonParse(const std::string& json)
+{
+	rapidjson::Document document;
+	document.Parse(json.data(), json.size());
+	return !document.HasParseError();
+}
+
+bool rapidjsonFirstField(const std::string& json)
+{
+	rapidjson::Document document;
+	document.Parse(json.data(), json.size());
+	if (document.HasParseError())
+		return false;
+	if (document.IsObject() && document.MemberCount() > 0)
+		(void)document.MemberBegin()->value.GetType();
+	else if (document.IsArray() && document.Size() > 0)
+		(void)document[0].GetType();
+	return true;
+}
+#endif
+
+#ifdef MUJSON_COMPARE_SIMDJSON
+bool simdjsonParse(const std::string& json)
+{
+	static simdjson::dom::parser parser; // reusing the parser is how simdjson is meant to be used
+	simdjson::dom::element root;
+	return !parser.parse(json.data(), json.size()).get(root);
+}
+
+bool simdjsonFirstField(const std::string& json)
+{
+	static simdjson::ondemand::parser parser;
+	simdjson::padded_string padded(json);
+	simdjson::ondemand::document document;
+	if (parser.iterate(padded).get(document))
+		return false;
+	simdjson::ondemand::json_type type;
+	if (document.type().get(type))
+		return false;
+	if (type == simdjson::ondemand::json_type::object)
+	{
+		simdjson::ondemand::object object;
+		if (document.get_object().get(object))
+			return false;
+		for (auto field : object)
+		{
+			simdjson::ondemand::value value;
+			return !field.value().get(value);
+		}
+	}
+	else if (type == simdjson::ondemand::json_type::array)
+	{
+		simdjson::ondemand::array array;
+		if (document.get_array().get(array))
+			return false;
+		for (auto element : array)
+		{
+			simdjson::ondemand::value value;
+			return !element.get(value);
+		}
+	}
+	return true;
+}
+#endif
+
+#ifdef MUJSON_COMPARE_YAJL
+bool yajlLoad(const std::string& json, bool firstField)
+{
+	char error[128];
+	yajl_val root = yajl_tree_parse(json.c_str(), error, sizeof(error));
+	if (!root)
+		return false;
+	bool ok = true;
+	if (firstField && YAJL_IS_OBJECT(root) && root->u.object.len > 0)
+		ok = root->u.object.values[0] != NULL;
+	else if (firstField && YAJL_IS_ARRAY(root) && root->u.array.len > 0)
+		ok = root->u.array.values[0] != NULL;
+	yajl_tree_free(root);
+	return ok;
+}
+
+bool yajlParse(const std::string& json)
+{
+	return yajlLoad(json, false);
+}
+
+bool yajlFirstField(const std::string& json)
+{
+	return yajlLoad(json, true);
+}
+#endif
+
+const Parser parsers[] =
+{
+	{"mujson", mujsonParse, mujsonFirstField},
+#ifdef MUJSON_COMPARE_NLOHMANN
+	{"nlohmann", nlohmannParse, nlohmannFirstField},
+#endif
+#ifdef MUJSON_COMPARE_RAPIDJSON
+	{"rapidjson", rapidjsonParse, rapidjsonFirstField},
+#endif
+#ifdef MUJSON_COMPARE_SIMDJSON
+	{"simdjson", simdjsonParse, simdjsonFirstField},
+#endif
+#ifdef MUJSON_COMPARE_YAJL
+	{"yajl", yajlParse, yajlFirstField},
+#endif
+};
+
+// Measurements
+
+struct Result
+{
+	bool ok;
+	double parseSeconds;
+	double firstFieldSeconds;
+	long peakKb;
+};
+
+double bestOf(int runs, bool (*function)(const std::string&), const std::string& json, bool* ok)
+{
+	double best = 1e30;
+	for( int i=0; i<runs; i++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		*ok = function(json) && *ok;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = (seconds < best) ? seconds : best;
+	}
+	return best;
+}
+
+long maxRssKb()
+{
+#ifdef COMPARE_FORK
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return -1;
+#ifdef __APPLE__
+	return (long)(usage.ru_maxrss/1024);
+#else
+	return (long)usage.ru_maxrss;
+#endif
+#else
+	return -1;
+#endif
+}
+
+Result measure(const Parser& parser, const std::string& json, int runs)
+{
+	Result result;
+	long before = maxRssKb();
+	result.ok = parser.parse(json);
+	long after = maxRssKb();
+	result.peakKb = (before < 0) ? -1 : after - before;
+	result.parseSeconds = bestOf(runs, parser.parse, json, &result.ok);
+	result.firstFieldSeconds = bestOf(runs, parser.firstField, json, &result.ok);
+	return result;
+}
+
+// Each measurement runs in its own process so that earlier parses don't hide the peak of later ones
+Result measureIsolated(const Parser& parser, const std::string& json, int runs)
+{
+#ifdef COMPARE_FORK
+	int channel[2];
+	if (pipe(channel) == 0)
+	{
+		std::cout.flush();
+		pid_t child = fork();
+		if (child == 0)
+		{
+			Result result = measure(parser, json, runs);
+			ssize_t written = write(channel[1], &result, sizeof(result));
+			_exit(written == (ssize_t)sizeof(result) ? 0 : 1);
+		}
+		close(channel[1]);
+		Result result;
+		bool received = (child > 0 && read(channel[0], &result, sizeof(result)) == (ssize_t)sizeof(result));
+		close(channel[0]);
+		if (child > 0)
+			waitpid(child, NULL, 0);
+		if (received)
+			return result;
+	}
+#endif
+	return measure(parser, json, runs);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	int first = 1;
+	int runs = 5;
+	if (argc > 1 && atoi(argv[1]) > 0)
+	{
+		runs = atoi(argv[1]);
+		first = 2;
+	}
+	if (first >= argc)
+	{
+		std::cerr << "Usage: compare [runs] file.json..." << std::endl;
+		return 1;
+	}
+
+	// All inputs are read up front, so the resident set only grows before the measurements start
+	std::vector<std::string> inputs;
+	for( int i=first; i<argc; i++)
+	{
+		std::ifstream file(argv[i], std::ios::binary);
+		std::stringstream contents;
+		contents << file.rdbuf();
+		inputs.push_back(contents.str());
+	}
+
+	for( size_t i=0; i<inputs.size(); i++)
+	{
+		for( size_t p=0; p<sizeof(parsers)/sizeof(parsers[0]); p++)
+		{
+			Result result = measureIsolated(parsers[p], inputs[i], runs);
+			double megabytes = (double)inputs[i].size() / (1024.0*1024.0);
+			char line[512];
+			snprintf(line, sizeof(line), "{\"file\":\"%s\",\"parser\":\"%s\",\"bytes\":%lu,\"ok\":%s,\"parse_seconds\":%.6f,\"mb_per_s\":%.1f,\"first_field_seconds\":%.6f,\"peak_kb\":%ld}",
+				argv[first+i], parsers[p].name, (unsigned long)inputs[i].size(), result.ok ? "true" : "false", result.parseSeconds,
+				result.parseSeconds > 0 ? megabytes/result.parseSeconds : 0.0, result.firstFieldSeconds, result.peakKb);
+			std::cout << line << std::endl;
+		}
+	}
+	return 0;
+}
@@ -1,3 +1,7 @@
+#if (defined(MUJSON_LARGE_BUFFERS) || defined(MUJSON_SHARED_DOCUMENTS) || defined(MUJSON_SIDECAR_FILES)) && defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB, syscall, shm_open, ftruncate, pread and st_mtim
+#endif
+
 #include <mujson.h>
 
 #include <stdlib.h>
@@ -9,6 +13,34 @@
 #include <setjmp.h>
 #endif
 
+#if defined(MUJSON_LARGE_BUFFERS) && defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define MUJSON_MAP_BUFFERS
+#endif
+
+#if defined(MUJSON_SHARED_DOCUMENTS) && (defined(__linux__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MUJSON_SHM_DOCUMENTS
+#endif
+
+#if defined(MUJSON_SIDECAR_FILES) && (defined(__linux__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MUJSON_MAP_SIDECARS
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MUJSON_SSE2
+#endif
+
 // Why another json parser?
 // 	This is mostly just to freshen up my C.
 //	It might be very obvious from the code I don't use pure C that much.
@@ -25,12 +57,18 @@
 // - The parse result uses (practically always, with a max 1 byte overhead) less memory than the size of the json file
 // - The parse result and table are serial data, so can for example be written to disk
 // - The parse result has the same characters as the input JSON, so can be used in environments where no binary data is allowed without modification
-//		- However, this does mean that unicode cannot be supported; input data in the '\u1234' form will become 'u1234'
+//		- Escapes are decoded when strings are copied or compared: '\u1234' (and surrogate pairs) become UTF-8
+//		- Phase 1 optionally validates UTF-8 and escapes in strings (muj_compressed_json.validate_utf8)
 // - It requires only 2 dynamic memory allocations: For the compressed document text, and for the document table.
 // - It doesn't deduct value types during the parsing phase. Hence the use case is (partial) single parse of a json file.
 // - The internal data layout is optimal for depth-first parsing
 // - The parse phase does a single linear (streaming) scan of the input json
 
+// Without MUJSON_REALLOC, shrinking buffers allocated with a custom MUJSON_MALLOC copies them
+#if !defined(MUJSON_MALLOC) && !defined(MUJSON_REALLOC)
+#define MUJSON_REALLOC(x, size) realloc(x, size)
+#endif
+
 #ifndef MUJSON_MALLOC
 #define MUJSON_MALLOC(x) malloc(x)
 #endif
@@ -48,25 +86,137 @@
 extern const char* muj_problem_string;
 const char* muj_problem_string = 0;
 
+static muj_error muj_last_error;
+static muj_log_function muj_log = NULL;
+static void* muj_log_user_data = NULL;
+
+// Phase 1 problems are located in the source after the fact, so the hot path doesn't count lines
+static int muj_current_phase = 0;
+#if !defined(MUJSON_MANUAL_STREAM) || defined(MUJSON_MANUAL_STREAM_POSITIONS)
+static muj_source muj_phase1_source;
+static long muj_phase1_start = -1;
+#endif
+
 extern const char* muj_get_last_error(void);
 const char* muj_get_last_error()
 {
 	const char* last_error = muj_problem_string;
 	muj_problem_string = 0;
+	muj_last_error.code = MUJ_ERROR_NONE;
 	return last_error;
 }
 
+muj_error muj_get_error()
+{
+	if (muj_problem_string == 0)
+		muj_last_error.code = MUJ_ERROR_NONE;
+	return muj_last_error;
+}
+
+// Lets an internal parse see only its own problems. A problem the caller hasn't read yet is put back afterwards and,
+// being the first, stays the one muj_get_last_error returns; otherwise the internal problem is left for the caller.
+typedef struct
+{
+	const char* string;
+	muj_error error;
+} muj_problem_state;
+
+static muj_problem_state muj_save_problem(void)
+{
+	muj_problem_state saved;
+	saved.string = muj_problem_string;
+	saved.error = muj_last_error;
+	muj_problem_string = 0;
+	muj_last_error.code = MUJ_ERROR_NONE;
+	return saved;
+}
+
+static void muj_restore_problem(muj_problem_state saved)
+{
+	if (saved.string == 0)
+		return;
+	muj_problem_string = saved.string;
+	muj_last_error = saved.error;
+}
+
+void muj_set_log_function(muj_log_function log, void* user_data)
+{
+	muj_log = log;
+	muj_log_user_data = user_data;
+}
+
+static void muj_locate_in_source(muj_error* error)
+{
+#if !defined(MUJSON_MANUAL_STREAM) || defined(MUJSON_MANUAL_STREAM_POSITIONS)
+	long end = muj_tell_source(muj_phase1_source);
+	if (muj_phase1_start < 0 || end < muj_phase1_start)
+		return;
+	error->offset = (size_t)(end - muj_phase1_start);
+	if (!muj_seek_source(muj_phase1_source, muj_phase1_start))
+		return;
+	error->line = 1;
+	error->column = 1;
+	char byte;
+	for( long i=muj_phase1_start; i<end && muj_read_byte(muj_phase1_source, &byte); i++)
+	{
+		if (byte == '\n')
+		{
+			error->line++;
+			error->column = 1;
+		}
+		else
+			error->column++;
+	}
+	muj_seek_source(muj_phase1_source, end);
+#else
+	MUJ_UNUSED(error);
+#endif
+}
+
+// The first problem is kept until muj_get_last_error, later ones are usually its consequences and only logged
+static void muj_report_problem(muj_error_code code, size_t offset, int expected, int found, const char* string)
+{
+	muj_error error;
+	error.code = code;
+	error.phase = muj_current_phase;
+	error.message = string;
+	error.offset = offset;
+	error.line = 0;
+	error.column = 0;
+	error.expected = expected;
+	error.found = found;
+	if (muj_current_phase == 1 && offset == MUJ_UNKNOWN_POSITION)
+		muj_locate_in_source(&error);
+	if (muj_problem_string == 0)
+	{
+		muj_problem_string = string;
+		muj_last_error = error;
+	}
+	if (muj_log)
+		muj_log(&error, muj_log_user_data);
+}
+
 #ifndef MUJSON_NO_SETJMP
 static jmp_buf problem_jmp_buf;
-#define MUJ_PROBLEM(string) \
-muj_problem_string = string;\
-printf("mujson: Problem occured: %s", string);\
+#define MUJ_PROBLEM_AT(code, offset, expected, found, string) \
+muj_report_problem(code, offset, expected, found, string);\
 longjmp(problem_jmp_buf, 1)
 #define POST_PROBLEM_IMPLIED(x)
 #else
-#define MUJ_PROBLEM(string) muj_problem_string = string; printf("mujson: Problem occured, bad things may happen: %s", string)
+#define MUJ_PROBLEM_AT(code, offset, expected, found, string) muj_report_problem(code, offset, expected, found, string) // bad things may happen
 #define POST_PROBLEM_IMPLIED(x) x
 #endif
+#define MUJ_PROBLEM(code, string) MUJ_PROBLEM_AT(code, MUJ_UNKNOWN_POSITION, -1, -1, string)
+
+#ifdef MUJSON_INSTRUMENT
+#define MUJ_COUNT(stats, counter, amount) do { if (stats) (stats)->counter += (amount); } while(0)
+static double muj_stats_clock(muj_stats* stats)
+{
+	return (stats && stats->clock) ? stats->clock(stats->clock_user_data) : 0.0;
+}
+#else
+#define MUJ_COUNT(stats, counter, amount)
+#endif
 
 muj_document muj_make_document(muj_compressed_json json, muj_document_table table)
 {
@@ -96,6 +246,7 @@ muj_document muj_load_document_from_file(FILE* f)
 	muj_source source;
 	source.file = f;
 	muj_phase1(source, target);
+	target = muj_shrink_compressed_json(target); // documents loaded whole tend to be kept
 	
 	muj_document_table table = muj_allocate_document_table(target);
 	
@@ -124,13 +275,13 @@ void muj_expect_byte(muj_source source, char expectation)
 {
 	char byte = 0;
 	bool success = muj_read_byte(source, &byte);
-	if (!success || (success && (byte != expectation)))
+	if (!success)
 	{
-		if (!success)
-			printf("Failed reading byte (EOF?)\n");
-		else
-			printf("Expected similarity: %d ('%c') should be %d ('%c')\n", (int)byte, byte, (int)expectation, expectation);
-		MUJ_PROBLEM("Unexpected data in phase 1.\n");
+		MUJ_PROBLEM_AT(MUJ_ERROR_EOF, MUJ_UNKNOWN_POSITION, (unsigned char)expectation, -1, "EOF in phase 1.\n");
+	}
+	else if (byte != expectation)
+	{
+		MUJ_PROBLEM_AT(MUJ_ERROR_UNEXPECTED_BYTE, MUJ_UNKNOWN_POSITION, (unsigned char)expectation, (unsigned char)byte, "Unexpected data in phase 1.\n");
 	}
 	
 }
@@ -157,20 +308,157 @@ void skip_whitespace(muj_source source)
 	}
 }
 
+// Large buffers
+
+static muj_large_buffers muj_large_buffer_settings = {0, false, -1};
+
+void muj_set_large_buffers(muj_large_buffers settings)
+{
+	muj_large_buffer_settings = settings;
+}
+
+int muj_get_numa_node(void)
+{
+#ifdef MUJSON_MAP_BUFFERS
+	unsigned cpu = 0;
+	unsigned node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return (int)node;
+#endif
+	return -1;
+}
+
+#ifdef MUJSON_MAP_BUFFERS
+// Buffers start with a header that tells how they were allocated, so they can be freed after the settings changed
+#define MUJ_BUFFER_HEADER 64 // keeps the buffer cache line aligned
+#define MUJ_HUGE_PAGE_SIZE ((size_t)2*1024*1024)
+#define MUJ_MPOL_PREFERRED 1
+
+static void* muj_map_buffer(size_t size)
+{
+	muj_large_buffers settings = muj_large_buffer_settings;
+	void* mapped = MAP_FAILED;
+	if (settings.huge_pages)
+	{
+		size = (size + MUJ_HUGE_PAGE_SIZE-1) & ~(MUJ_HUGE_PAGE_SIZE-1); // whole huge pages
+#ifdef MAP_HUGETLB
+		mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	}
+	if (mapped == MAP_FAILED)
+	{
+		mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (settings.huge_pages)
+			madvise(mapped, size, MADV_HUGEPAGE);
+#endif
+	}
+	// Before anything touches the pages, they are only placed when touched
+	if (settings.numa_node >= 0 && settings.numa_node < 256)
+	{
+		size_t node = (size_t)settings.numa_node;
+		unsigned long nodes[256/(8*sizeof(unsigned long))] = {0};
+		nodes[node/(8*sizeof(unsigned long))] = 1ul << (node%(8*sizeof(unsigned long)));
+		syscall(SYS_mbind, mapped, size, MUJ_MPOL_PREFERRED, nodes, (unsigned long)(sizeof(nodes)*8 + 1), 0u); // only a hint
+	}
+	*(size_t*)mapped = size;
+	return mapped;
+}
+
+static void* muj_alloc_buffer(size_t size)
+{
+	char* buffer = NULL;
+	if (muj_large_buffer_settings.min_size != 0 && size >= muj_large_buffer_settings.min_size)
+		buffer = (char*)muj_map_buffer(size + MUJ_BUFFER_HEADER);
+	if (buffer == NULL)
+	{
+		buffer = (char*)MUJSON_MALLOC(size + MUJ_BUFFER_HEADER);
+		if (buffer == NULL)
+			return NULL;
+		*(size_t*)buffer = 0;
+	}
+	return buffer + MUJ_BUFFER_HEADER;
+}
+
+static void muj_free_buffer(void* buffer)
+{
+	if (buffer == NULL)
+		return;
+	char* block = (char*)buffer - MUJ_BUFFER_HEADER;
+	size_t mapped_size = *(size_t*)block;
+	if (mapped_size)
+		munmap(block, mapped_size);
+	else
+		MUJSON_FREE(block);
+}
+
+// NULL if out of memory, buffer is then untouched
+static void* muj_shrink_buffer(void* buffer, size_t size)
+{
+#ifdef MUJSON_REALLOC
+	char* block = (char*)buffer - MUJ_BUFFER_HEADER;
+	if (*(size_t*)block == 0)
+	{
+		char* shrunk = (char*)MUJSON_REALLOC(block, size + MUJ_BUFFER_HEADER);
+		return shrunk ? shrunk + MUJ_BUFFER_HEADER : NULL;
+	}
+#endif
+	void* shrunk = muj_alloc_buffer(size);
+	if (shrunk)
+	{
+		memcpy(shrunk, buffer, size);
+		muj_free_buffer(buffer);
+	}
+	return shrunk;
+}
+#else
+static void* muj_alloc_buffer(size_t size)
+{
+	return MUJSON_MALLOC(size);
+}
+
+static void muj_free_buffer(void* buffer)
+{
+	MUJSON_FREE(buffer);
+}
+
+static void* muj_shrink_buffer(void* buffer, size_t size)
+{
+#ifdef MUJSON_REALLOC
+	return MUJSON_REALLOC(buffer, size);
+#else
+	void* shrunk = MUJSON_MALLOC(size);
+	if (shrunk)
+	{
+		memcpy(shrunk, buffer, size);
+		MUJSON_FREE(buffer);
+	}
+	return shrunk;
+#endif
+}
+#endif
+
 muj_compressed_json muj_allocate_compressed_json(size_t uncompressedSizeInBytes)
 {
 	size_t bytes = uncompressedSizeInBytes+1; // Worst case inflation is 1 byte: [1,1] -> [+1+1]
 	muj_compressed_json out;
 	out.json_max_size = 0;
+	out.validate_utf8 = false;
+	out.shape_cache = NULL;
+	out.record_container_sizes = false;
+	out.record_type_tags = false;
+	out.stats = NULL;
 #ifdef MUJSON_SINGLE_MALLOC
-	size_t malloc_size = bytes + sizeof(size_t)*3;
-	out.json_target = (char*)MUJSON_MALLOC(malloc_size);
+	size_t malloc_size = bytes + 1 + sizeof(size_t)*3; // +1: phase 2 puts a sentinel after the compressed json
+	out.json_target = (char*)muj_alloc_buffer(malloc_size);
 	out.json_write_pos = (size_t*)((char*)out.json_target +(long) malloc_size - (long)sizeof(size_t)*3);
 	out.json_read_pos = (size_t*)((char*)out.json_target + (long)malloc_size - (long)sizeof(size_t)*2);
 	out.table_size = (size_t*)((char*)out.json_target + (long)malloc_size - (long)sizeof(size_t)*1);
 #else
-	size_t malloc_size = bytes;
-	out.json_target = MUJSON_MALLOC(malloc_size);
+	size_t malloc_size = bytes + 1;
+	out.json_target = muj_alloc_buffer(malloc_size);
 	out.json_write_pos = MUJSON_MALLOC(sizeof(size_t));
 	out.json_read_pos = MUJSON_MALLOC(sizeof(size_t));
 	out.table_size = MUJSON_MALLOC(sizeof(size_t));
@@ -183,9 +471,40 @@ muj_compressed_json muj_allocate_compressed_json(size_t uncompressedSizeInBytes)
 	return out;
 }
 
+muj_compressed_json muj_shrink_compressed_json(muj_compressed_json json)
+{
+	size_t bytes = *json.json_write_pos + 1; // like a fresh allocation, one byte more than the compressed json
+	if (json.json_target == NULL || bytes >= json.json_max_size)
+		return json;
+#ifdef MUJSON_SINGLE_MALLOC
+	// The counters are at the end of the allocation, so they move
+	size_t write_pos = *json.json_write_pos;
+	size_t read_pos = *json.json_read_pos;
+	size_t table_size = *json.table_size;
+	size_t malloc_size = bytes + 1 + sizeof(size_t)*3;
+	char* shrunk = (char*)muj_shrink_buffer(json.json_target, malloc_size);
+	if (shrunk == NULL)
+		return json;
+	json.json_target = shrunk;
+	json.json_write_pos = (size_t*)(shrunk + (long)malloc_size - (long)sizeof(size_t)*3);
+	json.json_read_pos = (size_t*)(shrunk + (long)malloc_size - (long)sizeof(size_t)*2);
+	json.table_size = (size_t*)(shrunk + (long)malloc_size - (long)sizeof(size_t)*1);
+	*json.json_write_pos = write_pos;
+	*json.json_read_pos = read_pos;
+	*json.table_size = table_size;
+#else
+	char* shrunk = (char*)muj_shrink_buffer(json.json_target, bytes + 1);
+	if (shrunk == NULL)
+		return json;
+	json.json_target = shrunk;
+#endif
+	json.json_max_size = bytes;
+	return json;
+}
+
 void muj_free_compressed_json(muj_compressed_json json)
 {
-	MUJSON_FREE(json.json_target);
+	muj_free_buffer(json.json_target);
 #ifndef MUJSON_SINGLE_MALLOC
 	MUJSON_FREE(json.json_write_pos);
 	MUJSON_FREE(json.json_read_pos);
@@ -202,9 +521,7 @@ void push_byte_to_target(muj_compressed_json target, char byte)
 {
 	if ((*target.json_write_pos) >= target.json_max_size)
 	{
-		printf("Target size: %d\n", (int)target.json_max_size);
-		printf("Write attempt: %d\n", (int)(*target.json_write_pos));
-		MUJ_PROBLEM("Compressed JSON target not large enough.\n");
+		MUJ_PROBLEM(MUJ_ERROR_TARGET_TOO_SMALL, "Compressed JSON target not large enough.\n");
 	}
 	else
 	{
@@ -234,16 +551,213 @@ void muj_phase1_value_constant(muj_source source, muj_compressed_json target)
 	else
 	{
 FAIL_CONSTANT_PARSING:
-		printf("Failed reading byte (EOF?)\n");
-		MUJ_PROBLEM("EOF in phase 1.\n");
+		MUJ_PROBLEM(MUJ_ERROR_EOF, "EOF in phase 1.\n");
 	}
 }
 
-void skip_string(muj_source source, muj_compressed_json target)
+// String scanning
+// Strings are mostly plain ASCII without escapes, so both the search for the end of a run and validation look at
+// 16 (SSE2) or 8 (SWAR) bytes at a time and only fall back to byte by byte work for escapes and multi byte sequences.
+
+#define MUJ_SWAR_ONES 0x0101010101010101ULL
+#define MUJ_SWAR_HIGHS 0x8080808080808080ULL
+#define MUJ_SWAR_HAS_ZERO(x) (((x) - MUJ_SWAR_ONES) & ~(x) & MUJ_SWAR_HIGHS)
+#define MUJ_SWAR_HAS_LESS(x, n) (((x) - MUJ_SWAR_ONES*(n)) & ~(x) & MUJ_SWAR_HIGHS) // some byte < n (n <= 128)
+
+static uint64_t muj_load_8(const char* bytes)
+{
+	uint64_t out;
+	memcpy(&out, bytes, sizeof(out));
+	return out;
+}
+
+// Number of bytes from str up to the first quote or backslash (or limit)
+static size_t muj_string_run_length(const char* str, const char* limit)
+{
+	const char* p = str;
+#ifdef MUJSON_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	while (limit - p >= 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i*)p);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash))))
+			break;
+		p += 16;
+	}
+#endif
+	while (limit - p >= 8)
+	{
+		uint64_t block = muj_load_8(p);
+		if (MUJ_SWAR_HAS_ZERO(block ^ (MUJ_SWAR_ONES * '"')) | MUJ_SWAR_HAS_ZERO(block ^ (MUJ_SWAR_ONES * '\\')))
+			break;
+		p += 8;
+	}
+	while (p < limit && *p != '"' && *p != '\\')
+		p++;
+	return (size_t)(p - str);
+}
+
+static int muj_hex_value(char byte)
+{
+	if (byte >= '0' && byte <= '9')
+		return byte - '0';
+	if (byte >= 'a' && byte <= 'f')
+		return byte - 'a' + 10;
+	if (byte >= 'A' && byte <= 'F')
+		return byte - 'A' + 10;
+	return -1;
+}
+
+// Parses the 4 hex digits of a \u escape, stops at the first non hex digit (a closing quote at the latest)
+static bool muj_parse_hex4(const char* str, uint32_t* code)
+{
+	*code = 0;
+	for( int i=0; i<4; i++)
+	{
+		int value = muj_hex_value(str[i]);
+		if (value < 0)
+			return false;
+		*code = (*code << 4) | (uint32_t)value;
+	}
+	return true;
+}
+
+static bool muj_is_high_surrogate(uint32_t code)
+{
+	return (code >= 0xD800 && code < 0xDC00);
+}
+
+static bool muj_is_low_surrogate(uint32_t code)
+{
+	return (code >= 0xDC00 && code < 0xE000);
+}
+
+// Decodes the \u escape at str (the backslash), combining surrogate pairs. Returns the number of bytes read, 0 if malformed.
+// An isolated surrogate is reported as 0xD800-0xDFFF in code.
+static size_t muj_decode_unicode_escape(const char* str, uint32_t* code)
+{
+	if (!muj_parse_hex4(str+2, code))
+		return 0;
+	uint32_t low;
+	if (muj_is_high_surrogate(*code) && str[6] == '\\' && str[7] == 'u' && muj_parse_hex4(str+8, &low) && muj_is_low_surrogate(low))
+	{
+		*code = 0x10000 + ((*code - 0xD800) << 10) + (low - 0xDC00);
+		return 12;
+	}
+	return 6;
+}
+
+// Validates a multi byte UTF-8 sequence at str, returns its length or 0 if invalid (overlong, surrogate, too large, truncated)
+static size_t muj_validate_utf8_sequence(const unsigned char* str, size_t available)
+{
+	unsigned char lead = str[0];
+	size_t length;
+	unsigned char min = 0x80, max = 0xBF; // allowed range of the second byte
+	if (lead >= 0xC2 && lead <= 0xDF)
+		length = 2;
+	else if (lead >= 0xE0 && lead <= 0xEF)
+	{
+		length = 3;
+		if (lead == 0xE0)
+			min = 0xA0;
+		else if (lead == 0xED)
+			max = 0x9F;
+	}
+	else if (lead >= 0xF0 && lead <= 0xF4)
+	{
+		length = 4;
+		if (lead == 0xF0)
+			min = 0x90;
+		else if (lead == 0xF4)
+			max = 0x8F;
+	}
+	else
+		return 0;
+	if (available < length || str[1] < min || str[1] > max)
+		return 0;
+	for( size_t i=2; i<length; i++)
+	{
+		if ((str[i] & 0xC0) != 0x80)
+			return 0;
+	}
+	return length;
+}
+
+// Validates the contents of a string (without quotes) as written by phase 1: UTF-8, escapes and no raw control characters
+static bool muj_validate_string(const char* str, size_t length)
+{
+	const char* p = str;
+	const char* limit = str+length;
+	while (p < limit)
+	{
+#ifdef MUJSON_SSE2
+		const __m128i backslash = _mm_set1_epi8('\\');
+		const __m128i space = _mm_set1_epi8(' ');
+		while (limit - p >= 16)
+		{
+			__m128i block = _mm_loadu_si128((const __m128i*)p);
+			if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(block, space), _mm_cmpeq_epi8(block, backslash)))) // signed: also >= 0x80
+				break;
+			p += 16;
+		}
+#endif
+		while (limit - p >= 8)
+		{
+			uint64_t block = muj_load_8(p);
+			if ((block & MUJ_SWAR_HIGHS) | MUJ_SWAR_HAS_ZERO(block ^ (MUJ_SWAR_ONES * '\\')) | MUJ_SWAR_HAS_LESS(block, ' '))
+				break;
+			p += 8;
+		}
+		if (p >= limit)
+			break;
+		unsigned char byte = (unsigned char)*p;
+		if (byte == '\\')
+		{
+			if (limit - p < 2)
+				return false;
+			if (p[1] == 'u')
+			{
+				uint32_t code;
+				size_t read = (limit - p >= 6) ? muj_decode_unicode_escape(p, &code) : 0;
+				if (read == 0 || muj_is_high_surrogate(code) || muj_is_low_surrogate(code))
+					return false;
+				p += read;
+			}
+			else if (strchr("\"\\/bfnrt", p[1]) != NULL && p[1] != 0)
+				p += 2;
+			else
+				return false;
+		}
+		else if (byte >= 0x80)
+		{
+			size_t read = muj_validate_utf8_sequence((const unsigned char*)p, (size_t)(limit - p));
+			if (read == 0)
+				return false;
+			p += read;
+		}
+		else if (byte < ' ')
+			return false; // must be escaped
+		else
+			p++;
+	}
+	return true;
+}
+
+// Copies the rest of a string of which the start (at least the opening quote) has already been copied.
+// begin: position of the first byte after the quote. escape_pending: the last copied byte was an escaping backslash.
+void skip_string_rest(muj_source source, muj_compressed_json target, size_t begin, bool escape_pending)
 {
 	char byte = 0;
-	muj_expect_byte(source, '"'); // '"'
-	push_byte_to_target(target, '"');
+	if (escape_pending)
+	{
+		if (!muj_read_byte(source, &byte))
+		{
+			MUJ_PROBLEM(MUJ_ERROR_EOF, "EOF in string parsing.\n");
+			POST_PROBLEM_IMPLIED(return);
+		}
+		push_byte_to_target(target, byte);
+	}
     for(;;)
 	{
 		bool success = muj_read_byte(source, &byte);
@@ -267,11 +781,21 @@ void skip_string(muj_source source, muj_compressed_json target)
 		else
 		{
 FAIL_STRING_SKIPPPING:
-			printf("Failed reading byte (EOF?)\n");
-			MUJ_PROBLEM("EOF in string parsing.\n");
-			POST_PROBLEM_IMPLIED(break);
+			MUJ_PROBLEM(MUJ_ERROR_EOF, "EOF in string parsing.\n");
+			POST_PROBLEM_IMPLIED(return);
 		}
 	}
+	if (target.validate_utf8 && !muj_validate_string(&target.json_target[begin], *target.json_write_pos - 1 - begin))
+	{
+		MUJ_PROBLEM(MUJ_ERROR_INVALID_STRING, "Invalid UTF-8, escape or control character in string.\n");
+	}
+}
+
+void skip_string(muj_source source, muj_compressed_json target)
+{
+	muj_expect_byte(source, '"'); // '"'
+	push_byte_to_target(target, '"');
+	skip_string_rest(source, target, *target.json_write_pos, false);
 }
 
 bool isByteDigit(char byte)
@@ -306,8 +830,7 @@ void skip_number(muj_source source, muj_compressed_json target)
 		}
 		else
 		{
-			printf("Failed reading byte (EOF?)\n");
-			MUJ_PROBLEM("EOF in number parsing.\n");
+			MUJ_PROBLEM(MUJ_ERROR_EOF, "EOF in number parsing.\n");
 			POST_PROBLEM_IMPLIED(return);
 		}
 	}
@@ -368,8 +891,7 @@ void skip_number(muj_source source, muj_compressed_json target)
 		else
 		{
 SKIP_NUMBER_PEEK_FAILED:
-			printf("Failed reading byte (EOF?)\n");
-			MUJ_PROBLEM("EOF in number parsing.\n");
+			MUJ_PROBLEM(MUJ_ERROR_EOF, "EOF in number parsing.\n");
 			POST_PROBLEM_IMPLIED(return);
 		}
 	}
@@ -390,67 +912,223 @@ void skip_assignment(muj_source source)
 	muj_expect_byte(source, ':'); // ':' or '='
 }
 
-void muj_phase1_key(muj_source source, muj_compressed_json target)
+// Shape cache
+// Objects at the same depth usually have the same keys in the same order (arrays of records, NDJSON).
+// Per depth, the cache remembers the compressed keys of the last object. The object loop reads the key it expects
+// straight into the target with one muj_read_bytes and compares it with memcmp, before looking at the next byte at
+// all. If the ':' came right after that key last time, it is read and checked with the key. On a mismatch the source
+// is put back, so this needs a source that can seek (not a pipe). Otherwise an expected
+// key is compared byte by byte while it is copied, which still skips the escape and validation work. Either way, a
+// key that isn't the expected one is parsed the regular way and the shape is updated from that key on.
+
+#if !defined(MUJSON_MANUAL_STREAM) || (defined(MUJSON_MANUAL_STREAM_POSITIONS) && defined(MUJSON_MANUAL_STREAM_READ_BYTES))
+#define MUJ_BULK_KEYS
+#endif
+
+static muj_shape* muj_shape_cache_enter(muj_compressed_json target)
 {
-	skip_string(source, target);
-	skip_whitespace(source);
-	skip_assignment(source);
-	skip_whitespace(source);
+	muj_shape_cache* cache = target.shape_cache;
+	if (!cache)
+		return NULL;
+	size_t level = cache->depth++;
+	if (level >= MUJ_SHAPE_MAX_DEPTH)
+		return NULL;
+	cache->levels[level].cursor = 0;
+	return &cache->levels[level];
 }
 
-void muj_phase1_value(muj_source source, muj_compressed_json target);
+static void muj_shape_cache_leave(muj_compressed_json target)
+{
+	if (target.shape_cache)
+		target.shape_cache->depth--;
+}
 
-void muj_phase1_value_object(muj_source source, muj_compressed_json target)
+static void muj_shape_record_key(muj_shape* shape, const char* key, size_t length, bool colon_follows)
 {
-	char byte = 0;
-	muj_expect_byte(source, '{'); // '{'
-	push_byte_to_target(target, '{');
-	
-	bool in_object = true;
-	while(in_object)
+	size_t begin = (shape->cursor == 0) ? 0 : shape->ends[shape->cursor-1];
+	shape->num_keys = shape->cursor; // the rest of the old shape no longer applies
+	if (shape->cursor < MUJ_SHAPE_MAX_KEYS && begin + length <= MUJ_SHAPE_MAX_BYTES)
 	{
-		skip_whitespace(source);
-		muj_peek_byte(source, &byte); // '}' or '"'
-		switch(byte)
-		{
-			case '}':
-			{
-				muj_expect_byte(source, '}');
-				push_byte_to_target(target, '}');
-				in_object = false;
-				break;
-			}
-			case '"':
-			{
-				
-				muj_phase1_key(source, target);
-				muj_phase1_value(source, target);
-				skip_whitespace(source);
-				muj_peek_byte(source, &byte);
-				muj_increase_table_size(target);
-				muj_increase_table_size(target);
-				if (byte == ',')
-				{
-					muj_expect_byte(source, ','); // skip comma
-				}
+		memcpy(&shape->bytes[begin], key, length);
+		shape->ends[shape->cursor] = (uint16_t)(begin + length);
+		uint64_t bit = (uint64_t)1 << shape->cursor;
+		shape->colon_follows = colon_follows ? (shape->colon_follows | bit) : (shape->colon_follows & ~bit);
+		shape->num_keys++;
+		shape->cursor++;
+	}
+}
 
-				break;
-			}
-			default:
-			{
-				printf("Unexpected byte: %d\n", (int)byte);
-				MUJ_PROBLEM("Unexpected data in phase 1. (Expected object continuation)\n");
-			}
+#ifdef MUJ_BULK_KEYS
+// true if the next key is the one the shape expects, it is then copied. false leaves source and target as they were.
+// *colon_read tells if the ':' was read with it.
+static bool muj_phase1_expected_key(muj_source source, muj_compressed_json target, muj_shape* shape, bool* colon_read)
+{
+	if (shape->cursor >= shape->num_keys || muj_phase1_start < 0)
+		return false;
+	size_t begin = (shape->cursor == 0) ? 0 : shape->ends[shape->cursor-1];
+	size_t length = shape->ends[shape->cursor] - begin;
+	*colon_read = (shape->colon_follows >> shape->cursor) & 1;
+	size_t key_begin = *target.json_write_pos;
+	if (key_begin + length + *colon_read > target.json_max_size)
+		return false; // the regular way reports it
+	char* key = &target.json_target[key_begin]; // the ':' is overwritten by the value
+	size_t read = muj_read_bytes(source, key, length + *colon_read);
+	if (read == length + *colon_read && memcmp(key, &shape->bytes[begin], length) == 0)
+	{
+		if (*colon_read && key[length] != ':')
+		{
+			muj_seek_source(source, muj_tell_source(source) - 1); // the key matched, the regular way reads up to the ':'
+			shape->colon_follows &= ~((uint64_t)1 << shape->cursor);
+			*colon_read = false;
 		}
+		*target.json_write_pos += length;
+		shape->cursor++;
+		target.shape_cache->hits++;
+		return true;
 	}
+	muj_seek_source(source, muj_tell_source(source) - (long)read);
+	return false;
 }
+#endif
 
-void muj_phase1_value_array(muj_source source, muj_compressed_json target)
+static void muj_phase1_shaped_key(muj_source source, muj_compressed_json target, muj_shape* shape)
 {
-	char byte = 0;
-	muj_expect_byte(source, '['); // '['
-	push_byte_to_target(target, '[');
-	
+	size_t key_begin = *target.json_write_pos;
+#ifdef MUJ_BULK_KEYS
+	bool compared = (muj_phase1_start >= 0); // by muj_phase1_expected_key, which didn't match
+#else
+	bool compared = false;
+#endif
+	if (shape->cursor < shape->num_keys && !compared)
+	{
+		size_t begin = (shape->cursor == 0) ? 0 : shape->ends[shape->cursor-1];
+		const char* expected = &shape->bytes[begin];
+		size_t length = shape->ends[shape->cursor] - begin;
+		bool escape_pending = false;
+		char byte = 0;
+		size_t i = 0;
+		for( ; i<length; i++)
+		{
+			if (!muj_read_byte(source, &byte))
+			{
+				MUJ_PROBLEM(MUJ_ERROR_EOF, "EOF in string parsing.\n");
+				POST_PROBLEM_IMPLIED(return);
+			}
+			push_byte_to_target(target, byte);
+			if (byte != expected[i])
+				break;
+			escape_pending = (byte == '\\' && !escape_pending);
+		}
+		if (i == length)
+		{
+			shape->cursor++;
+			target.shape_cache->hits++;
+			return;
+		}
+		target.shape_cache->misses++;
+		if (i == 0)
+		{
+			MUJ_PROBLEM_AT(MUJ_ERROR_UNEXPECTED_BYTE, MUJ_UNKNOWN_POSITION, '"', (unsigned char)byte, "Unexpected data in phase 1. (Expected key)\n");
+			POST_PROBLEM_IMPLIED(return);
+		}
+		if (escape_pending || byte != '"')
+			skip_string_rest(source, target, key_begin+1, !escape_pending && byte == '\\');
+		else if (target.validate_utf8 && !muj_validate_string(&target.json_target[key_begin+1], *target.json_write_pos - key_begin - 2))
+		{
+			MUJ_PROBLEM(MUJ_ERROR_INVALID_STRING, "Invalid UTF-8, escape or control character in string.\n"); // A shorter key than expected
+		}
+	}
+	else
+	{
+		target.shape_cache->misses++;
+		skip_string(source, target);
+	}
+	char next = 0;
+	muj_peek_byte(source, &next);
+	muj_shape_record_key(shape, &target.json_target[key_begin], *target.json_write_pos - key_begin, next == ':');
+}
+
+void muj_phase1_key(muj_source source, muj_compressed_json target, muj_shape* shape)
+{
+	if (shape)
+		muj_phase1_shaped_key(source, target, shape);
+	else
+		skip_string(source, target);
+}
+
+void muj_phase1_value(muj_source source, muj_compressed_json target);
+
+// Everything of an object member after the key (and the ':' if colon_read)
+static void muj_phase1_member_value(muj_source source, muj_compressed_json target, bool colon_read)
+{
+	char byte = 0;
+	if (!colon_read)
+	{
+		skip_whitespace(source);
+		skip_assignment(source);
+	}
+	skip_whitespace(source);
+	muj_phase1_value(source, target);
+	skip_whitespace(source);
+	muj_peek_byte(source, &byte);
+	muj_increase_table_size(target);
+	muj_increase_table_size(target);
+	if (byte == ',')
+	{
+		muj_expect_byte(source, ','); // skip comma
+	}
+}
+
+void muj_phase1_value_object(muj_source source, muj_compressed_json target)
+{
+	char byte = 0;
+	muj_expect_byte(source, '{'); // '{'
+	push_byte_to_target(target, '{');
+	muj_shape* shape = muj_shape_cache_enter(target);
+	
+	bool in_object = true;
+	while(in_object)
+	{
+		skip_whitespace(source);
+#ifdef MUJ_BULK_KEYS
+		bool colon_read = false;
+		if (shape && muj_phase1_expected_key(source, target, shape, &colon_read))
+		{
+			muj_phase1_member_value(source, target, colon_read);
+			continue;
+		}
+#endif
+		muj_peek_byte(source, &byte); // '}' or '"'
+		switch(byte)
+		{
+			case '}':
+			{
+				muj_expect_byte(source, '}');
+				push_byte_to_target(target, '}');
+				in_object = false;
+				break;
+			}
+			case '"':
+			{
+				muj_phase1_key(source, target, shape);
+				muj_phase1_member_value(source, target, false);
+				break;
+			}
+			default:
+			{
+				MUJ_PROBLEM_AT(MUJ_ERROR_UNEXPECTED_BYTE, MUJ_UNKNOWN_POSITION, -1, (unsigned char)byte, "Unexpected data in phase 1. (Expected object continuation)\n");
+			}
+		}
+	}
+	muj_shape_cache_leave(target);
+}
+
+void muj_phase1_value_array(muj_source source, muj_compressed_json target)
+{
+	char byte = 0;
+	muj_expect_byte(source, '['); // '['
+	push_byte_to_target(target, '[');
+	
 	skip_whitespace(source);
 	
 	char early_out;
@@ -461,6 +1139,7 @@ void muj_phase1_value_array(muj_source source, muj_compressed_json target)
 		push_byte_to_target(target, ']');
 		return;
 	}
+	muj_shape_cache_enter(target);
 	
 	bool in_array = true;
 	while(in_array)
@@ -484,10 +1163,10 @@ void muj_phase1_value_array(muj_source source, muj_compressed_json target)
 		}
 		else
 		{
-			printf("Unexpected byte: %d\n", byte);
-			MUJ_PROBLEM("Unexpected data in phase 1. (Expected array continuation)\n");
+			MUJ_PROBLEM_AT(MUJ_ERROR_UNEXPECTED_BYTE, MUJ_UNKNOWN_POSITION, -1, (unsigned char)byte, "Unexpected data in phase 1. (Expected array continuation)\n");
 		}
 	}
+	muj_shape_cache_leave(target);
 }
 
 void muj_phase1_value(muj_source source, muj_compressed_json target)
@@ -514,9 +1193,40 @@ void muj_phase1_value(muj_source source, muj_compressed_json target)
 	}
 }
 
+#ifdef MUJSON_INSTRUMENT
+// Everything is derived from the positions before and after, so the per byte code stays the same
+static void muj_count_phase1(muj_source source, muj_compressed_json target, double start_time, size_t start_write_pos)
+{
+	muj_stats* stats = target.stats;
+	if (!stats)
+		return;
+#if !defined(MUJSON_MANUAL_STREAM) || defined(MUJSON_MANUAL_STREAM_POSITIONS)
+	long end = muj_tell_source(source);
+	if (muj_phase1_start >= 0 && end >= muj_phase1_start)
+		stats->phase1_bytes_read += (size_t)(end - muj_phase1_start);
+#else
+	MUJ_UNUSED(source);
+#endif
+	stats->phase1_bytes_written += *target.json_write_pos - start_write_pos;
+	if (stats->clock)
+		stats->phase1_seconds += muj_stats_clock(stats) - start_time;
+}
+#endif
+
 void muj_phase1(muj_source source, muj_compressed_json target)
 {
+	muj_current_phase = 1;
+#if !defined(MUJSON_MANUAL_STREAM) || defined(MUJSON_MANUAL_STREAM_POSITIONS)
+	muj_phase1_source = source;
+	muj_phase1_start = muj_tell_source(source);
+#endif
+#ifdef MUJSON_INSTRUMENT
+	double start_time = muj_stats_clock(target.stats);
+	size_t start_write_pos = *target.json_write_pos;
+#endif
 #ifndef MUJSON_NO_SETJMP
+	if (target.shape_cache)
+		target.shape_cache->depth = 0;
 	if (!setjmp(problem_jmp_buf))
 	{
 		muj_increase_table_size(target);
@@ -524,35 +1234,56 @@ void muj_phase1(muj_source source, muj_compressed_json target)
 		muj_phase1_value(source, target);
 	}
 #else
+	if (target.shape_cache)
+		target.shape_cache->depth = 0;
 	muj_increase_table_size(target);
 	skip_whitespace(source);
 	muj_phase1_value(source, target);
 #endif
+#ifdef MUJSON_INSTRUMENT
+	muj_count_phase1(source, target, start_time, start_write_pos);
+#endif
 }
 
 muj_document_table muj_allocate_document_table(muj_compressed_json what_for)
 {
 	size_t indices = *what_for.table_size;
+	size_t escape_free_size = (indices/2 + 7)/8;
+	size_t container_sizes_size = what_for.record_container_sizes ? indices * sizeof(MUJ_INDEX) : 0;
+	size_t type_tags_size = what_for.record_type_tags ? (indices/2 + 1)/2 : 0;
 	muj_document_table out;
 #ifdef MUJSON_SINGLE_MALLOC
-	size_t malloc_size = indices * sizeof(MUJ_INDEX) + sizeof(size_t);
-	out.table = (uint32_t*)MUJSON_MALLOC(malloc_size);
+	size_t malloc_size = indices * sizeof(MUJ_INDEX) + container_sizes_size + escape_free_size + type_tags_size + sizeof(size_t);
+	out.table = (uint32_t*)muj_alloc_buffer(malloc_size);
+	out.container_sizes = container_sizes_size ? out.table + indices : NULL;
+	out.escape_free = (unsigned char*)out.table + indices * sizeof(MUJ_INDEX) + container_sizes_size;
+	out.type_tags = type_tags_size ? out.escape_free + escape_free_size : NULL;
 	out.current_write_pos = (size_t*)((char*)out.table + malloc_size - (long)sizeof(size_t));
 #else
 	size_t malloc_size = indices * sizeof(MUJ_INDEX);
-	out.table = MUJSON_MALLOC(malloc_size);
+	out.table = muj_alloc_buffer(malloc_size);
+	out.container_sizes = container_sizes_size ? MUJSON_MALLOC(container_sizes_size) : NULL;
+	out.escape_free = MUJSON_MALLOC(escape_free_size);
+	out.type_tags = type_tags_size ? MUJSON_MALLOC(type_tags_size) : NULL;
 	out.current_write_pos = MUJSON_MALLOC(sizeof(size_t));
 #endif
 	out.table_size_in_indices = out.table!=0?indices:0;
 	if (out.current_write_pos)
 		*out.current_write_pos = 0;
+	if (out.table)
+		memset(out.escape_free, 0, escape_free_size);
+	if (out.table && out.type_tags)
+		memset(out.type_tags, 0, type_tags_size);
 	return out;
 }
 
 void muj_free_document_table(muj_document_table table)
 {
-	MUJSON_FREE(table.table);
+	muj_free_buffer(table.table);
 #ifndef MUJSON_SINGLE_MALLOC
+	MUJSON_FREE(table.container_sizes);
+	MUJSON_FREE(table.escape_free);
+	MUJSON_FREE(table.type_tags);
 	MUJSON_FREE(table.current_write_pos);
 #endif
 }
@@ -562,9 +1293,7 @@ MUJ_INDEX muj_push_index_to_table(muj_document_table table, MUJ_INDEX index)
 	MUJ_INDEX pos = (MUJ_INDEX)(*table.current_write_pos);
 	if (pos >= table.table_size_in_indices)
 	{
-		printf("Table size: %d\n", (int)table.table_size_in_indices);
-		printf("Write attempt: %d\n", (int)(*table.current_write_pos));
-		MUJ_PROBLEM("Table not large enough.\n");
+		MUJ_PROBLEM(MUJ_ERROR_TABLE_TOO_SMALL, "Table not large enough.\n");
 		POST_PROBLEM_IMPLIED(return pos);
 	}
 	else
@@ -584,9 +1313,7 @@ void muj_replace_index_in_table(muj_document_table table, MUJ_INDEX pos_in_table
 {
 	if (pos_in_table >= table.table_size_in_indices)
 	{
-		printf("Table size: %d\n", (int)table.table_size_in_indices);
-		printf("Write attempt: %d\n", (int)(*table.current_write_pos));
-		MUJ_PROBLEM("Table not large enough.\n");
+		MUJ_PROBLEM(MUJ_ERROR_TABLE_TOO_SMALL, "Table not large enough.\n");
 	}
 	else
 	{
@@ -598,9 +1325,7 @@ char peek_json_byte(muj_compressed_json json)
 {
 	if ((*json.json_read_pos) >= json.json_max_size)
 	{
-		printf("Compressed JSON size: %d\n", (int)json.json_max_size);
-		printf("Peek attempt: %d\n", (int)(*json.json_read_pos));
-		MUJ_PROBLEM("Peek would cause a segfault.\n");
+		MUJ_PROBLEM_AT(MUJ_ERROR_OUT_OF_BOUNDS, *json.json_read_pos, -1, -1, "Peek would cause a segfault.\n");
 		POST_PROBLEM_IMPLIED(return 0);
 	}
 	else
@@ -613,9 +1338,7 @@ char read_json_byte(muj_compressed_json json)
 {
 	if ((*json.json_read_pos) >= json.json_max_size)
 	{
-		printf("Compressed JSON size: %d\n", (int)json.json_max_size);
-		printf("Read attempt: %d\n", (int)(*json.json_read_pos));
-		MUJ_PROBLEM("Read would cause a segfault.\n");
+		MUJ_PROBLEM_AT(MUJ_ERROR_OUT_OF_BOUNDS, *json.json_read_pos, -1, -1, "Read would cause a segfault.\n");
 		POST_PROBLEM_IMPLIED(return 0);
 	}
 	else
@@ -631,8 +1354,10 @@ void muj_phase2_value_constant(muj_document document)
 	read_json_byte(document.json);
 }
 
+// The string was just pushed to the table, so it is the last table entry
 void muj_phase2_skip_string(muj_document document)
 {
+	bool escape_free = true;
 	read_json_byte(document.json);
     for(;;)
 	{
@@ -641,9 +1366,15 @@ void muj_phase2_skip_string(muj_document document)
 			break;
 		else if (byte == '\\')
 		{
+			escape_free = false;
 			read_json_byte(document.json);
 		}
 	}
+	if (escape_free)
+	{
+		size_t entry = (*document.table.current_write_pos)/2 - 1;
+		document.table.escape_free[entry/8] |= (unsigned char)(1u << (entry%8));
+	}
 }
 
 void muj_phase2_skip_number(muj_document document)
@@ -675,8 +1406,19 @@ void muj_phase2_key(muj_document document)
 
 void muj_phase2_value(muj_document document);
 
+// The container's own entry was pushed by the caller, its children have been pushed since
+static void muj_phase2_record_size(muj_document document, MUJ_INDEX container, size_t count)
+{
+	if (!document.table.container_sizes)
+		return;
+	document.table.container_sizes[container] = (MUJ_INDEX)count;
+	document.table.container_sizes[container+1] = (MUJ_INDEX)*document.table.current_write_pos;
+}
+
 void muj_phase2_value_object(muj_document document)
 {
+	MUJ_INDEX object = (MUJ_INDEX)(*document.table.current_write_pos - 2);
+	size_t count = 0;
 	read_json_byte(document.json); // {
 	bool in_object = true;
 	while(in_object)
@@ -688,10 +1430,12 @@ void muj_phase2_value_object(muj_document document)
 			{
 				read_json_byte(document.json);
 				in_object = false;
+				muj_phase2_record_size(document, object, count);
 				break;
 			}
 			case '"':
 			{
+				count++;
 				muj_push_current_index_to_table(document);
 				MUJ_INDEX skip_replace_me_after = muj_push_current_index_to_table(document);
 				muj_phase2_key(document);
@@ -708,8 +1452,7 @@ void muj_phase2_value_object(muj_document document)
 			}
 			default:
 			{
-				printf("Unexpected byte: %d\n", (int)byte);
-				MUJ_PROBLEM("Unexpected data in phase 2.\n");
+				MUJ_PROBLEM_AT(MUJ_ERROR_UNEXPECTED_BYTE, *document.json.json_read_pos, '"', (unsigned char)byte, "Unexpected data in phase 2.\n");
 			}
 		}
 	}
@@ -717,6 +1460,8 @@ void muj_phase2_value_object(muj_document document)
 
 void muj_phase2_value_array(muj_document document)
 {
+	MUJ_INDEX array = (MUJ_INDEX)(*document.table.current_write_pos - 2);
+	size_t count = 0;
 	read_json_byte(document.json); // [
 	bool in_array = true;
 	while(in_array)
@@ -726,9 +1471,11 @@ void muj_phase2_value_array(muj_document document)
 		{
 			read_json_byte(document.json);
 			in_array = false;
+			muj_phase2_record_size(document, array, count);
 		}
 		else
 		{
+			count++;
 			muj_push_current_index_to_table(document);
 			MUJ_INDEX skip_replace_me_after = muj_push_current_index_to_table(document);
 			muj_phase2_value(document);
@@ -775,8 +1522,32 @@ void muj_phase2_value(muj_document document)
 	}
 }
 
-void muj_phase2( muj_document document)
+#ifdef MUJSON_INSTRUMENT
+static void muj_count_phase2(muj_document document, double start_time, size_t start_read_pos, size_t start_write_pos)
+{
+	muj_stats* stats = document.json.stats;
+	if (!stats)
+		return;
+	stats->phase2_bytes_read += *document.json.json_read_pos - start_read_pos;
+	stats->phase2_indices_written += *document.table.current_write_pos - start_write_pos;
+	if (stats->clock)
+		stats->phase2_seconds += muj_stats_clock(stats) - start_time;
+}
+#define MUJ_COUNT_PHASE2_BEGIN(document) \
+double start_time = muj_stats_clock(document.json.stats);\
+size_t start_read_pos = *document.json.json_read_pos;\
+size_t start_write_pos = *document.table.current_write_pos
+#define MUJ_COUNT_PHASE2_END(document) muj_count_phase2(document, start_time, start_read_pos, start_write_pos)
+#else
+#define MUJ_COUNT_PHASE2_BEGIN(document)
+#define MUJ_COUNT_PHASE2_END(document)
+#endif
+
+// The original recursive phase 2, kept for comparison. Produces the same table as muj_phase2.
+void muj_phase2_recursive(muj_document document)
 {
+	muj_current_phase = 2;
+	MUJ_COUNT_PHASE2_BEGIN(document);
 #ifndef MUJSON_NO_SETJMP
 	if (!setjmp(problem_jmp_buf))
 	{
@@ -790,6 +1561,256 @@ void muj_phase2( muj_document document)
 	muj_push_current_index_to_table(document);
 	muj_phase2_value(document);
 #endif
+	MUJ_COUNT_PHASE2_END(document);
+}
+
+// Iterative phase 2
+// One loop over the compressed json, dispatching on a byte class. There is no recursion and no separate stack: while a
+// container is open its own skip entry can't be known yet, so it holds the index of the parent container. Bounds are
+// checked once per value instead of per byte; the compressed json is followed by a 0 byte, which stops numbers and
+// shows up as unexpected data when a container isn't closed.
+
+enum
+{
+	MUJ_BYTE_INVALID,
+	MUJ_BYTE_OBJECT,
+	MUJ_BYTE_ARRAY,
+	MUJ_BYTE_END,
+	MUJ_BYTE_STRING,
+	MUJ_BYTE_NUMBER, // sign, every compressed number starts with one
+	MUJ_BYTE_CONSTANT,
+	MUJ_BYTE_DIGIT // rest of a number: digits, '.', 'e' and 'E'
+};
+
+#define _ MUJ_BYTE_INVALID
+#define O MUJ_BYTE_OBJECT
+#define A MUJ_BYTE_ARRAY
+#define E MUJ_BYTE_END
+#define S MUJ_BYTE_STRING
+#define N MUJ_BYTE_NUMBER
+#define C MUJ_BYTE_CONSTANT
+#define D MUJ_BYTE_DIGIT
+static const unsigned char muj_byte_class[256] =
+{
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, S, _, _, _, _, _, _, _, _, N, _, N, D, _,
+	D, D, D, D, D, D, D, D, D, D, _, _, _, _, _, _,
+	_, _, _, _, _, D, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, A, _, E, _, _,
+	_, _, _, _, _, D, C, _, _, _, _, _, _, _, C, _,
+	_, _, _, _, C, _, _, _, _, _, _, O, _, E, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+	_, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+};
+#undef _
+#undef O
+#undef A
+#undef E
+#undef S
+#undef N
+#undef C
+#undef D
+
+#define MUJ_NO_PARENT ((MUJ_INDEX)-1)
+
+static void muj_set_type_tag(unsigned char* tags, MUJ_INDEX index, unsigned tag)
+{
+	size_t entry = index/2;
+	unsigned shift = (unsigned)(entry%2)*4;
+	tags[entry/2] = (unsigned char)((tags[entry/2] & ~(0xFu << shift)) | (tag << shift));
+}
+
+static unsigned muj_constant_type(char byte)
+{
+	return (byte == 'n') ? MUJ_TYPE_NULL : (byte == 't') ? MUJ_TYPE_TRUE : MUJ_TYPE_FALSE;
+}
+
+// Skips the string starting at json[pos] and returns the position after it
+static size_t muj_phase2_string(const char* json, size_t pos, size_t end, muj_document_table table, MUJ_INDEX entry_index)
+{
+	bool escape_free = true;
+	pos++;
+	for(;;)
+	{
+		pos += muj_string_run_length(json+pos, json+end);
+		if (pos >= end)
+		{
+			MUJ_PROBLEM_AT(MUJ_ERROR_EOF, end, '"', -1, "EOF in string parsing.\n");
+			POST_PROBLEM_IMPLIED(return end);
+		}
+		if (json[pos] == '"')
+			break;
+		escape_free = false;
+		pos += 2;
+	}
+	if (escape_free)
+	{
+		size_t entry = entry_index/2;
+		table.escape_free[entry/8] |= (unsigned char)(1u << (entry%8));
+	}
+	return pos+1;
+}
+
+static void muj_phase2_iterative(muj_document document)
+{
+	char* json = document.json.json_target;
+	size_t end = *document.json.json_write_pos;
+	MUJ_INDEX* table = document.table.table;
+	MUJ_INDEX* sizes = document.table.container_sizes;
+	unsigned char* tags = document.table.type_tags;
+	size_t table_size = document.table.table_size_in_indices;
+	size_t write = *document.table.current_write_pos;
+	size_t pos = *document.json.json_read_pos;
+	MUJ_INDEX root = (MUJ_INDEX)write;
+	MUJ_INDEX open = MUJ_NO_PARENT; // innermost open container
+	bool open_is_object = false;
+	bool open_is_empty = false;
+	MUJ_INDEX pending = 0; // skip entry of the last value, set once we know whether a sibling follows
+	size_t depth = 0;
+	
+	json[end] = 0;
+	if (write+2 > table_size)
+	{
+		MUJ_PROBLEM_AT(MUJ_ERROR_TABLE_TOO_SMALL, pos, -1, -1, "Table not large enough.\n");
+		POST_PROBLEM_IMPLIED(return);
+	}
+	table[write] = (MUJ_INDEX)pos;
+	table[write+1] = 0;
+	write += 2;
+	
+	for(;;)
+	{
+		// A value, its table entry was just pushed at write-2
+		MUJ_INDEX value = (MUJ_INDEX)(write-2);
+		switch (muj_byte_class[(unsigned char)json[pos]])
+		{
+			case MUJ_BYTE_OBJECT:
+			case MUJ_BYTE_ARRAY:
+			{
+				if (depth >= MUJSON_MAX_DEPTH)
+				{
+					MUJ_PROBLEM_AT(MUJ_ERROR_MAX_DEPTH, pos, -1, (unsigned char)json[pos], "Maximum depth exceeded in phase 2.\n");
+					POST_PROBLEM_IMPLIED(return);
+				}
+				depth++;
+				open_is_object = (json[pos] == '{');
+				table[value+1] = open;
+				if (sizes)
+					sizes[value] = 0;
+				if (tags)
+					muj_set_type_tag(tags, value, open_is_object ? MUJ_TYPE_OBJECT : MUJ_TYPE_ARRAY);
+				open = value;
+				open_is_empty = true;
+				pos++;
+				break;
+			}
+			case MUJ_BYTE_STRING:
+				if (tags)
+					muj_set_type_tag(tags, value, MUJ_TYPE_STRING);
+				pos = muj_phase2_string(json, pos, end, document.table, value);
+				pending = value+1;
+				break;
+			case MUJ_BYTE_NUMBER:
+				if (tags)
+					muj_set_type_tag(tags, value, MUJ_TYPE_NUMBER);
+				pos++;
+				while (muj_byte_class[(unsigned char)json[pos]] == MUJ_BYTE_DIGIT)
+					pos++;
+				pending = value+1;
+				break;
+			case MUJ_BYTE_CONSTANT:
+				if (tags)
+					muj_set_type_tag(tags, value, muj_constant_type(json[pos]));
+				pos++;
+				pending = value+1;
+				break;
+			default:
+				MUJ_PROBLEM_AT(pos >= end ? MUJ_ERROR_EOF : MUJ_ERROR_UNEXPECTED_BYTE, pos, -1, pos >= end ? -1 : (unsigned char)json[pos], "Unexpected data in phase 2.\n");
+				POST_PROBLEM_IMPLIED(return);
+		}
+		
+		// Close containers until there is a next member
+		for(;;)
+		{
+			if (open == MUJ_NO_PARENT)
+			{
+				table[root+1] = 0;
+				*document.table.current_write_pos = write;
+				*document.json.json_read_pos = pos;
+				return;
+			}
+			if (muj_byte_class[(unsigned char)json[pos]] != MUJ_BYTE_END)
+				break;
+			if (!open_is_empty)
+				table[pending] = 0;
+			else if (tags)
+				muj_set_type_tag(tags, open, (open_is_object ? MUJ_TYPE_OBJECT : MUJ_TYPE_ARRAY) | MUJ_TYPE_EMPTY);
+			if (sizes)
+				sizes[open+1] = (MUJ_INDEX)write;
+			pos++;
+			depth--;
+			pending = open+1;
+			MUJ_INDEX parent = table[open+1];
+			open = parent;
+			open_is_empty = false;
+			if (parent != MUJ_NO_PARENT)
+				open_is_object = (json[table[parent]] == '{');
+		}
+		
+		// Next member of the open container
+		if (!open_is_empty)
+			table[pending] = (MUJ_INDEX)write;
+		open_is_empty = false;
+		if (sizes)
+			sizes[open]++;
+		if (open_is_object)
+		{
+			if (write+4 > table_size)
+			{
+				MUJ_PROBLEM_AT(MUJ_ERROR_TABLE_TOO_SMALL, pos, -1, -1, "Table not large enough.\n");
+				POST_PROBLEM_IMPLIED(return);
+			}
+			if (json[pos] != '"')
+			{
+				MUJ_PROBLEM_AT(pos >= end ? MUJ_ERROR_EOF : MUJ_ERROR_UNEXPECTED_BYTE, pos, '"', pos >= end ? -1 : (unsigned char)json[pos], "Unexpected data in phase 2.\n");
+				POST_PROBLEM_IMPLIED(return);
+			}
+			table[write] = (MUJ_INDEX)pos;
+			table[write+1] = (MUJ_INDEX)(write+2);
+			if (tags)
+				muj_set_type_tag(tags, (MUJ_INDEX)write, MUJ_TYPE_STRING);
+			pos = muj_phase2_string(json, pos, end, document.table, (MUJ_INDEX)write);
+			write += 2;
+		}
+		else if (write+2 > table_size)
+		{
+			MUJ_PROBLEM_AT(MUJ_ERROR_TABLE_TOO_SMALL, pos, -1, -1, "Table not large enough.\n");
+			POST_PROBLEM_IMPLIED(return);
+		}
+		table[write] = (MUJ_INDEX)pos;
+		table[write+1] = 0;
+		write += 2;
+	}
+}
+
+void muj_phase2( muj_document document)
+{
+	muj_current_phase = 2;
+	MUJ_COUNT_PHASE2_BEGIN(document);
+#ifndef MUJSON_NO_SETJMP
+	if (!setjmp(problem_jmp_buf))
+		muj_phase2_iterative(document);
+#else
+	muj_phase2_iterative(document);
+#endif
+	MUJ_COUNT_PHASE2_END(document);
 }
 
 char get_json_identifier(MUJ_INDEX index, muj_document document)
@@ -798,27 +1819,77 @@ char get_json_identifier(MUJ_INDEX index, muj_document document)
 	return document.json.json_target[document.table.table[index]];
 }
 
+static muj_type muj_type_of_identifier(char id)
+{
+	switch (id)
+	{
+		case '{': return MUJ_TYPE_OBJECT;
+		case '[': return MUJ_TYPE_ARRAY;
+		case '"': return MUJ_TYPE_STRING;
+		case '+': case '-': return MUJ_TYPE_NUMBER;
+		case 'n': return MUJ_TYPE_NULL;
+		case 't': return MUJ_TYPE_TRUE;
+		case 'f': return MUJ_TYPE_FALSE;
+		default: return MUJ_TYPE_UNKNOWN;
+	}
+}
+
+static unsigned muj_get_type_tag(MUJ_INDEX index, muj_document_table table)
+{
+	size_t entry = index/2;
+	return (table.type_tags[entry/2] >> ((entry%2)*4)) & 0xFu;
+}
+
+// MUJ_TYPE_UNKNOWN if the table has no tag for index
+static muj_type muj_get_tagged_type(MUJ_INDEX index, muj_document_table table)
+{
+	if (!table.type_tags)
+		return MUJ_TYPE_UNKNOWN;
+	return (muj_type)(muj_get_type_tag(index, table) & ~(unsigned)MUJ_TYPE_EMPTY);
+}
+
+muj_type muj_get_type(MUJ_INDEX index, muj_document document)
+{
+	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type;
+	return muj_type_of_identifier(get_json_identifier(index, document));
+}
+
 bool muj_is_object(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_OBJECT;
 	return (get_json_identifier(index, document) == '{');
 }
 
 bool muj_is_array(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_ARRAY;
 	return (get_json_identifier(index, document) == '[');
 }
 
 bool muj_is_string(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_STRING;
 	return (get_json_identifier(index, document) == '"');
 }
 
 bool muj_is_boolean(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return (type == MUJ_TYPE_TRUE || type == MUJ_TYPE_FALSE);
 	char id = get_json_identifier(index, document);
 	return (id == 't' || id == 'f');
 }
@@ -826,24 +1897,36 @@ bool muj_is_boolean(MUJ_INDEX index, muj_document document)
 bool muj_is_true(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_TRUE;
 	return (get_json_identifier(index, document) == 't');
 }
 
 bool muj_is_false(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_FALSE;
 	return (get_json_identifier(index, document) == 'f');
 }
 
 bool muj_is_null(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_NULL;
 	return (get_json_identifier(index, document) == 'n');
 }
 
 bool muj_is_constant(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type >= MUJ_TYPE_NULL;
 	char id = get_json_identifier(index, document);
 	return (id == 't' || id == 'f' || id == 'n');
 }
@@ -851,6 +1934,9 @@ bool muj_is_constant(MUJ_INDEX index, muj_document document)
 bool muj_is_number(MUJ_INDEX index, muj_document document)
 {
 	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	muj_type type = muj_get_tagged_type(index, document.table);
+	if (type != MUJ_TYPE_UNKNOWN)
+		return type == MUJ_TYPE_NUMBER;
 	char id = get_json_identifier(index, document);
 	return (id == '+' || id == '-');
 }
@@ -858,12 +1944,16 @@ bool muj_is_number(MUJ_INDEX index, muj_document document)
 bool muj_is_object_empty(MUJ_INDEX object, muj_document document)
 {
 	MUJSON_ASSERT(object < document.table.table_size_in_indices);
+	if (muj_get_tagged_type(object, document.table) != MUJ_TYPE_UNKNOWN)
+		return (muj_get_type_tag(object, document.table) & MUJ_TYPE_EMPTY) != 0;
 	return (document.json.json_target[document.table.table[object]+1] == '}');
 }
 
 bool muj_is_array_empty(MUJ_INDEX array, muj_document document)
 {
 	MUJSON_ASSERT(array < document.table.table_size_in_indices);
+	if (muj_get_tagged_type(array, document.table) != MUJ_TYPE_UNKNOWN)
+		return (muj_get_type_tag(array, document.table) & MUJ_TYPE_EMPTY) != 0;
 	return (document.json.json_target[document.table.table[array]+1] == ']');
 }
 
@@ -895,22 +1985,106 @@ MUJ_INDEX array_get_first_child(MUJ_INDEX array, muj_document document)
 	return array+2;
 }
 
-size_t muj_get_string_length_excluding_null(MUJ_INDEX string, muj_document document)
+// Bounded copy, returns the new write position
+static size_t muj_put_bytes(char* target, size_t target_size, size_t pos, const char* bytes, size_t length)
 {
-	MUJSON_ASSERT(string < document.table.table_size_in_indices);
-	MUJSON_ASSERT(muj_is_string(string, document));
-	char* str = (&document.json.json_target[document.table.table[string]])+1;
-	size_t len = 0;
-	while(*str != '"')
+	if (length == 0)
+		return pos;
+	if (pos + length <= target_size)
+		memcpy(&target[pos], bytes, length);
+	else if (pos < target_size)
+		memcpy(&target[pos], bytes, target_size-pos);
+	return pos + length;
+}
+
+static size_t muj_encode_utf8(uint32_t code, char* out)
+{
+	if (code < 0x80)
+	{
+		out[0] = (char)code;
+		return 1;
+	}
+	if (code < 0x800)
+	{
+		out[0] = (char)(0xC0 | (code >> 6));
+		out[1] = (char)(0x80 | (code & 0x3F));
+		return 2;
+	}
+	if (code < 0x10000)
+	{
+		out[0] = (char)(0xE0 | (code >> 12));
+		out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (code & 0x3F));
+		return 3;
+	}
+	out[0] = (char)(0xF0 | (code >> 18));
+	out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (code & 0x3F));
+	return 4;
+}
+
+// Decodes the escape at str (the backslash) into out (at most 4 bytes of UTF-8). Returns the number of bytes read.
+// An isolated surrogate becomes U+FFFD, a malformed \u escape decodes to 'u' as before.
+static size_t muj_decode_escape(const char* str, char* out, size_t* length)
+{
+	*length = 1;
+	switch(str[1])
 	{
-		if (*str == '\\')
+		case 'b': out[0] = '\b'; return 2;
+		case 'f': out[0] = '\f'; return 2;
+		case 'n': out[0] = '\n'; return 2;
+		case 'r': out[0] = '\r'; return 2;
+		case 't': out[0] = '\t'; return 2;
+		case 'u':
 		{
-			str++;
+			uint32_t code;
+			size_t read = muj_decode_unicode_escape(str, &code);
+			if (read == 0)
+				break;
+			if (muj_is_high_surrogate(code) || muj_is_low_surrogate(code))
+				code = 0xFFFD;
+			*length = muj_encode_utf8(code, out);
+			return read;
 		}
-		len++;
-		str++;
+		default:
+			break;
+	}
+	out[0] = str[1];
+	return 2;
+}
+
+static const char* muj_get_string_contents(MUJ_INDEX string, muj_document document, const char** limit)
+{
+	*limit = document.json.json_target + *document.json.json_write_pos;
+	return (&document.json.json_target[document.table.table[string]])+1;
+}
+
+// Decodes the string contents at str, writing at most target_size bytes. Returns the decoded length.
+static size_t muj_decode_string(char* target, size_t target_size, const char* str, const char* limit)
+{
+	size_t pos = 0;
+	for(;;)
+	{
+		size_t run = muj_string_run_length(str, limit);
+		pos = muj_put_bytes(target, target_size, pos, str, run);
+		str += run;
+		if (str >= limit || *str == '"')
+			return pos;
+		char decoded[4];
+		size_t length;
+		str += muj_decode_escape(str, decoded, &length);
+		pos = muj_put_bytes(target, target_size, pos, decoded, length);
 	}
-	return len;
+}
+
+size_t muj_get_string_length_excluding_null(MUJ_INDEX string, muj_document document)
+{
+	MUJSON_ASSERT(string < document.table.table_size_in_indices);
+	MUJSON_ASSERT(muj_is_string(string, document));
+	const char* limit;
+	const char* str = muj_get_string_contents(string, document, &limit);
+	return muj_decode_string(NULL, 0, str, limit);
 }
 
 size_t muj_get_string_length(MUJ_INDEX string, muj_document document)
@@ -924,60 +2098,154 @@ void muj_copy_string(char* target, MUJ_INDEX string, muj_document document)
 	MUJSON_ASSERT(target);
 	MUJSON_ASSERT(muj_is_string(string, document));
 	
-	char* str = (&document.json.json_target[document.table.table[string]])+1;
-	while(*str != '"')
-	{
-		if (*str == '\\')
-		{
-			str++;
-		}
-		*target = *str;
-		str++;
-		target++;
-	}
+	const char* limit;
+	const char* str = muj_get_string_contents(string, document, &limit);
+	size_t length = muj_decode_string(target, SIZE_MAX, str, limit);
+	MUJ_COUNT(document.json.stats, string_copies, 1);
+	MUJ_COUNT(document.json.stats, string_bytes_copied, length);
+	MUJ_UNUSED(length);
 }
 
-bool muj_compare_string(MUJ_INDEX string_in_document, char* comparison, muj_document document)
+bool muj_compare_string(MUJ_INDEX string_in_document, const char* comparison, muj_document document)
 {
 	MUJSON_ASSERT(string_in_document < document.table.table_size_in_indices);
 	MUJSON_ASSERT(comparison);
 	MUJSON_ASSERT(muj_is_string(string_in_document, document));
 	
-	char* str = (&document.json.json_target[document.table.table[string_in_document]])+1;
-	while(*str != '"')
+	const char* limit;
+	const char* str = muj_get_string_contents(string_in_document, document, &limit);
+	for(;;)
 	{
-		if (*str == '\\')
+		size_t run = muj_string_run_length(str, limit);
+		if (strncmp(comparison, str, run) != 0) // also stops at the end of comparison
+			return false;
+		str += run;
+		comparison += run;
+		if (str >= limit || *str == '"')
+			break;
+		char decoded[4];
+		size_t length;
+		str += muj_decode_escape(str, decoded, &length);
+		for( size_t i=0; i<length; i++)
 		{
-			str++;
+			if (comparison[i] == 0 || comparison[i] != decoded[i])
+				return false;
 		}
-		if ( *comparison != *str)
-			return false;
-		str++;
-		comparison++;
+		comparison += length;
 	}
-	return true;
+	return (*comparison == 0); // "na" is not "name"
 }
 
-size_t muj_get_reparsed_number_length_including_null(MUJ_INDEX number, muj_document document)
+// String views and arena
+
+void muj_init_stats(muj_stats* stats)
 {
-	MUJSON_ASSERT(number < document.table.table_size_in_indices);
-	MUJSON_ASSERT(muj_is_number(number, document));
-	char* str = (&document.json.json_target[document.table.table[number]]);
-    for( int l=0;; l++)
+	memset(stats, 0, sizeof(muj_stats));
+}
+
+void muj_init_shape_cache(muj_shape_cache* cache)
+{
+	memset(cache, 0, sizeof(muj_shape_cache));
+}
+
+void muj_init_arena(muj_arena* arena, size_t block_size)
+{
+	arena->current = NULL;
+	arena->block_size = block_size;
+}
+
+void muj_free_arena(muj_arena* arena)
+{
+	while (arena->current)
 	{
-		if (!isByteNumber(str[l], l==0))
-			return l + 2; // 1 for expansion of 'e' and 1 for \0
+		muj_arena_block* previous = arena->current->previous;
+		MUJSON_FREE(arena->current);
+		arena->current = previous;
 	}
 }
 
-void muj_reparse_number(char* target, char* str)
+void muj_reset_arena(muj_arena* arena)
 {
-    for(int i=0;; i++)
+	if (!arena->current)
+		return;
+	muj_arena_block* keep = arena->current;
+	arena->current = keep->previous;
+	muj_free_arena(arena);
+	keep->previous = NULL;
+	keep->used = 0;
+	arena->current = keep;
+}
+
+char* muj_arena_alloc(muj_arena* arena, size_t size)
+{
+	muj_arena_block* block = arena->current;
+	if (!block || block->size - block->used < size)
 	{
-		char byte = str[i];
-		if (isByteNumber(byte, i == 0))
-		{
-			if (isByteExponent(byte))
+		size_t block_size = (size > arena->block_size) ? size : arena->block_size;
+		block = (muj_arena_block*)MUJSON_MALLOC(sizeof(muj_arena_block) + block_size);
+		if (!block)
+			return NULL;
+		block->previous = arena->current;
+		block->size = block_size;
+		block->used = 0;
+		arena->current = block;
+	}
+	char* out = (char*)(block+1) + block->used;
+	block->used += size;
+	return out;
+}
+
+bool muj_is_string_escape_free(MUJ_INDEX string, muj_document document)
+{
+	MUJSON_ASSERT(string < document.table.table_size_in_indices);
+	size_t entry = string/2;
+	return (document.table.escape_free[entry/8] >> (entry%8)) & 1;
+}
+
+muj_string_view muj_get_string_view(MUJ_INDEX string, muj_document document, muj_arena* arena)
+{
+	MUJSON_ASSERT(muj_is_string(string, document));
+	muj_string_view out;
+	const char* limit;
+	const char* str = muj_get_string_contents(string, document, &limit);
+	if (muj_is_string_escape_free(string, document))
+	{
+		out.data = str;
+		out.length = muj_string_run_length(str, limit);
+		return out;
+	}
+	out.length = muj_decode_string(NULL, 0, str, limit);
+	char* decoded = arena ? muj_arena_alloc(arena, out.length) : NULL;
+	if (decoded)
+	{
+		muj_decode_string(decoded, out.length, str, limit);
+		MUJ_COUNT(document.json.stats, string_copies, 1);
+		MUJ_COUNT(document.json.stats, string_bytes_copied, out.length);
+	}
+	out.data = decoded;
+	return out;
+}
+
+size_t muj_get_reparsed_number_length_including_null(MUJ_INDEX number, muj_document document)
+{
+	MUJSON_ASSERT(number < document.table.table_size_in_indices);
+	MUJSON_ASSERT(muj_is_number(number, document));
+	char* str = (&document.json.json_target[document.table.table[number]]);
+    for( int l=0;; l++)
+	{
+		if (!isByteNumber(str[l], l==0))
+			return l + 2; // 1 for expansion of 'e' and 1 for \0
+	}
+}
+
+void muj_reparse_number(char* target, char* str)
+{
+    for(int i=0;; i++)
+	{
+		char byte = str[i];
+		if (isByteNumber(byte, i == 0))
+		{
+			if (isByteExponent(byte))
 			{
 				*target = 'e';
 				target++;
@@ -994,17 +2262,22 @@ void muj_reparse_number(char* target, char* str)
 	}
 }
 
+#define MUJ_NUMBER_BUFFER_SIZE 64 // numbers that fit are reparsed on the stack
+
 long muj_get_long(MUJ_INDEX number, muj_document document)
 {
 	MUJSON_ASSERT(number < document.table.table_size_in_indices); 
 	MUJSON_ASSERT(muj_is_number(number, document)); 
+	MUJ_COUNT(document.json.stats, number_parses, 1);
 	size_t number_length = muj_get_reparsed_number_length_including_null(number, document); 
-	char* number_string = (char*)malloc(number_length);
+	char buffer[MUJ_NUMBER_BUFFER_SIZE];
+	char* number_string = (number_length <= sizeof(buffer)) ? buffer : (char*)malloc(number_length);
 	number_string[number_length-1] = 0; number_string[number_length-2] = 0; 
 	char* str = (&document.json.json_target[document.table.table[number]]); 
 	muj_reparse_number(number_string, str);
 	long out = strtol(number_string, NULL, 10);
-	free(number_string);
+	if (number_string != buffer)
+		free(number_string);
 	return out;
 }
 
@@ -1012,22 +2285,46 @@ double muj_get_double(MUJ_INDEX number, muj_document document)
 {
 	MUJSON_ASSERT(number < document.table.table_size_in_indices); 
 	MUJSON_ASSERT(muj_is_number(number, document)); 
+	MUJ_COUNT(document.json.stats, number_parses, 1);
 	size_t number_length = muj_get_reparsed_number_length_including_null(number, document); 
-	char* number_string = (char*)malloc(number_length);
+	char buffer[MUJ_NUMBER_BUFFER_SIZE];
+	char* number_string = (number_length <= sizeof(buffer)) ? buffer : (char*)malloc(number_length);
 	number_string[number_length-1] = 0; number_string[number_length-2] = 0; 
 	char* str = (&document.json.json_target[document.table.table[number]]); 
 	muj_reparse_number(number_string, str);
 	double out = strtod(number_string, NULL);
-	free(number_string);
+	if (number_string != buffer)
+		free(number_string);
 	return out;
 }
 
-MUJ_INDEX muj_find_value_of_key_in_object(MUJ_INDEX object, char* key, muj_document document)
+bool muj_get_int64(MUJ_INDEX number, muj_document document, int64_t* out)
+{
+	MUJSON_ASSERT(number < document.table.table_size_in_indices);
+	MUJSON_ASSERT(muj_is_number(number, document));
+	MUJ_COUNT(document.json.stats, number_parses, 1);
+	const char* str = &document.json.json_target[document.table.table[number]];
+	bool negative = (*str == '-');
+	uint64_t value = 0;
+	for( str++; isByteDigit(*str); str++)
+	{
+		if (value > (UINT64_MAX - 9)/10)
+			return false;
+		value = value*10 + (uint64_t)(*str - '0');
+	}
+	if (isByteNumber(*str, false) || value > (uint64_t)INT64_MAX + (negative?1:0))
+		return false; // fraction, exponent or out of range
+	*out = negative ? (int64_t)(0 - value) : (int64_t)value;
+	return true;
+}
+
+MUJ_INDEX muj_find_value_of_key_in_object(MUJ_INDEX object, const char* key, muj_document document)
 {
     MUJ_INDEX child;
 
 	MUJSON_ASSERT(object < document.table.table_size_in_indices);
 	MUJSON_ASSERT(muj_is_object(object, document));
+	MUJ_COUNT(document.json.stats, lookups, 1);
 	if (muj_is_object_empty(object, document))
 		return 0;
 
@@ -1044,6 +2341,7 @@ MUJ_INDEX muj_find_value_of_key_in_object(MUJ_INDEX object, char* key, muj_docum
 		if (skip_end(child+1, document.table))
 			return 0;
 		child = get_skip(child+1, document.table); // key
+		MUJ_COUNT(document.json.stats, lookup_hops, 1);
 		
 		if (muj_compare_string(child, key, document))
 		{
@@ -1061,6 +2359,8 @@ size_t muj_object_count_number_of_children(MUJ_INDEX object, muj_document docume
 
 	MUJSON_ASSERT(object < document.table.table_size_in_indices);
 	MUJSON_ASSERT(muj_is_object(object, document));
+	if (document.table.container_sizes)
+		return document.table.container_sizes[object];
 	if (muj_is_object_empty(object, document))
 		return 0;
     child = object_get_first_child(object, document);
@@ -1070,6 +2370,7 @@ size_t muj_object_count_number_of_children(MUJ_INDEX object, muj_document docume
 		child = get_skip(child+1, document.table);
 		numChildren++;
 	}
+	MUJ_COUNT(document.json.stats, lookup_hops, numChildren-1);
 	MUJSON_ASSERT((numChildren & 1) == 0);
 	return numChildren/2;
 }
@@ -1080,6 +2381,8 @@ size_t muj_array_count_number_of_elements(MUJ_INDEX array, muj_document document
 
 	MUJSON_ASSERT(array < document.table.table_size_in_indices);
 	MUJSON_ASSERT(muj_is_array(array, document));
+	if (document.table.container_sizes)
+		return document.table.container_sizes[array];
 	if (muj_is_array_empty(array, document))
 		return 0;
     child = array_get_first_child(array, document);
@@ -1089,9 +2392,44 @@ size_t muj_array_count_number_of_elements(MUJ_INDEX array, muj_document document
 		child = get_skip(child+1, document.table);
 		numChildren++;
 	}
+	MUJ_COUNT(document.json.stats, lookup_hops, numChildren-1);
 	return numChildren;
 }
 
+MUJ_INDEX muj_get_subtree_end(MUJ_INDEX value, muj_document document)
+{
+	MUJSON_ASSERT(value < document.table.table_size_in_indices);
+	const MUJ_INDEX* table = document.table.table;
+	if (document.table.container_sizes && (muj_is_object(value, document) || muj_is_array(value, document)))
+		return document.table.container_sizes[value+1];
+	// The next sibling starts right after, without one follow the last children down
+	for(;;)
+	{
+		if (table[value+1] != 0)
+			return table[value+1];
+		if (muj_is_object(value, document))
+		{
+			if (muj_is_object_empty(value, document))
+				return value+2;
+			MUJ_INDEX key = value+2;
+			while (table[key+3] != 0)
+				key = table[key+3];
+			value = key+2;
+		}
+		else if (muj_is_array(value, document))
+		{
+			if (muj_is_array_empty(value, document))
+				return value+2;
+			MUJ_INDEX element = value+2;
+			while (table[element+1] != 0)
+				element = table[element+1];
+			value = element;
+		}
+		else
+			return value+2;
+	}
+}
+
 MUJ_INDEX muj_get_element_from_array(MUJ_INDEX array, size_t index, muj_document document)
 {
     MUJ_INDEX child;
@@ -1099,6 +2437,7 @@ MUJ_INDEX muj_get_element_from_array(MUJ_INDEX array, size_t index, muj_document
 
 	MUJSON_ASSERT(array < document.table.table_size_in_indices);
 	MUJSON_ASSERT(muj_is_array(array, document));
+	MUJ_COUNT(document.json.stats, lookups, 1);
 	if (muj_is_array_empty(array, document))
 		return 0;
     child = array_get_first_child(array, document);
@@ -1108,6 +2447,7 @@ MUJ_INDEX muj_get_element_from_array(MUJ_INDEX array, size_t index, muj_document
 	while(!skip_end(child+1, document.table))
 	{
 		child = get_skip(child+1, document.table);
+		MUJ_COUNT(document.json.stats, lookup_hops, 1);
 		if (current == index)
 			return child;
 		current++;
@@ -1164,7 +2504,7 @@ MUJ_INDEX muj_get_root_object(muj_document_table table)
 char* muj_alloc_string_copy_target(MUJ_INDEX string, muj_document document)
 {
     size_t s = muj_get_string_length(string, document);
-    char* out = MUJSON_MALLOC(s);
+    char* out = (char*)MUJSON_MALLOC(s);
     out[s-1] = 0;
     return out;
 }
@@ -1182,6 +2522,3264 @@ void muj_free_string_copy_target(char* string)
     MUJSON_FREE(string);
 }
 
+// Minified output
+// The compressed json is standard json minus the separators, with a sign in front of every number,
+// the exponent sign folded into 'e' (negative) or 'E' (positive) and constants reduced to their first byte.
+// That means it can be turned back into minified json with a single linear scan. The only state needed
+// is whether the current nesting level is an object (one bit per level) and whether the last string was a key.
+
+#define MUJ_MINIFY_LOCAL_LEVELS 512
+
+typedef struct
+{
+	unsigned char* object_bits; // bit set: level is an object
+	unsigned char local_bits[MUJ_MINIFY_LOCAL_LEVELS/8];
+	size_t depth;
+	size_t max_depth;
+	size_t array_levels;
+	size_t strip_array_levels;
+	bool after_key;
+	bool need_separator;
+	bool strip_null_members; // merge patch values: drop object members that are null, except inside arrays
+	bool failed;
+} muj_minify_state;
+
+static void muj_minify_begin(muj_minify_state* state)
+{
+	state->object_bits = state->local_bits;
+	state->depth = 0;
+	state->max_depth = MUJ_MINIFY_LOCAL_LEVELS;
+	state->array_levels = 0;
+	state->strip_array_levels = 0;
+	state->after_key = false;
+	state->need_separator = false;
+	state->strip_null_members = false;
+	state->failed = false;
+}
+
+static void muj_minify_end(muj_minify_state* state)
+{
+	if (state->object_bits != state->local_bits)
+		MUJSON_FREE(state->object_bits);
+}
+
+static bool muj_minify_in_object(muj_minify_state* state)
+{
+	if (state->depth == 0)
+		return false;
+	size_t level = state->depth-1;
+	return (state->object_bits[level/8] >> (level%8)) & 1;
+}
+
+static void muj_minify_push_level(muj_minify_state* state, bool is_object)
+{
+	if (state->depth == state->max_depth)
+	{
+		unsigned char* bits = (unsigned char*)MUJSON_MALLOC(state->max_depth/4);
+		if (!bits)
+		{
+			state->failed = true;
+			return;
+		}
+		memcpy(bits, state->object_bits, state->max_depth/8);
+		if (state->object_bits != state->local_bits)
+			MUJSON_FREE(state->object_bits);
+		state->object_bits = bits;
+		state->max_depth *= 2;
+	}
+	size_t level = state->depth++;
+	if (is_object)
+		state->object_bits[level/8] |= (unsigned char)(1u << (level%8));
+	else
+	{
+		state->object_bits[level/8] &= (unsigned char)~(1u << (level%8));
+		state->array_levels++;
+	}
+}
+
+static void muj_minify_pop_level(muj_minify_state* state)
+{
+	if (state->depth == 0)
+		return;
+	if (!muj_minify_in_object(state))
+		state->array_levels--;
+	state->depth--;
+}
+
+// Offset one past the closing quote of the string starting at json[begin]
+static size_t muj_skip_compressed_string(const char* json, size_t begin, size_t end)
+{
+	size_t i = begin+1;
+	while (i < end && json[i] != '"')
+		i += (json[i] == '\\')?2:1;
+	return i+1;
+}
+
+// True if the string at json[begin] is a key of a null member that should be stripped
+static bool muj_minify_is_stripped_key(muj_minify_state* state, const char* json, size_t begin, size_t end)
+{
+	if (!state->strip_null_members || state->array_levels != state->strip_array_levels)
+		return false;
+	size_t key_end = muj_skip_compressed_string(json, begin, end);
+	return (key_end < end && json[key_end] == 'n');
+}
+
+#define MUJ_MINIFY_PUT(byte) do { if (pos < target_size) target[pos] = (byte); pos++; } while(0)
+
+// Minifies json[begin, end) and returns the new write position. Writes stop at target_size but the position keeps counting.
+static size_t muj_minify_range(muj_minify_state* state, char* target, size_t target_size, size_t pos, const char* json, size_t begin, size_t end)
+{
+	size_t i = begin;
+	while (i < end && !state->failed)
+	{
+		char byte = json[i++];
+
+		if (byte == '}' || byte == ']')
+		{
+			muj_minify_pop_level(state);
+			MUJ_MINIFY_PUT(byte);
+			state->need_separator = true;
+			state->after_key = false;
+			continue;
+		}
+
+		bool is_key = (byte == '"' && !state->after_key && muj_minify_in_object(state));
+		if (is_key && muj_minify_is_stripped_key(state, json, i-1, end))
+		{
+			i = muj_skip_compressed_string(json, i-1, end) + 1; // key and the 'n'
+			continue;
+		}
+		if (state->need_separator)
+			MUJ_MINIFY_PUT(state->after_key ? ':' : ',');
+		state->after_key = is_key;
+		state->need_separator = true;
+
+		switch(byte)
+		{
+			case '{': case '[':
+			{
+				MUJ_MINIFY_PUT(byte);
+				muj_minify_push_level(state, byte == '{');
+				state->need_separator = false;
+				break;
+			}
+			case '"':
+			{
+				MUJ_MINIFY_PUT('"');
+				for(;;)
+				{
+					size_t run = i;
+					while (i < end && json[i] != '"' && json[i] != '\\')
+						i++;
+					pos = muj_put_bytes(target, target_size, pos, &json[run], i-run);
+					if (i >= end)
+						break;
+					byte = json[i++];
+					MUJ_MINIFY_PUT(byte);
+					if (byte == '"')
+						break;
+					if (i < end)
+					{
+						byte = json[i++]; // escaped byte
+						MUJ_MINIFY_PUT(byte);
+					}
+				}
+				break;
+			}
+			case 'n':
+				MUJ_MINIFY_PUT('n'); MUJ_MINIFY_PUT('u'); MUJ_MINIFY_PUT('l'); MUJ_MINIFY_PUT('l');
+				break;
+			case 't':
+				MUJ_MINIFY_PUT('t'); MUJ_MINIFY_PUT('r'); MUJ_MINIFY_PUT('u'); MUJ_MINIFY_PUT('e');
+				break;
+			case 'f':
+				MUJ_MINIFY_PUT('f'); MUJ_MINIFY_PUT('a'); MUJ_MINIFY_PUT('l'); MUJ_MINIFY_PUT('s'); MUJ_MINIFY_PUT('e');
+				break;
+			default:
+			{
+				if (byte == '-')
+					MUJ_MINIFY_PUT('-');
+				else if (byte != '+')
+				{
+					if (!isByteNumber(byte, false))
+						break; // not a value, shouldn't happen in phase 1 output
+					i--;
+				}
+				while (i < end && isByteNumber(json[i], false))
+				{
+					byte = json[i++];
+					if (byte == 'e')
+					{
+						MUJ_MINIFY_PUT('e');
+						MUJ_MINIFY_PUT('-');
+					}
+					else if (byte == 'E')
+						MUJ_MINIFY_PUT('e');
+					else
+						MUJ_MINIFY_PUT(byte);
+				}
+				break;
+			}
+		}
+	}
+	return pos;
+}
+
+size_t muj_write_minified(char* target, size_t target_size, muj_document document)
+{
+	muj_minify_state state;
+	muj_minify_begin(&state);
+	size_t length = muj_minify_range(&state, target, target_size, 0, document.json.json_target, 0, *document.json.json_write_pos);
+	bool failed = state.failed;
+	muj_minify_end(&state);
+	return failed?0:length;
+}
+
+// Returns the offset in the compressed json one past the end of the value (or key)
+size_t get_value_end(MUJ_INDEX index, muj_document document)
+{
+	MUJSON_ASSERT(index < document.table.table_size_in_indices);
+	if (index == 0)
+		return *document.json.json_write_pos;
+	if (!skip_end(index+1, document.table)) // Next sibling (or the value of a key) starts right where this one ends
+		return document.table.table[get_skip(index+1, document.table)];
+
+	const char* json = document.json.json_target;
+	size_t end = *document.json.json_write_pos;
+	size_t i = document.table.table[index];
+	size_t depth = 0;
+	do
+	{
+		char byte = json[i++];
+		switch(byte)
+		{
+			case '{': case '[':
+				depth++;
+				break;
+			case '}': case ']':
+				depth--;
+				break;
+			case '"':
+				i = muj_skip_compressed_string(json, i-1, end);
+				break;
+			case '+': case '-':
+				while (i < end && isByteNumber(json[i], false))
+					i++;
+				break;
+			default: // constants are a single byte
+				break;
+		}
+	} while (depth > 0 && i < end);
+	return i;
+}
+
+// Overlay
+// Edits are kept sorted on the position in the compressed json where they take effect,
+// so writing is a single scan over the original with the edits spliced in.
+
+muj_overlay muj_allocate_overlay(muj_document document, size_t max_edits)
+{
+	muj_overlay out;
+	out.document = document;
+	out.max_edits = 0;
+#ifdef MUJSON_SINGLE_MALLOC
+	size_t malloc_size = max_edits * sizeof(muj_edit) + sizeof(size_t);
+	out.edits = (muj_edit*)MUJSON_MALLOC(malloc_size);
+	out.num_edits = (size_t*)((char*)out.edits + malloc_size - (long)sizeof(size_t));
+#else
+	out.edits = (muj_edit*)MUJSON_MALLOC(max_edits * sizeof(muj_edit));
+	out.num_edits = (size_t*)MUJSON_MALLOC(sizeof(size_t));
+#endif
+	if (out.edits != NULL)
+	{
+		out.max_edits = max_edits;
+		*out.num_edits = 0;
+	}
+	return out;
+}
+
+void muj_free_overlay(muj_overlay overlay)
+{
+	MUJSON_FREE(overlay.edits);
+#ifndef MUJSON_SINGLE_MALLOC
+	MUJSON_FREE(overlay.num_edits);
+#endif
+}
+
+void muj_reset_overlay(muj_overlay overlay)
+{
+	if (overlay.max_edits)
+		*overlay.num_edits = 0;
+}
+
+static bool muj_is_insertion(muj_edit edit)
+{
+	return (edit.begin == edit.end);
+}
+
+static bool muj_overlay_add_edit(muj_overlay overlay, muj_edit edit)
+{
+	if (overlay.max_edits == 0 || *overlay.num_edits >= overlay.max_edits)
+		return false;
+	size_t at = *overlay.num_edits;
+	while (at > 0) // Usually edits arrive in document order
+	{
+		muj_edit previous = overlay.edits[at-1];
+		bool before = (previous.begin > edit.begin) || (previous.begin == edit.begin && muj_is_insertion(edit) && !muj_is_insertion(previous));
+		if (!before)
+			break;
+		overlay.edits[at] = previous;
+		at--;
+	}
+	overlay.edits[at] = edit;
+	(*overlay.num_edits)++;
+	return true;
+}
+
+static bool muj_overlay_add_value_edit(muj_overlay overlay, muj_edit_type type, MUJ_INDEX index, size_t begin, size_t end, const char* value, size_t value_length, muj_value_format value_format)
+{
+	muj_edit edit;
+	edit.type = type;
+	edit.index = index;
+	edit.begin = begin;
+	edit.end = end;
+	edit.key = 0;
+	edit.key_length = 0;
+	edit.value = value;
+	edit.value_length = value_length;
+	edit.value_format = value_format;
+	return muj_overlay_add_edit(overlay, edit);
+}
+
+static bool muj_overlay_set(muj_overlay overlay, MUJ_INDEX value, const char* json, size_t length, muj_value_format format)
+{
+	MUJSON_ASSERT(value < overlay.document.table.table_size_in_indices);
+	size_t begin = overlay.document.table.table[value];
+	return muj_overlay_add_value_edit(overlay, MUJ_EDIT_SET_VALUE, value, begin, get_value_end(value, overlay.document), json, length, format);
+}
+
+static bool muj_overlay_insert(muj_overlay overlay, MUJ_INDEX object, const char* key, size_t key_length, const char* json, size_t length, muj_value_format format)
+{
+	MUJSON_ASSERT(object < overlay.document.table.table_size_in_indices);
+	MUJSON_ASSERT(muj_is_object(object, overlay.document));
+	size_t close = get_value_end(object, overlay.document)-1; // '}'
+	muj_edit edit;
+	edit.type = MUJ_EDIT_INSERT_KEY;
+	edit.index = object;
+	edit.begin = close;
+	edit.end = close;
+	edit.key = key;
+	edit.key_length = key_length;
+	edit.value = json;
+	edit.value_length = length;
+	edit.value_format = format;
+	return muj_overlay_add_edit(overlay, edit);
+}
+
+static bool muj_overlay_delete(muj_overlay overlay, MUJ_INDEX key)
+{
+	MUJSON_ASSERT(key+2 < overlay.document.table.table_size_in_indices);
+	size_t begin = overlay.document.table.table[key];
+	return muj_overlay_add_value_edit(overlay, MUJ_EDIT_DELETE_KEY, key, begin, get_value_end(key+2, overlay.document), 0, 0, MUJ_VALUE_TEXT);
+}
+
+static bool muj_overlay_append(muj_overlay overlay, MUJ_INDEX array, const char* json, size_t length, muj_value_format format)
+{
+	MUJSON_ASSERT(array < overlay.document.table.table_size_in_indices);
+	MUJSON_ASSERT(muj_is_array(array, overlay.document));
+	size_t close = get_value_end(array, overlay.document)-1; // ']'
+	return muj_overlay_add_value_edit(overlay, MUJ_EDIT_APPEND_ELEMENT, array, close, close, json, length, format);
+}
+
+static bool muj_overlay_insert_before(muj_overlay overlay, MUJ_INDEX array, MUJ_INDEX element, const char* json, size_t length, muj_value_format format)
+{
+	MUJSON_ASSERT(element < overlay.document.table.table_size_in_indices);
+	size_t begin = overlay.document.table.table[element];
+	return muj_overlay_add_value_edit(overlay, MUJ_EDIT_INSERT_ELEMENT, array, begin, begin, json, length, format);
+}
+
+static bool muj_overlay_delete_at(muj_overlay overlay, MUJ_INDEX array, MUJ_INDEX element)
+{
+	MUJSON_ASSERT(element < overlay.document.table.table_size_in_indices);
+	size_t begin = overlay.document.table.table[element];
+	return muj_overlay_add_value_edit(overlay, MUJ_EDIT_DELETE_ELEMENT, array, begin, get_value_end(element, overlay.document), 0, 0, MUJ_VALUE_TEXT);
+}
+
+bool muj_overlay_set_value(muj_overlay overlay, MUJ_INDEX value, const char* json)
+{
+	MUJSON_ASSERT(json);
+	return muj_overlay_set(overlay, value, json, strlen(json), MUJ_VALUE_TEXT);
+}
+
+bool muj_overlay_insert_key(muj_overlay overlay, MUJ_INDEX object, const char* key, const char* json)
+{
+	MUJSON_ASSERT(key && json);
+	return muj_overlay_insert(overlay, object, key, strlen(key), json, strlen(json), MUJ_VALUE_TEXT);
+}
+
+bool muj_overlay_delete_key(muj_overlay overlay, MUJ_INDEX object, const char* key)
+{
+	MUJ_INDEX value = muj_find_value_of_key_in_object(object, key, overlay.document);
+	if (value == 0)
+		return false;
+	return muj_overlay_delete(overlay, value-2);
+}
+
+bool muj_overlay_append_element(muj_overlay overlay, MUJ_INDEX array, const char* json)
+{
+	MUJSON_ASSERT(json);
+	return muj_overlay_append(overlay, array, json, strlen(json), MUJ_VALUE_TEXT);
+}
+
+bool muj_overlay_insert_element(muj_overlay overlay, MUJ_INDEX array, size_t before, const char* json)
+{
+	MUJSON_ASSERT(json);
+	MUJ_INDEX element = muj_get_element_from_array(array, before, overlay.document);
+	if (element == 0)
+	{
+		if (before != muj_array_count_number_of_elements(array, overlay.document))
+			return false;
+		return muj_overlay_append(overlay, array, json, strlen(json), MUJ_VALUE_TEXT);
+	}
+	return muj_overlay_insert_before(overlay, array, element, json, strlen(json), MUJ_VALUE_TEXT);
+}
+
+bool muj_overlay_delete_element(muj_overlay overlay, MUJ_INDEX array, size_t at)
+{
+	MUJ_INDEX element = muj_get_element_from_array(array, at, overlay.document);
+	if (element == 0)
+		return false;
+	return muj_overlay_delete_at(overlay, array, element);
+}
+
+// Emits text that is already standard json as a single value (or key) of the current level
+static size_t muj_minify_splice(muj_minify_state* state, char* target, size_t target_size, size_t pos, const char* text, size_t length, bool is_key)
+{
+	if (state->need_separator)
+		MUJ_MINIFY_PUT(state->after_key ? ':' : ',');
+	if (is_key)
+		MUJ_MINIFY_PUT('"');
+	pos = muj_put_bytes(target, target_size, pos, text, length);
+	if (is_key)
+		MUJ_MINIFY_PUT('"');
+	state->after_key = is_key;
+	state->need_separator = true;
+	return pos;
+}
+
+static size_t muj_minify_edit_value(muj_minify_state* state, char* target, size_t target_size, size_t pos, muj_edit edit)
+{
+	switch(edit.value_format)
+	{
+		case MUJ_VALUE_TEXT:
+			return muj_minify_splice(state, target, target_size, pos, edit.value, edit.value_length, false);
+		case MUJ_VALUE_COMPRESSED:
+			return muj_minify_range(state, target, target_size, pos, edit.value, 0, edit.value_length);
+		case MUJ_VALUE_COMPRESSED_WITHOUT_NULLS:
+			state->strip_null_members = true;
+			state->strip_array_levels = state->array_levels;
+			pos = muj_minify_range(state, target, target_size, pos, edit.value, 0, edit.value_length);
+			state->strip_null_members = false;
+			return pos;
+	}
+	return pos;
+}
+
+size_t muj_overlay_write_minified(char* target, size_t target_size, muj_overlay overlay)
+{
+	const char* json = overlay.document.json.json_target;
+	size_t read = 0;
+	size_t pos = 0;
+	muj_minify_state state;
+	muj_minify_begin(&state);
+	for( size_t i=0; i<overlay.max_edits && i<*overlay.num_edits; i++)
+	{
+		muj_edit edit = overlay.edits[i];
+		if (edit.begin < read)
+			continue; // Inside a replaced or deleted value
+		pos = muj_minify_range(&state, target, target_size, pos, json, read, edit.begin);
+		switch(edit.type)
+		{
+			case MUJ_EDIT_INSERT_KEY:
+				pos = muj_minify_splice(&state, target, target_size, pos, edit.key, edit.key_length, true);
+				pos = muj_minify_edit_value(&state, target, target_size, pos, edit);
+				break;
+			case MUJ_EDIT_SET_VALUE:
+			case MUJ_EDIT_APPEND_ELEMENT:
+			case MUJ_EDIT_INSERT_ELEMENT:
+				pos = muj_minify_edit_value(&state, target, target_size, pos, edit);
+				break;
+			case MUJ_EDIT_DELETE_KEY:
+			case MUJ_EDIT_DELETE_ELEMENT:
+				break;
+		}
+		read = edit.end;
+	}
+	pos = muj_minify_range(&state, target, target_size, pos, json, read, *overlay.document.json.json_write_pos);
+	bool failed = state.failed;
+	muj_minify_end(&state);
+	return failed?0:pos;
+}
+
+// Compresses standard json text the same way phase 1 does
+static size_t muj_compress_text(char* target, size_t target_size, size_t pos, const char* text, size_t length)
+{
+	size_t i = 0;
+	while (i < length)
+	{
+		char byte = text[i];
+		if (byte == '"')
+		{
+			size_t end = muj_skip_compressed_string(text, i, length);
+			if (end > length)
+				end = length;
+			pos = muj_put_bytes(target, target_size, pos, &text[i], end-i);
+			i = end;
+		}
+		else if (byte == '{' || byte == '}' || byte == '[' || byte == ']')
+		{
+			MUJ_MINIFY_PUT(byte);
+			i++;
+		}
+		else if (byte == 'n' || byte == 't' || byte == 'f')
+		{
+			MUJ_MINIFY_PUT(byte);
+			i++;
+			while (i < length && text[i] >= 'a' && text[i] <= 'z')
+				i++;
+		}
+		else if (byte == '-' || isByteDigit(byte))
+		{
+			MUJ_MINIFY_PUT(byte == '-' ? '-' : '+');
+			if (byte == '-')
+				i++;
+			while (i < length && isByteNumber(text[i], false))
+			{
+				byte = text[i++];
+				if (!isByteExponent(byte))
+					MUJ_MINIFY_PUT(byte);
+				else if (i < length && text[i] == '-')
+				{
+					MUJ_MINIFY_PUT('e'); // negative
+					i++;
+				}
+				else
+				{
+					MUJ_MINIFY_PUT('E'); // positive
+					if (i < length && text[i] == '+')
+						i++;
+				}
+			}
+		}
+		else
+			i++; // whitespace, ',' and ':'
+	}
+	return pos;
+}
+
+// Copies a compressed value, dropping null object members (outside arrays) for merge patch values
+static size_t muj_copy_compressed_value(char* target, size_t target_size, size_t pos, const char* json, size_t length, bool strip_null_members)
+{
+	if (!strip_null_members)
+		return muj_put_bytes(target, target_size, pos, json, length);
+
+	muj_minify_state state;
+	muj_minify_begin(&state);
+	state.strip_null_members = true;
+	size_t run = 0;
+	size_t i = 0;
+	while (i < length && !state.failed)
+	{
+		char byte = json[i];
+		switch(byte)
+		{
+			case '{': case '[':
+				muj_minify_push_level(&state, byte == '{');
+				state.after_key = false;
+				i++;
+				break;
+			case '}': case ']':
+				muj_minify_pop_level(&state);
+				state.after_key = false;
+				i++;
+				break;
+			case '"':
+			{
+				bool is_key = (!state.after_key && muj_minify_in_object(&state));
+				size_t end = muj_skip_compressed_string(json, i, length);
+				if (is_key && muj_minify_is_stripped_key(&state, json, i, length))
+				{
+					pos = muj_put_bytes(target, target_size, pos, &json[run], i-run);
+					i = end+1;
+					run = i;
+					break;
+				}
+				state.after_key = is_key;
+				i = end;
+				break;
+			}
+			case '+': case '-':
+				i++;
+				while (i < length && isByteNumber(json[i], false))
+					i++;
+				state.after_key = false;
+				break;
+			default:
+				i++;
+				state.after_key = false;
+				break;
+		}
+	}
+	pos = muj_put_bytes(target, target_size, pos, &json[run], length-run);
+	muj_minify_end(&state);
+	return pos;
+}
+
+static size_t muj_compress_edit_value(char* target, size_t target_size, size_t pos, muj_edit edit)
+{
+	if (edit.value_format == MUJ_VALUE_TEXT)
+		return muj_compress_text(target, target_size, pos, edit.value, edit.value_length);
+	return muj_copy_compressed_value(target, target_size, pos, edit.value, edit.value_length, edit.value_format == MUJ_VALUE_COMPRESSED_WITHOUT_NULLS);
+}
+
+// Same as muj_overlay_write_minified, but writes compressed json
+static size_t muj_overlay_write_compressed(char* target, size_t target_size, muj_overlay overlay)
+{
+	const char* json = overlay.document.json.json_target;
+	size_t read = 0;
+	size_t pos = 0;
+	for( size_t i=0; i<overlay.max_edits && i<*overlay.num_edits; i++)
+	{
+		muj_edit edit = overlay.edits[i];
+		if (edit.begin < read)
+			continue;
+		pos = muj_put_bytes(target, target_size, pos, &json[read], edit.begin-read);
+		switch(edit.type)
+		{
+			case MUJ_EDIT_INSERT_KEY:
+				MUJ_MINIFY_PUT('"');
+				pos = muj_put_bytes(target, target_size, pos, edit.key, edit.key_length);
+				MUJ_MINIFY_PUT('"');
+				pos = muj_compress_edit_value(target, target_size, pos, edit);
+				break;
+			case MUJ_EDIT_SET_VALUE:
+			case MUJ_EDIT_APPEND_ELEMENT:
+			case MUJ_EDIT_INSERT_ELEMENT:
+				pos = muj_compress_edit_value(target, target_size, pos, edit);
+				break;
+			case MUJ_EDIT_DELETE_KEY:
+			case MUJ_EDIT_DELETE_ELEMENT:
+				break;
+		}
+		read = edit.end;
+	}
+	return muj_put_bytes(target, target_size, pos, &json[read], *overlay.document.json.json_write_pos-read);
+}
+
+// Table entries compressed json will need: two per value and two per key
+static size_t muj_count_table_size(const char* json, size_t length)
+{
+	size_t size = 0;
+	size_t i = 0;
+	while (i < length)
+	{
+		switch(json[i])
+		{
+			case '}': case ']':
+				i++;
+				break;
+			case '"':
+				size += 2;
+				i = muj_skip_compressed_string(json, i, length);
+				break;
+			case '+': case '-':
+				size += 2;
+				i++;
+				while (i < length && isByteNumber(json[i], false))
+					i++;
+				break;
+			default: // '{', '[' and constants
+				size += 2;
+				i++;
+				break;
+		}
+	}
+	return size;
+}
+
+muj_document muj_overlay_make_document(muj_overlay overlay)
+{
+	muj_document out;
+	memset(&out, 0, sizeof(out));
+	size_t length = muj_overlay_write_compressed(NULL, 0, overlay);
+	muj_compressed_json json = muj_allocate_compressed_json(length);
+	if (json.json_target == NULL)
+		return out;
+	muj_overlay_write_compressed(json.json_target, length, overlay);
+	json.json_target[length] = 0;
+	*json.json_write_pos = length;
+	*json.table_size = muj_count_table_size(json.json_target, length);
+	muj_document_table table = muj_allocate_document_table(json);
+	if (table.table == NULL)
+	{
+		muj_free_compressed_json(json);
+		return out;
+	}
+	out = muj_make_document(json, table);
+	muj_phase2(out);
+	return out;
+}
+
+// Patching (RFC 6902 json patch and RFC 7386 merge patch)
+// Operations become overlay edits on the source document. Array indices are resolved through the edits so far,
+// so a run of adds and removes in one array stays a single batch of edits. When an operation depends on the
+// result of an earlier one in a way the overlay can't express (a path through an added key or element, a value
+// that was already edited), the overlay is first written out as an intermediate document, which then becomes
+// the base for the edits. Values are copied in their compressed form; test compares them structurally.
+
+typedef struct muj_patch_scratch
+{
+	struct muj_patch_scratch* next;
+} muj_patch_scratch;
+
+typedef struct
+{
+	muj_document source;
+	muj_document base; // source or an intermediate document
+	muj_overlay overlay;
+	muj_patch_scratch* scratch; // decoded paths and copied values, freed when done
+	muj_document patch;
+	MUJ_INDEX operand; // the value of the current operation in patch
+} muj_patch_engine;
+
+typedef enum
+{
+	MUJ_PATCH_DONE,
+	MUJ_PATCH_CONFLICT, // depends on the edits so far, retry on a flushed base
+	MUJ_PATCH_FAILED
+} muj_patch_result;
+
+typedef enum
+{
+	MUJ_PATCH_ADD,
+	MUJ_PATCH_REMOVE,
+	MUJ_PATCH_REPLACE,
+	MUJ_PATCH_TEST,
+	MUJ_PATCH_READ
+} muj_patch_step;
+
+typedef struct
+{
+	MUJ_INDEX parent;
+	MUJ_INDEX target; // 0 if it doesn't exist
+	const char* key; // last reference token
+	bool is_root;
+	bool parent_is_array;
+	bool append; // just past the end of the parent array
+} muj_pointer_location;
+
+static char* muj_patch_alloc(muj_patch_engine* engine, size_t size)
+{
+	muj_patch_scratch* scratch = (muj_patch_scratch*)MUJSON_MALLOC(sizeof(muj_patch_scratch) + size);
+	if (!scratch)
+		return NULL;
+	scratch->next = engine->scratch;
+	engine->scratch = scratch;
+	return (char*)(scratch+1);
+}
+
+static bool muj_patch_is_intermediate(muj_patch_engine* engine)
+{
+	return (engine->base.json.json_target != engine->source.json.json_target);
+}
+
+static void muj_patch_free_base(muj_patch_engine* engine)
+{
+	if (muj_patch_is_intermediate(engine))
+	{
+		muj_free_compressed_json(engine->base.json);
+		muj_free_document_table(engine->base.table);
+	}
+}
+
+static void muj_patch_finish(muj_patch_engine* engine)
+{
+	muj_patch_free_base(engine);
+	muj_free_overlay(engine->overlay);
+	while (engine->scratch)
+	{
+		muj_patch_scratch* next = engine->scratch->next;
+		MUJSON_FREE(engine->scratch);
+		engine->scratch = next;
+	}
+}
+
+static bool muj_patch_flush(muj_patch_engine* engine)
+{
+	muj_problem_state saved = muj_save_problem();
+	muj_document next = muj_overlay_make_document(engine->overlay);
+	bool failed = (muj_problem_string != 0);
+	muj_restore_problem(saved);
+	if (next.json.json_target == NULL)
+		return false;
+	if (failed)
+	{
+		muj_free_compressed_json(next.json);
+		muj_free_document_table(next.table);
+		return false;
+	}
+	muj_patch_free_base(engine);
+	engine->base = next;
+	engine->overlay.document = next;
+	muj_reset_overlay(engine->overlay);
+	return true;
+}
+
+static bool muj_overlay_is_replaced(muj_overlay overlay, size_t offset)
+{
+	for( size_t i=0; i<*overlay.num_edits; i++)
+	{
+		muj_edit edit = overlay.edits[i];
+		if (edit.begin <= offset && offset < edit.end)
+			return true;
+	}
+	return false;
+}
+
+static bool muj_overlay_is_touched(muj_overlay overlay, size_t begin, size_t end)
+{
+	for( size_t i=0; i<*overlay.num_edits; i++)
+	{
+		muj_edit edit = overlay.edits[i];
+		if (muj_is_insertion(edit) ? (begin < edit.begin && edit.begin < end) : (edit.begin < end && edit.end > begin))
+			return true;
+	}
+	return false;
+}
+
+static bool muj_overlay_is_shifted(muj_overlay overlay, MUJ_INDEX array)
+{
+	for( size_t i=0; i<*overlay.num_edits; i++)
+	{
+		muj_edit edit = overlay.edits[i];
+		if (edit.index == array && (edit.type == MUJ_EDIT_APPEND_ELEMENT || edit.type == MUJ_EDIT_INSERT_ELEMENT || edit.type == MUJ_EDIT_DELETE_ELEMENT))
+			return true;
+	}
+	return false;
+}
+
+static bool muj_overlay_has_inserted_key(muj_overlay overlay, MUJ_INDEX object, const char* key, size_t key_length)
+{
+	for( size_t i=0; i<*overlay.num_edits; i++)
+	{
+		muj_edit edit = overlay.edits[i];
+		if (edit.type == MUJ_EDIT_INSERT_KEY && edit.index == object && edit.key_length == key_length && memcmp(edit.key, key, key_length) == 0)
+			return true;
+	}
+	return false;
+}
+
+static bool muj_is_value_touched(muj_overlay overlay, MUJ_INDEX value)
+{
+	return muj_overlay_is_touched(overlay, overlay.document.table.table[value], get_value_end(value, overlay.document));
+}
+
+// The key as written (escapes included) without the quotes
+static const char* muj_get_raw_key(MUJ_INDEX key, muj_document document, size_t* length)
+{
+	size_t begin = document.table.table[key]+1;
+	*length = document.table.table[key+2] - begin - 1; // the value starts right after the key
+	return &document.json.json_target[begin];
+}
+
+static bool muj_raw_key_equals(MUJ_INDEX key, const char* name, size_t length, muj_document document)
+{
+	size_t key_length;
+	const char* key_name = muj_get_raw_key(key, document, &key_length);
+	return (key_length == length && memcmp(key_name, name, length) == 0);
+}
+
+// Keys are compared as written (escapes included)
+static MUJ_INDEX muj_find_value_of_raw_key(MUJ_INDEX object, const char* key, size_t length, muj_document document)
+{
+	if (muj_is_object_empty(object, document))
+		return 0;
+	MUJ_INDEX child = object_get_first_child(object, document);
+	for(;;)
+	{
+		if (muj_raw_key_equals(child, key, length, document))
+			return child+2;
+		if (skip_end(child+3, document.table))
+			return 0;
+		child = get_skip(child+3, document.table);
+	}
+}
+
+static const char* muj_get_value_span(MUJ_INDEX value, muj_document document, size_t* length)
+{
+	size_t begin = document.table.table[value];
+	*length = get_value_end(value, document) - begin;
+	return &document.json.json_target[begin];
+}
+
+// Structural equality (RFC 6902 test): member order doesn't matter, numbers are compared by value and strings
+// after decoding. Equal compressed text is equal without looking further.
+typedef struct
+{
+	const char* str;
+	const char* limit;
+	char decoded[4];
+	size_t length;
+	size_t at;
+} muj_string_cursor;
+
+static void muj_init_string_cursor(muj_string_cursor* cursor, MUJ_INDEX string, muj_document document)
+{
+	cursor->str = muj_get_string_contents(string, document, &cursor->limit);
+	cursor->length = 0;
+	cursor->at = 0;
+}
+
+// The next decoded byte, or -1 at the end of the string
+static int muj_string_cursor_next(muj_string_cursor* cursor)
+{
+	if (cursor->at < cursor->length)
+		return (unsigned char)cursor->decoded[cursor->at++];
+	if (cursor->str >= cursor->limit || *cursor->str == '"')
+		return -1;
+	if (*cursor->str != '\\')
+		return (unsigned char)*cursor->str++;
+	cursor->str += muj_decode_escape(cursor->str, cursor->decoded, &cursor->length);
+	cursor->at = 0;
+	return muj_string_cursor_next(cursor);
+}
+
+static bool muj_strings_equal(MUJ_INDEX a, muj_document document_a, MUJ_INDEX b, muj_document document_b)
+{
+	muj_string_cursor cursor_a;
+	muj_string_cursor cursor_b;
+	muj_init_string_cursor(&cursor_a, a, document_a);
+	muj_init_string_cursor(&cursor_b, b, document_b);
+	for(;;)
+	{
+		int byte = muj_string_cursor_next(&cursor_a);
+		if (byte != muj_string_cursor_next(&cursor_b))
+			return false;
+		if (byte < 0)
+			return true;
+	}
+}
+
+static bool muj_numbers_equal(MUJ_INDEX a, muj_document document_a, MUJ_INDEX b, muj_document document_b)
+{
+	int64_t integer_a;
+	int64_t integer_b;
+	bool is_integer_a = muj_get_int64(a, document_a, &integer_a);
+	bool is_integer_b = muj_get_int64(b, document_b, &integer_b);
+	if (is_integer_a && is_integer_b)
+		return (integer_a == integer_b);
+	return (muj_get_double(a, document_a) == muj_get_double(b, document_b));
+}
+
+static bool muj_values_equal(MUJ_INDEX a, muj_document document_a, MUJ_INDEX b, muj_document document_b)
+{
+	size_t length_a;
+	size_t length_b;
+	const char* text_a = muj_get_value_span(a, document_a, &length_a);
+	const char* text_b = muj_get_value_span(b, document_b, &length_b);
+	if (length_a == length_b && memcmp(text_a, text_b, length_a) == 0)
+		return true;
+	muj_type type = muj_get_type(a, document_a);
+	if (type != muj_get_type(b, document_b))
+		return false;
+	switch(type)
+	{
+		case MUJ_TYPE_NUMBER:
+			return muj_numbers_equal(a, document_a, b, document_b);
+		case MUJ_TYPE_STRING:
+			return muj_strings_equal(a, document_a, b, document_b);
+		case MUJ_TYPE_ARRAY:
+		{
+			if (muj_array_count_number_of_elements(a, document_a) != muj_array_count_number_of_elements(b, document_b))
+				return false;
+			if (muj_is_array_empty(a, document_a))
+				return true;
+			MUJ_INDEX element_a = array_get_first_child(a, document_a);
+			MUJ_INDEX element_b = array_get_first_child(b, document_b);
+			for(;;)
+			{
+				if (!muj_values_equal(element_a, document_a, element_b, document_b))
+					return false;
+				if (skip_end(element_a+1, document_a.table))
+					return true;
+				element_a = get_skip(element_a+1, document_a.table);
+				element_b = get_skip(element_b+1, document_b.table);
+			}
+		}
+		case MUJ_TYPE_OBJECT:
+		{
+			if (muj_object_count_number_of_children(a, document_a) != muj_object_count_number_of_children(b, document_b))
+				return false;
+			if (muj_is_object_empty(a, document_a))
+				return true;
+			MUJ_INDEX key_a = object_get_first_child(a, document_a);
+			MUJ_INDEX key_b = object_get_first_child(b, document_b);
+			for(;;)
+			{
+				MUJ_INDEX match = key_b; // the member at the same position first, then a search
+				if (!muj_strings_equal(key_a, document_a, match, document_b))
+				{
+					match = object_get_first_child(b, document_b);
+					while (!muj_strings_equal(key_a, document_a, match, document_b))
+					{
+						if (skip_end(match+3, document_b.table))
+							return false;
+						match = get_skip(match+3, document_b.table);
+					}
+				}
+				if (!muj_values_equal(key_a+2, document_a, match+2, document_b))
+					return false;
+				if (skip_end(key_a+3, document_a.table))
+					return true;
+				key_a = get_skip(key_a+3, document_a.table);
+				if (!skip_end(match+3, document_b.table))
+					key_b = get_skip(match+3, document_b.table);
+			}
+		}
+		default: // constants of the same type
+			return true;
+	}
+}
+
+// Decodes a json pointer in place into null terminated reference tokens: "/a~1b/c" -> "a/b\0c\0". Returns -1 if invalid.
+static long muj_decode_pointer(char* pointer)
+{
+	if (*pointer == 0)
+		return 0;
+	if (*pointer != '/')
+		return -1;
+	char* read = pointer+1;
+	char* write = pointer;
+	long tokens = 1;
+	for(;;)
+	{
+		char byte = *read++;
+		if (byte == 0)
+		{
+			*write = 0;
+			return tokens;
+		}
+		if (byte == '/')
+		{
+			*write++ = 0;
+			tokens++;
+		}
+		else if (byte == '~')
+		{
+			byte = *read++;
+			if (byte == '0')
+				*write++ = '~';
+			else if (byte == '1')
+				*write++ = '/';
+			else
+				return -1;
+		}
+		else
+			*write++ = byte;
+	}
+}
+
+static bool muj_parse_array_index(const char* token, size_t* index)
+{
+	if (*token == 0 || (token[0] == '0' && token[1] != 0))
+		return false;
+	size_t value = 0;
+	for( ; *token; token++)
+	{
+		if (!isByteDigit(*token))
+			return false;
+		value = value*10 + (size_t)(*token - '0');
+	}
+	*index = value;
+	return true;
+}
+
+// Finds element index of an array as the overlay edits so far have shaped it. Sets *element to the original element
+// it is (0 past the end) and *count to the number of elements. An element the overlay added can't be a target yet.
+static muj_patch_result muj_patch_find_element(muj_overlay overlay, MUJ_INDEX array, size_t index, MUJ_INDEX* element, size_t* count)
+{
+	muj_document document = overlay.document;
+	size_t edit = 0;
+	size_t position = 0;
+	*element = 0;
+	MUJ_INDEX current = muj_is_array_empty(array, document) ? 0 : array_get_first_child(array, document);
+	for(;;)
+	{
+		size_t begin = current ? document.table.table[current] : get_value_end(array, document)-1; // the ']' for appends
+		bool deleted = false;
+		for( ; edit<*overlay.num_edits && overlay.edits[edit].begin <= begin; edit++) // sorted, insertions first
+		{
+			muj_edit found = overlay.edits[edit];
+			if (found.begin < begin || found.index != array)
+				continue;
+			if (found.type == MUJ_EDIT_INSERT_ELEMENT || found.type == MUJ_EDIT_APPEND_ELEMENT)
+			{
+				if (position++ == index)
+					return MUJ_PATCH_CONFLICT;
+			}
+			else if (found.type == MUJ_EDIT_DELETE_ELEMENT)
+				deleted = true;
+		}
+		if (current == 0)
+			break;
+		if (!deleted && position++ == index)
+			*element = current;
+		if (skip_end(current+1, document.table))
+			current = 0;
+		else
+			current = get_skip(current+1, document.table);
+	}
+	*count = position;
+	return MUJ_PATCH_DONE;
+}
+
+static muj_patch_result muj_patch_locate(muj_pointer_location* location, const char* tokens, long num_tokens, muj_patch_engine* engine)
+{
+	muj_document document = engine->base;
+	MUJ_INDEX current = muj_get_root_object(document.table);
+	location->parent = 0;
+	location->target = current;
+	location->key = tokens;
+	location->is_root = (num_tokens == 0);
+	location->parent_is_array = false;
+	location->append = false;
+	for( long i=0; i<num_tokens; i++)
+	{
+		if (muj_overlay_is_replaced(engine->overlay, document.table.table[current]))
+			return MUJ_PATCH_CONFLICT;
+		bool last = (i == num_tokens-1);
+		MUJ_INDEX next = 0;
+		location->parent = current;
+		location->key = tokens;
+		if (muj_is_object(current, document))
+		{
+			location->parent_is_array = false;
+			next = muj_find_value_of_key_in_object(current, tokens, document);
+		}
+		else if (muj_is_array(current, document))
+		{
+			size_t index = 0;
+			location->parent_is_array = true;
+			if (last && strcmp(tokens, "-") == 0)
+				location->append = true; // after earlier appends too
+			else if (!muj_parse_array_index(tokens, &index))
+				return MUJ_PATCH_FAILED;
+			else if (muj_overlay_is_shifted(engine->overlay, current))
+			{
+				size_t count;
+				if (muj_patch_find_element(engine->overlay, current, index, &next, &count) != MUJ_PATCH_DONE)
+					return MUJ_PATCH_CONFLICT;
+				location->append = (next == 0 && last && index == count);
+			}
+			else
+			{
+				next = muj_get_element_from_array(current, index, document);
+				location->append = (next == 0 && last && index == muj_array_count_number_of_elements(current, document));
+			}
+		}
+		else
+			return MUJ_PATCH_CONFLICT; // Might have been replaced by a container
+		if (next == 0 && !last)
+			return MUJ_PATCH_CONFLICT; // Might have been added
+		location->target = next;
+		current = next;
+		tokens += strlen(tokens)+1;
+	}
+	return MUJ_PATCH_DONE;
+}
+
+// Json escapes a decoded reference token for use as a key
+static const char* muj_patch_escape_key(muj_patch_engine* engine, const char* key, size_t* length)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t extra = 0;
+	size_t key_length = strlen(key);
+	for( size_t i=0; i<key_length; i++)
+	{
+		unsigned char byte = (unsigned char)key[i];
+		if (byte == '"' || byte == '\\')
+			extra += 1;
+		else if (byte < ' ')
+			extra += 5;
+	}
+	*length = key_length + extra;
+	if (extra == 0)
+		return key;
+	char* out = muj_patch_alloc(engine, *length);
+	if (!out)
+		return NULL;
+	char* write = out;
+	for( size_t i=0; i<key_length; i++)
+	{
+		unsigned char byte = (unsigned char)key[i];
+		if (byte == '"' || byte == '\\')
+		{
+			*write++ = '\\';
+			*write++ = (char)byte;
+		}
+		else if (byte < ' ')
+		{
+			*write++ = '\\'; *write++ = 'u'; *write++ = '0'; *write++ = '0';
+			*write++ = hex[byte >> 4];
+			*write++ = hex[byte & 15];
+		}
+		else
+			*write++ = (char)byte;
+	}
+	return out;
+}
+
+static muj_patch_result muj_patch_edited(bool success)
+{
+	return success ? MUJ_PATCH_DONE : MUJ_PATCH_FAILED;
+}
+
+// value/length: the compressed value for add and replace, the copied value for read. test uses engine->operand.
+static muj_patch_result muj_patch_do_step(muj_patch_engine* engine, muj_patch_step step, const char* tokens, long num_tokens, const char** value, size_t* length)
+{
+	muj_pointer_location location;
+	muj_patch_result result = muj_patch_locate(&location, tokens, num_tokens, engine);
+	if (result != MUJ_PATCH_DONE)
+		return result;
+	muj_overlay overlay = engine->overlay;
+	muj_document document = engine->base;
+
+	if (step == MUJ_PATCH_ADD && location.parent_is_array && !location.is_root)
+	{
+		if (location.append)
+			return muj_patch_edited(muj_overlay_append(overlay, location.parent, *value, *length, MUJ_VALUE_COMPRESSED));
+		if (location.target == 0)
+			return MUJ_PATCH_FAILED;
+		return muj_patch_edited(muj_overlay_insert_before(overlay, location.parent, location.target, *value, *length, MUJ_VALUE_COMPRESSED));
+	}
+	if (step == MUJ_PATCH_ADD && location.target == 0 && !location.is_root)
+	{
+		size_t key_length;
+		const char* key = muj_patch_escape_key(engine, location.key, &key_length);
+		if (!key)
+			return MUJ_PATCH_FAILED;
+		if (muj_overlay_has_inserted_key(overlay, location.parent, key, key_length))
+			return MUJ_PATCH_CONFLICT;
+		return muj_patch_edited(muj_overlay_insert(overlay, location.parent, key, key_length, *value, *length, MUJ_VALUE_COMPRESSED));
+	}
+
+	if (location.target == 0 && !location.is_root)
+		return MUJ_PATCH_CONFLICT; // Might have been added
+	if (muj_is_value_touched(overlay, location.target))
+		return MUJ_PATCH_CONFLICT;
+
+	switch(step)
+	{
+		case MUJ_PATCH_ADD:
+		case MUJ_PATCH_REPLACE:
+			return muj_patch_edited(muj_overlay_set(overlay, location.target, *value, *length, MUJ_VALUE_COMPRESSED));
+		case MUJ_PATCH_REMOVE:
+			if (location.is_root)
+				return MUJ_PATCH_FAILED;
+			if (location.parent_is_array)
+				return muj_patch_edited(muj_overlay_delete_at(overlay, location.parent, location.target));
+			return muj_patch_edited(muj_overlay_delete(overlay, location.target-2));
+		case MUJ_PATCH_TEST:
+		{
+			return muj_patch_edited(muj_values_equal(location.target, document, engine->operand, engine->patch));
+		}
+		case MUJ_PATCH_READ:
+		{
+			const char* existing = muj_get_value_span(location.target, document, length);
+			char* copy = muj_patch_alloc(engine, *length);
+			if (!copy)
+				return MUJ_PATCH_FAILED;
+			memcpy(copy, existing, *length);
+			*value = copy;
+			return MUJ_PATCH_DONE;
+		}
+	}
+	return MUJ_PATCH_FAILED;
+}
+
+static bool muj_patch_step_with_retry(muj_patch_engine* engine, muj_patch_step step, const char* tokens, long num_tokens, const char** value, size_t* length)
+{
+	muj_patch_result result = muj_patch_do_step(engine, step, tokens, num_tokens, value, length);
+	if (result == MUJ_PATCH_CONFLICT && *engine->overlay.num_edits > 0 && muj_patch_flush(engine))
+		result = muj_patch_do_step(engine, step, tokens, num_tokens, value, length);
+	return (result == MUJ_PATCH_DONE);
+}
+
+// Copies and decodes a pointer member of a patch operation
+static char* muj_patch_get_pointer(muj_patch_engine* engine, MUJ_INDEX operation, const char* name, muj_document patch, long* num_tokens)
+{
+	MUJ_INDEX pointer = muj_find_value_of_key_in_object(operation, name, patch);
+	if (pointer == 0 || !muj_is_string(pointer, patch))
+		return NULL;
+	char* tokens = muj_patch_alloc(engine, muj_get_string_length(pointer, patch));
+	if (!tokens)
+		return NULL;
+	tokens[muj_get_string_length_excluding_null(pointer, patch)] = 0;
+	muj_copy_string(tokens, pointer, patch);
+	*num_tokens = muj_decode_pointer(tokens);
+	return (*num_tokens < 0) ? NULL : tokens;
+}
+
+static bool muj_tokens_are_prefix(const char* prefix, long num_prefix_tokens, const char* tokens, long num_tokens)
+{
+	if (num_prefix_tokens > num_tokens)
+		return false;
+	for( long i=0; i<num_prefix_tokens; i++)
+	{
+		if (strcmp(prefix, tokens) != 0)
+			return false;
+		prefix += strlen(prefix)+1;
+		tokens += strlen(tokens)+1;
+	}
+	return true;
+}
+
+static bool muj_patch_apply_operation(muj_patch_engine* engine, MUJ_INDEX operation, muj_document patch)
+{
+	if (!muj_is_object(operation, patch))
+		return false;
+	MUJ_INDEX op = muj_find_value_of_key_in_object(operation, "op", patch);
+	if (op == 0 || !muj_is_string(op, patch))
+		return false;
+	long num_tokens = 0;
+	char* tokens = muj_patch_get_pointer(engine, operation, "path", patch, &num_tokens);
+	if (!tokens)
+		return false;
+
+	const char* value = NULL;
+	size_t length = 0;
+	if (muj_compare_string(op, "remove", patch))
+		return muj_patch_step_with_retry(engine, MUJ_PATCH_REMOVE, tokens, num_tokens, &value, &length);
+
+	if (muj_compare_string(op, "copy", patch) || muj_compare_string(op, "move", patch))
+	{
+		long num_from_tokens = 0;
+		char* from = muj_patch_get_pointer(engine, operation, "from", patch, &num_from_tokens);
+		if (!from || !muj_patch_step_with_retry(engine, MUJ_PATCH_READ, from, num_from_tokens, &value, &length))
+			return false;
+		if (muj_compare_string(op, "move", patch))
+		{
+			if (muj_tokens_are_prefix(from, num_from_tokens, tokens, num_tokens))
+				return (num_from_tokens == num_tokens); // Moving to itself is a no-op, into a child is an error
+			if (!muj_patch_step_with_retry(engine, MUJ_PATCH_REMOVE, from, num_from_tokens, NULL, NULL))
+				return false;
+		}
+		return muj_patch_step_with_retry(engine, MUJ_PATCH_ADD, tokens, num_tokens, &value, &length);
+	}
+
+	MUJ_INDEX operand = muj_find_value_of_key_in_object(operation, "value", patch);
+	if (operand == 0)
+		return false;
+	value = muj_get_value_span(operand, patch, &length);
+	engine->operand = operand;
+	if (muj_compare_string(op, "add", patch))
+		return muj_patch_step_with_retry(engine, MUJ_PATCH_ADD, tokens, num_tokens, &value, &length);
+	if (muj_compare_string(op, "replace", patch))
+		return muj_patch_step_with_retry(engine, MUJ_PATCH_REPLACE, tokens, num_tokens, &value, &length);
+	if (muj_compare_string(op, "test", patch))
+		return muj_patch_step_with_retry(engine, MUJ_PATCH_TEST, tokens, num_tokens, &value, &length);
+	return false;
+}
+
+static bool muj_patch_begin(muj_patch_engine* engine, muj_document source, muj_document patch, size_t max_edits)
+{
+	engine->source = source;
+	engine->base = source;
+	engine->scratch = NULL;
+	engine->patch = patch;
+	engine->operand = 0;
+	engine->overlay = muj_allocate_overlay(source, max_edits);
+	return (engine->overlay.max_edits > 0);
+}
+
+static bool muj_patch_end(muj_patch_engine* engine, muj_document* result, bool success)
+{
+	if (success)
+	{
+		if (*engine->overlay.num_edits == 0 && muj_patch_is_intermediate(engine))
+		{
+			*result = engine->base; // Already written out
+			engine->base = engine->source;
+		}
+		else
+		{
+			muj_problem_state saved = muj_save_problem();
+			muj_document out = muj_overlay_make_document(engine->overlay);
+			success = (out.json.json_target != NULL && muj_problem_string == 0);
+			muj_restore_problem(saved);
+			if (success)
+				*result = out;
+			else if (out.json.json_target != NULL)
+			{
+				muj_free_compressed_json(out.json);
+				muj_free_document_table(out.table);
+			}
+		}
+	}
+	muj_patch_finish(engine);
+	return success;
+}
+
+bool muj_apply_json_patch(muj_document* result, muj_document source, muj_document patch)
+{
+	MUJ_INDEX operations = muj_get_root_object(patch.table);
+	if (!muj_is_array(operations, patch))
+		return false;
+	size_t num_operations = muj_array_count_number_of_elements(operations, patch);
+	muj_patch_engine engine;
+	if (!muj_patch_begin(&engine, source, patch, num_operations*2 + 1))
+	{
+		muj_patch_finish(&engine);
+		return false;
+	}
+	bool success = true;
+	if (num_operations > 0)
+	{
+		MUJ_INDEX operation = array_get_first_child(operations, patch);
+		for(;;)
+		{
+			if (!muj_patch_apply_operation(&engine, operation, patch))
+			{
+				success = false;
+				break;
+			}
+			if (skip_end(operation+1, patch.table))
+				break;
+			operation = get_skip(operation+1, patch.table);
+		}
+	}
+	return muj_patch_end(&engine, result, success);
+}
+
+static bool muj_merge_patch_object(muj_patch_engine* engine, MUJ_INDEX target, MUJ_INDEX patch_object, muj_document patch)
+{
+	muj_document document = engine->base;
+	muj_overlay overlay = engine->overlay;
+	if (muj_is_object_empty(patch_object, patch))
+		return true;
+	MUJ_INDEX key = object_get_first_child(patch_object, patch);
+	for(;;)
+	{
+		MUJ_INDEX value = key+2;
+		size_t name_length;
+		const char* name = muj_get_raw_key(key, patch, &name_length);
+		MUJ_INDEX existing = muj_find_value_of_raw_key(target, name, name_length, document);
+		bool success = true;
+		if (muj_is_null(value, patch))
+		{
+			if (existing)
+				success = muj_overlay_delete(overlay, existing-2);
+		}
+		else if (existing && muj_is_object(value, patch) && muj_is_object(existing, document))
+			success = muj_merge_patch_object(engine, existing, value, patch);
+		else
+		{
+			size_t length;
+			const char* text = muj_get_value_span(value, patch, &length);
+			muj_value_format format = muj_is_object(value, patch) ? MUJ_VALUE_COMPRESSED_WITHOUT_NULLS : MUJ_VALUE_COMPRESSED;
+			if (existing)
+				success = muj_overlay_set(overlay, existing, text, length, format);
+			else
+				success = muj_overlay_insert(overlay, target, name, name_length, text, length, format);
+		}
+		if (!success)
+			return false;
+		if (skip_end(value+1, patch.table))
+			return true;
+		key = get_skip(value+1, patch.table);
+	}
+}
+
+bool muj_apply_merge_patch(muj_document* result, muj_document source, muj_document patch)
+{
+	MUJ_INDEX patch_root = muj_get_root_object(patch.table);
+	MUJ_INDEX source_root = muj_get_root_object(source.table);
+	muj_patch_engine engine;
+	if (!muj_patch_begin(&engine, source, patch, patch.table.table_size_in_indices/4 + 1)) // At most one edit per member
+	{
+		muj_patch_finish(&engine);
+		return false;
+	}
+	bool success;
+	if (muj_is_object(patch_root, patch) && muj_is_object(source_root, source))
+		success = muj_merge_patch_object(&engine, source_root, patch_root, patch);
+	else
+	{
+		size_t length;
+		const char* text = muj_get_value_span(patch_root, patch, &length);
+		success = muj_overlay_set(engine.overlay, source_root, text, length, muj_is_object(patch_root, patch) ? MUJ_VALUE_COMPRESSED_WITHOUT_NULLS : MUJ_VALUE_COMPRESSED);
+	}
+	return muj_patch_end(&engine, result, success);
+}
+
+// Diff
+// Walks both tables in lockstep and writes a RFC 6902 json patch that turns one document into the other.
+// Values whose compressed text is identical are skipped with a single memcmp, without descending into them,
+// so unchanged regions cost only the comparison. Scalars are compared as text here, so 1.0 to 1 is a replace.
+// Object members are matched by key, trying the member at the same position first (snapshots of a document
+// mostly keep their key order). Array elements are matched by position after trimming the common prefix
+// and suffix, so an insertion or removal in the middle of an array doesn't cascade into replacing the rest.
+
+#define MUJ_DIFF_LOCAL_PATH 256
+
+typedef struct
+{
+	muj_document from;
+	muj_document to;
+	char* target;
+	size_t target_size;
+	size_t pos;
+	char* path; // json pointer of the current value, escaped for use in a json string
+	char local_path[MUJ_DIFF_LOCAL_PATH];
+	size_t path_length;
+	size_t path_capacity;
+	bool first_operation;
+	bool failed;
+} muj_diff_state;
+
+static void muj_diff_push_path(muj_diff_state* state, const char* bytes, size_t length)
+{
+	if (state->path_length + length > state->path_capacity)
+	{
+		size_t capacity = state->path_capacity*2;
+		while (state->path_length + length > capacity)
+			capacity *= 2;
+		char* path = (char*)MUJSON_MALLOC(capacity);
+		if (!path)
+		{
+			state->failed = true;
+			return;
+		}
+		memcpy(path, state->path, state->path_length);
+		if (state->path != state->local_path)
+			MUJSON_FREE(state->path);
+		state->path = path;
+		state->path_capacity = capacity;
+	}
+	memcpy(&state->path[state->path_length], bytes, length);
+	state->path_length += length;
+}
+
+// Appends a reference token for a key, the key is already escaped for json so only '~' and '/' need escaping
+static void muj_diff_push_key(muj_diff_state* state, MUJ_INDEX key, muj_document document)
+{
+	size_t length;
+	const char* name = muj_get_raw_key(key, document, &length);
+	muj_diff_push_path(state, "/", 1);
+	size_t run = 0;
+	for( size_t i=0; i<length; i++)
+	{
+		const char* escape = NULL;
+		size_t skip = 1;
+		if (name[i] == '~')
+			escape = "~0";
+		else if (name[i] == '/')
+			escape = "~1";
+		else if (name[i] == '\\' && i+1 < length)
+		{
+			escape = (name[i+1] == '/') ? "~1" : NULL;
+			skip = 2;
+		}
+		if (escape)
+		{
+			muj_diff_push_path(state, &name[run], i-run);
+			muj_diff_push_path(state, escape, 2);
+			run = i+skip;
+		}
+		i += skip-1;
+	}
+	muj_diff_push_path(state, &name[run], length-run);
+}
+
+static void muj_diff_push_index(muj_diff_state* state, size_t index)
+{
+	char digits[24];
+	size_t length = 0;
+	do
+	{
+		digits[sizeof(digits)-1-length++] = (char)('0' + index%10);
+		index /= 10;
+	} while (index > 0);
+	muj_diff_push_path(state, "/", 1);
+	muj_diff_push_path(state, &digits[sizeof(digits)-length], length);
+}
+
+static void muj_diff_put(muj_diff_state* state, const char* text)
+{
+	state->pos = muj_put_bytes(state->target, state->target_size, state->pos, text, strlen(text));
+}
+
+// Writes an operation on the current path. value_end == 0: no value
+static void muj_diff_operation(muj_diff_state* state, const char* op, size_t value_begin, size_t value_end)
+{
+	if (state->failed)
+		return;
+	muj_diff_put(state, state->first_operation ? "{\"op\":\"" : ",{\"op\":\"");
+	state->first_operation = false;
+	muj_diff_put(state, op);
+	muj_diff_put(state, "\",\"path\":\"");
+	state->pos = muj_put_bytes(state->target, state->target_size, state->pos, state->path, state->path_length);
+	muj_diff_put(state, "\"");
+	if (value_end > 0)
+	{
+		muj_diff_put(state, ",\"value\":");
+		muj_minify_state minify;
+		muj_minify_begin(&minify);
+		state->pos = muj_minify_range(&minify, state->target, state->target_size, state->pos, state->to.json.json_target, value_begin, value_end);
+		state->failed |= minify.failed;
+		muj_minify_end(&minify);
+	}
+	muj_diff_put(state, "}");
+}
+
+// End of a value in the compressed json: where its next sibling starts, or the closing bracket of its parent
+static size_t muj_diff_child_end(MUJ_INDEX child, size_t parent_end, muj_document document)
+{
+	if (skip_end(child+1, document.table))
+		return parent_end-1;
+	return document.table.table[get_skip(child+1, document.table)];
+}
+
+// Next key of an object, 0 if none
+static MUJ_INDEX muj_diff_next_key(MUJ_INDEX key, muj_document document)
+{
+	if (skip_end(key+3, document.table))
+		return 0;
+	return get_skip(key+3, document.table);
+}
+
+static MUJ_INDEX muj_diff_find_key(MUJ_INDEX object, MUJ_INDEX hint, MUJ_INDEX key, muj_document key_document, muj_document document)
+{
+	size_t length;
+	const char* name = muj_get_raw_key(key, key_document, &length);
+	if (hint && muj_raw_key_equals(hint, name, length, document))
+		return hint+2;
+	return muj_find_value_of_raw_key(object, name, length, document);
+}
+
+static void muj_diff_value(muj_diff_state* state, MUJ_INDEX from, size_t from_end, MUJ_INDEX to, size_t to_end);
+
+static void muj_diff_object(muj_diff_state* state, MUJ_INDEX from, size_t from_end, MUJ_INDEX to, size_t to_end)
+{
+	muj_document a = state->from;
+	muj_document b = state->to;
+	size_t path_length = state->path_length;
+
+	// Removed and changed members
+	MUJ_INDEX hint = muj_is_object_empty(to, b) ? 0 : object_get_first_child(to, b);
+	MUJ_INDEX key = muj_is_object_empty(from, a) ? 0 : object_get_first_child(from, a);
+	for( ; key && !state->failed; key = muj_diff_next_key(key, a))
+	{
+		MUJ_INDEX value = muj_diff_find_key(to, hint, key, a, b);
+		muj_diff_push_key(state, key, a);
+		if (value == 0)
+			muj_diff_operation(state, "remove", 0, 0);
+		else
+			muj_diff_value(state, key+2, muj_diff_child_end(key+2, from_end, a), value, muj_diff_child_end(value, to_end, b));
+		state->path_length = path_length;
+		if (hint)
+			hint = muj_diff_next_key(hint, b);
+	}
+
+	// Added members
+	hint = muj_is_object_empty(from, a) ? 0 : object_get_first_child(from, a);
+	key = muj_is_object_empty(to, b) ? 0 : object_get_first_child(to, b);
+	for( ; key && !state->failed; key = muj_diff_next_key(key, b))
+	{
+		if (muj_diff_find_key(from, hint, key, b, a) == 0)
+		{
+			muj_diff_push_key(state, key, b);
+			muj_diff_operation(state, "add", b.table.table[key+2], muj_diff_child_end(key+2, to_end, b));
+			state->path_length = path_length;
+		}
+		if (hint)
+			hint = muj_diff_next_key(hint, a);
+	}
+}
+
+static bool muj_diff_spans_equal(muj_diff_state* state, size_t from_begin, size_t from_end, size_t to_begin, size_t to_end)
+{
+	return (from_end-from_begin == to_end-to_begin && memcmp(&state->from.json.json_target[from_begin], &state->to.json.json_target[to_begin], to_end-to_begin) == 0);
+}
+
+static void muj_diff_array(muj_diff_state* state, MUJ_INDEX from, size_t from_end, MUJ_INDEX to, size_t to_end)
+{
+	muj_document a = state->from;
+	muj_document b = state->to;
+	size_t num_from = muj_array_count_number_of_elements(from, a);
+	size_t num_to = muj_array_count_number_of_elements(to, b);
+	MUJ_INDEX* elements = (MUJ_INDEX*)MUJSON_MALLOC((num_from+num_to+1) * sizeof(MUJ_INDEX));
+	if (!elements)
+	{
+		state->failed = true;
+		return;
+	}
+	MUJ_INDEX* from_elements = elements;
+	MUJ_INDEX* to_elements = elements+num_from;
+	muj_array_copy_elements(from_elements, from, a);
+	muj_array_copy_elements(to_elements, to, b);
+#define MUJ_DIFF_BEGIN(document, elements, i) ((document).table.table[(elements)[i]])
+#define MUJ_DIFF_END(document, elements, num, end, i) (((i)+1 < (num)) ? MUJ_DIFF_BEGIN(document, elements, (i)+1) : (end)-1)
+#define MUJ_DIFF_ELEMENTS_EQUAL(i, j) muj_diff_spans_equal(state, \
+		MUJ_DIFF_BEGIN(a, from_elements, i), MUJ_DIFF_END(a, from_elements, num_from, from_end, i), \
+		MUJ_DIFF_BEGIN(b, to_elements, j), MUJ_DIFF_END(b, to_elements, num_to, to_end, j))
+
+	size_t prefix = 0;
+	while (prefix < num_from && prefix < num_to && MUJ_DIFF_ELEMENTS_EQUAL(prefix, prefix))
+		prefix++;
+	size_t suffix = 0;
+	while (prefix+suffix < num_from && prefix+suffix < num_to && MUJ_DIFF_ELEMENTS_EQUAL(num_from-1-suffix, num_to-1-suffix))
+		suffix++;
+	size_t changed_from = num_from-prefix-suffix;
+	size_t changed_to = num_to-prefix-suffix;
+	size_t path_length = state->path_length;
+
+	for( size_t i=prefix; i<prefix+changed_from && i<prefix+changed_to && !state->failed; i++)
+	{
+		muj_diff_push_index(state, i);
+		muj_diff_value(state, from_elements[i], MUJ_DIFF_END(a, from_elements, num_from, from_end, i), to_elements[i], MUJ_DIFF_END(b, to_elements, num_to, to_end, i));
+		state->path_length = path_length;
+	}
+	for( size_t i=prefix+changed_from; i<prefix+changed_to && !state->failed; i++)
+	{
+		muj_diff_push_index(state, i);
+		muj_diff_operation(state, "add", MUJ_DIFF_BEGIN(b, to_elements, i), MUJ_DIFF_END(b, to_elements, num_to, to_end, i));
+		state->path_length = path_length;
+	}
+	for( size_t i=prefix+changed_from; i>prefix+changed_to && !state->failed; i--) // Back to front, so the indices stay valid
+	{
+		muj_diff_push_index(state, i-1);
+		muj_diff_operation(state, "remove", 0, 0);
+		state->path_length = path_length;
+	}
+#undef MUJ_DIFF_ELEMENTS_EQUAL
+#undef MUJ_DIFF_END
+#undef MUJ_DIFF_BEGIN
+	MUJSON_FREE(elements);
+}
+
+static void muj_diff_value(muj_diff_state* state, MUJ_INDEX from, size_t from_end, MUJ_INDEX to, size_t to_end)
+{
+	size_t from_begin = state->from.table.table[from];
+	size_t to_begin = state->to.table.table[to];
+	if (muj_diff_spans_equal(state, from_begin, from_end, to_begin, to_end))
+		return;
+	if (muj_is_object(from, state->from) && muj_is_object(to, state->to))
+		muj_diff_object(state, from, from_end, to, to_end);
+	else if (muj_is_array(from, state->from) && muj_is_array(to, state->to))
+		muj_diff_array(state, from, from_end, to, to_end);
+	else
+		muj_diff_operation(state, "replace", to_begin, to_end);
+}
+
+size_t muj_diff(char* target, size_t target_size, muj_document from, muj_document to)
+{
+	muj_diff_state state;
+	state.from = from;
+	state.to = to;
+	state.target = target;
+	state.target_size = target_size;
+	state.pos = 0;
+	state.path = state.local_path;
+	state.path_length = 0;
+	state.path_capacity = MUJ_DIFF_LOCAL_PATH;
+	state.first_operation = true;
+	state.failed = false;
+	muj_diff_put(&state, "[");
+	muj_diff_value(&state, muj_get_root_object(from.table), *from.json.json_write_pos, muj_get_root_object(to.table), *to.json.json_write_pos);
+	muj_diff_put(&state, "]");
+	if (state.path != state.local_path)
+		MUJSON_FREE(state.path);
+	return state.failed?0:state.pos;
+}
+
+// Subtree hashing
+// Every value and key gets a 64 bit hash, stored beside the table (one per table entry pair). Keys and scalar values
+// hash their compressed text, objects and arrays combine the hashes of their children. Since children always come
+// after their parent in the table, a single pass from the back of the table computes everything bottom-up.
+// Equal compressed text means equal hashes, also across documents.
+
+#define MUJ_HASH_OFFSET 14695981039346656037ULL
+#define MUJ_HASH_PRIME 1099511628211ULL
+
+static uint64_t muj_hash_bytes(uint64_t hash, const char* bytes, size_t length)
+{
+	for( size_t i=0; i<length; i++)
+		hash = (hash ^ (unsigned char)bytes[i]) * MUJ_HASH_PRIME;
+	return hash;
+}
+
+static uint64_t muj_hash_combine(uint64_t hash, uint64_t child)
+{
+	hash ^= child + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+	return hash * MUJ_HASH_PRIME;
+}
+
+muj_subtree_hashes muj_compute_subtree_hashes(muj_document document)
+{
+	muj_subtree_hashes out;
+	out.num_hashes = *document.table.current_write_pos/2;
+	out.hashes = (uint64_t*)MUJSON_MALLOC((out.num_hashes+1) * sizeof(uint64_t));
+	if (!out.hashes)
+	{
+		out.num_hashes = 0;
+		return out;
+	}
+	const char* json = document.json.json_target;
+	for( size_t entry=out.num_hashes; entry>0; entry--)
+	{
+		MUJ_INDEX index = (MUJ_INDEX)((entry-1)*2);
+		char byte = json[document.table.table[index]];
+		uint64_t hash = muj_hash_bytes(MUJ_HASH_OFFSET, &byte, 1);
+		if ((byte == '{' || byte == '[') && json[document.table.table[index]+1] != (byte == '{' ? '}' : ']'))
+		{
+			MUJ_INDEX child = index+2;
+			for(;;)
+			{
+				hash = muj_hash_combine(hash, out.hashes[child/2]);
+				if (byte == '{')
+				{
+					child += 2; // value of the key
+					hash = muj_hash_combine(hash, out.hashes[child/2]);
+				}
+				if (skip_end(child+1, document.table))
+					break;
+				child = get_skip(child+1, document.table);
+			}
+		}
+		else if (byte != '{' && byte != '[')
+		{
+			size_t begin = document.table.table[index];
+			hash = muj_hash_bytes(MUJ_HASH_OFFSET, &json[begin], get_value_end(index, document) - begin);
+		}
+		out.hashes[index/2] = hash;
+	}
+	return out;
+}
+
+void muj_free_subtree_hashes(muj_subtree_hashes hashes)
+{
+	MUJSON_FREE(hashes.hashes);
+}
+
+uint64_t muj_subtree_hash(MUJ_INDEX index, muj_subtree_hashes hashes)
+{
+	MUJSON_ASSERT(index/2 < hashes.num_hashes);
+	return hashes.hashes[index/2];
+}
+
+bool muj_subtree_equal(MUJ_INDEX a, muj_document document_a, muj_subtree_hashes hashes_a, MUJ_INDEX b, muj_document document_b, muj_subtree_hashes hashes_b)
+{
+	if (muj_subtree_hash(a, hashes_a) != muj_subtree_hash(b, hashes_b))
+		return false;
+	size_t length_a;
+	size_t length_b;
+	const char* text_a = muj_get_value_span(a, document_a, &length_a);
+	const char* text_b = muj_get_value_span(b, document_b, &length_b);
+	return (length_a == length_b && memcmp(text_a, text_b, length_a) == 0);
+}
+
+size_t muj_find_duplicate_subtrees(muj_duplicate* duplicates, size_t max_duplicates, size_t min_length, muj_document document, muj_subtree_hashes hashes)
+{
+	size_t num_slots = 16;
+	while (num_slots < hashes.num_hashes*2)
+		num_slots *= 2;
+	MUJ_INDEX* slots = (MUJ_INDEX*)MUJSON_MALLOC(num_slots * sizeof(MUJ_INDEX)); // open addressing, index+1 (0: empty)
+	if (!slots)
+		return 0;
+	memset(slots, 0, num_slots * sizeof(MUJ_INDEX));
+
+	const char* json = document.json.json_target;
+	size_t num_duplicates = 0;
+	size_t skip_until = 0; // inside a duplicate, its children are duplicates as well
+	for( size_t entry=0; entry<hashes.num_hashes; entry++)
+	{
+		MUJ_INDEX index = (MUJ_INDEX)(entry*2);
+		size_t begin = document.table.table[index];
+		if (begin < skip_until || (json[begin] != '{' && json[begin] != '['))
+			continue;
+		size_t end = get_value_end(index, document);
+		if (end-begin < min_length)
+			continue;
+		size_t slot = (size_t)hashes.hashes[entry] & (num_slots-1);
+		for(;;)
+		{
+			if (slots[slot] == 0)
+			{
+				slots[slot] = index+1;
+				break;
+			}
+			MUJ_INDEX first = slots[slot]-1;
+			if (muj_subtree_equal(first, document, hashes, index, document, hashes))
+			{
+				if (num_duplicates < max_duplicates)
+				{
+					duplicates[num_duplicates].subtree = index;
+					duplicates[num_duplicates].first = first;
+				}
+				num_duplicates++;
+				skip_until = end;
+				break;
+			}
+			slot = (slot+1) & (num_slots-1);
+		}
+	}
+	MUJSON_FREE(slots);
+	return num_duplicates;
+}
+
+// Key interning
+// Records in arrays of objects repeat the same keys over and over. Interning gives every distinct key (compared as
+// written, escapes included) a small integer id, so looking up a key that was interned before is an integer compare
+// per member instead of a string compare.
+
+muj_key_dictionary muj_intern_keys(muj_document document)
+{
+	muj_key_dictionary out;
+	memset(&out, 0, sizeof(out));
+	size_t num_entries = *document.table.current_write_pos/2;
+	size_t num_slots = 16;
+	while (num_slots < num_entries)
+		num_slots *= 2; // at most half the entries are keys, so the slots are at most half full
+	// ids, keys and slots in one allocation
+	MUJ_INDEX* memory = (MUJ_INDEX*)MUJSON_MALLOC((num_entries + num_entries/2 + 1 + num_slots) * sizeof(MUJ_INDEX));
+	if (!memory)
+		return out;
+	out.ids = memory;
+	out.keys = memory + num_entries;
+	out.slots = out.keys + num_entries/2 + 1;
+	out.num_slots = num_slots;
+	out.num_entries = num_entries;
+	memset(out.slots, 0, num_slots * sizeof(MUJ_INDEX));
+
+	const char* json = document.json.json_target;
+	for( size_t entry=0; entry<num_entries; entry++)
+	{
+		MUJ_INDEX object = (MUJ_INDEX)(entry*2);
+		if (json[document.table.table[object]] != '{' || muj_is_object_empty(object, document))
+			continue;
+		for( MUJ_INDEX key = object_get_first_child(object, document);; key = get_skip(key+3, document.table))
+		{
+			size_t length;
+			const char* name = muj_get_raw_key(key, document, &length);
+			size_t slot = (size_t)muj_hash_bytes(MUJ_HASH_OFFSET, name, length) & (num_slots-1);
+			for(;;)
+			{
+				if (out.slots[slot] == 0)
+				{
+					out.keys[out.num_keys] = key;
+					out.slots[slot] = (MUJ_INDEX)++out.num_keys; // id+1 (0: empty)
+					break;
+				}
+				if (muj_raw_key_equals(out.keys[out.slots[slot]-1], name, length, document))
+					break;
+				slot = (slot+1) & (num_slots-1);
+			}
+			out.ids[key/2] = out.slots[slot]-1;
+			if (skip_end(key+3, document.table))
+				break;
+		}
+	}
+	return out;
+}
+
+void muj_free_key_dictionary(muj_key_dictionary dictionary)
+{
+	MUJSON_FREE(dictionary.ids);
+}
+
+MUJ_INDEX muj_get_key_id(MUJ_INDEX key, muj_key_dictionary dictionary)
+{
+	MUJSON_ASSERT(key/2 < dictionary.num_entries);
+	return dictionary.ids[key/2];
+}
+
+MUJ_INDEX muj_find_key_id(const char* key, muj_document document, muj_key_dictionary dictionary)
+{
+	if (dictionary.num_slots == 0)
+		return MUJ_NO_KEY_ID;
+	size_t length = strlen(key);
+	size_t slot = (size_t)muj_hash_bytes(MUJ_HASH_OFFSET, key, length) & (dictionary.num_slots-1);
+	while (dictionary.slots[slot] != 0)
+	{
+		MUJ_INDEX id = dictionary.slots[slot]-1;
+		if (muj_raw_key_equals(dictionary.keys[id], key, length, document))
+			return id;
+		slot = (slot+1) & (dictionary.num_slots-1);
+	}
+	return MUJ_NO_KEY_ID;
+}
+
+MUJ_INDEX muj_get_key_of_id(MUJ_INDEX id, muj_key_dictionary dictionary)
+{
+	MUJSON_ASSERT(id < dictionary.num_keys);
+	return dictionary.keys[id];
+}
+
+MUJ_INDEX muj_find_value_of_key_id(MUJ_INDEX object, MUJ_INDEX id, muj_document document, muj_key_dictionary dictionary)
+{
+	MUJSON_ASSERT(muj_is_object(object, document));
+	MUJ_COUNT(document.json.stats, lookups, 1);
+	if (id == MUJ_NO_KEY_ID || muj_is_object_empty(object, document))
+		return 0;
+	for( MUJ_INDEX key = object_get_first_child(object, document);; key = get_skip(key+3, document.table))
+	{
+		if (dictionary.ids[key/2] == id)
+			return key+2;
+		if (skip_end(key+3, document.table))
+			return 0;
+		MUJ_COUNT(document.json.stats, lookup_hops, 1);
+	}
+}
+
+// Columnar extraction
+// Pulls fields out of an array of records into typed columns with the Apache Arrow memory layout: validity bitmaps
+// (LSB first), contiguous int64/double values, bit-packed booleans and int32 offsets plus UTF-8 data for strings.
+// The table is walked once: the members of each record are collected and matched to the fields, trying the
+// position the field had in the previous record first. Values are then read straight from the compressed json.
+
+static size_t muj_align_8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static bool muj_column_has_type(muj_column_type type, MUJ_INDEX value, muj_document document)
+{
+	if (value == 0)
+		return false;
+	switch(type)
+	{
+		case MUJ_COLUMN_INT64:
+		case MUJ_COLUMN_DOUBLE:
+			return muj_is_number(value, document);
+		case MUJ_COLUMN_BOOL:
+			return muj_is_boolean(value, document);
+		case MUJ_COLUMN_STRING:
+			return muj_is_string(value, document);
+	}
+	return false;
+}
+
+static bool muj_fill_column(muj_column* column, const MUJ_INDEX* found, size_t stride, muj_document document)
+{
+	size_t num_rows = column->length;
+	size_t values_size;
+	switch(column->type)
+	{
+		case MUJ_COLUMN_INT64: values_size = num_rows * sizeof(int64_t); break;
+		case MUJ_COLUMN_DOUBLE: values_size = num_rows * sizeof(double); break;
+		case MUJ_COLUMN_BOOL: values_size = (num_rows+7)/8; break;
+		default: values_size = (num_rows+1) * sizeof(int32_t); break;
+	}
+	values_size = muj_align_8(values_size);
+	size_t validity_size = muj_align_8((num_rows+7)/8);
+	char* memory = (char*)MUJSON_MALLOC(values_size + validity_size);
+	if (!memory)
+		return false;
+	memset(memory, 0, values_size + validity_size);
+	column->values = memory;
+	column->validity = (uint8_t*)(memory + values_size);
+
+	size_t data_size = 0;
+	for( size_t row=0; row<num_rows; row++)
+	{
+		MUJ_INDEX value = found[row*stride];
+		int64_t integer = 0;
+		if (!muj_column_has_type(column->type, value, document) || (column->type == MUJ_COLUMN_INT64 && !muj_get_int64(value, document, &integer)))
+		{
+			column->null_count++;
+			if (column->type == MUJ_COLUMN_STRING)
+				((int32_t*)column->values)[row+1] = (int32_t)data_size;
+			continue;
+		}
+		column->validity[row/8] |= (uint8_t)(1u << (row%8));
+		switch(column->type)
+		{
+			case MUJ_COLUMN_INT64:
+				((int64_t*)column->values)[row] = integer;
+				break;
+			case MUJ_COLUMN_DOUBLE:
+				((double*)column->values)[row] = muj_get_double(value, document);
+				break;
+			case MUJ_COLUMN_BOOL:
+				if (muj_is_true(value, document))
+					((uint8_t*)column->values)[row/8] |= (uint8_t)(1u << (row%8));
+				break;
+			case MUJ_COLUMN_STRING:
+				data_size += muj_get_string_view(value, document, NULL).length;
+				if (data_size > INT32_MAX)
+					return false;
+				((int32_t*)column->values)[row+1] = (int32_t)data_size;
+				break;
+		}
+	}
+	if (column->type != MUJ_COLUMN_STRING)
+		return true;
+
+	column->data = (char*)MUJSON_MALLOC(muj_align_8(data_size) + 1);
+	if (!column->data)
+		return false;
+	column->data_size = data_size;
+	int32_t* offsets = (int32_t*)column->values;
+	for( size_t row=0; row<num_rows; row++)
+	{
+		if (offsets[row+1] != offsets[row])
+			muj_copy_string(&column->data[offsets[row]], found[row*stride], document);
+	}
+	return true;
+}
+
+bool muj_extract_columns(muj_column* columns, size_t num_columns, MUJ_INDEX array, muj_document document)
+{
+	MUJSON_ASSERT(muj_is_array(array, document));
+	size_t num_rows = muj_array_count_number_of_elements(array, document);
+	for( size_t c=0; c<num_columns; c++)
+	{
+		columns[c].length = num_rows;
+		columns[c].null_count = 0;
+		columns[c].validity = NULL;
+		columns[c].values = NULL;
+		columns[c].data = NULL;
+		columns[c].data_size = 0;
+	}
+
+	// Per row and column the value (0: missing), per column the key length and the member position of the previous row
+	size_t scratch_size = (num_rows*num_columns + 1) * sizeof(MUJ_INDEX) + num_columns * 2 * sizeof(size_t);
+	size_t* field_lengths = (size_t*)MUJSON_MALLOC(scratch_size);
+	size_t max_members = 16;
+	MUJ_INDEX* members = (MUJ_INDEX*)MUJSON_MALLOC(max_members * sizeof(MUJ_INDEX));
+	bool success = (field_lengths && members);
+	size_t* hints = field_lengths + num_columns;
+	MUJ_INDEX* found = (MUJ_INDEX*)(hints + num_columns);
+	if (success)
+	{
+		for( size_t c=0; c<num_columns; c++)
+		{
+			field_lengths[c] = strlen(columns[c].field);
+			hints[c] = 0;
+		}
+		memset(found, 0, num_rows*num_columns * sizeof(MUJ_INDEX));
+	}
+
+	MUJ_INDEX element = (num_rows > 0) ? array_get_first_child(array, document) : 0;
+	for( size_t row=0; row<num_rows && success; row++)
+	{
+		if (muj_is_object(element, document) && !muj_is_object_empty(element, document))
+		{
+			size_t num_members = 0;
+			for( MUJ_INDEX key = object_get_first_child(element, document);; key = get_skip(key+3, document.table))
+			{
+				if (num_members == max_members)
+				{
+					MUJ_INDEX* grown = (MUJ_INDEX*)MUJSON_MALLOC(max_members * 2 * sizeof(MUJ_INDEX));
+					if (!grown)
+					{
+						success = false;
+						break;
+					}
+					memcpy(grown, members, max_members * sizeof(MUJ_INDEX));
+					MUJSON_FREE(members);
+					members = grown;
+					max_members *= 2;
+				}
+				members[num_members++] = key;
+				if (skip_end(key+3, document.table))
+					break;
+			}
+			for( size_t c=0; c<num_columns && success; c++)
+			{
+				size_t m = hints[c];
+				if (m >= num_members || !muj_raw_key_equals(members[m], columns[c].field, field_lengths[c], document))
+				{
+					for( m=0; m<num_members; m++)
+					{
+						if (muj_raw_key_equals(members[m], columns[c].field, field_lengths[c], document))
+							break;
+					}
+				}
+				if (m < num_members)
+				{
+					found[row*num_columns + c] = members[m]+2;
+					hints[c] = m;
+				}
+			}
+		}
+		if (!skip_end(element+1, document.table))
+			element = get_skip(element+1, document.table);
+	}
+
+	for( size_t c=0; c<num_columns && success; c++)
+		success = muj_fill_column(&columns[c], &found[c], num_columns, document);
+	if (field_lengths)
+		MUJSON_FREE(field_lengths);
+	if (members)
+		MUJSON_FREE(members);
+	if (!success)
+		muj_free_columns(columns, num_columns);
+	return success;
+}
+
+void muj_free_columns(muj_column* columns, size_t num_columns)
+{
+	for( size_t c=0; c<num_columns; c++)
+	{
+		MUJSON_FREE(columns[c].values);
+		MUJSON_FREE(columns[c].data);
+		columns[c].values = NULL;
+		columns[c].validity = NULL;
+		columns[c].data = NULL;
+	}
+}
+
+// Compression at rest
+// Blocks are compressed independently with an LZ77 codec in the LZ4 sequence format: a token with the literal length
+// in the high nibble and the match length-4 in the low one (15: more length bytes follow, 255 each until a smaller
+// one), the literals, a 2 byte little endian offset back into the block and the match. The last sequence has no
+// match. A block starts with MUJ_BLOCK_RAW if it didn't compress. Table blocks store each index minus the one two
+// before it in the block (offsets and skips grow through the document), which compresses much better.
+
+#define MUJ_BLOCK_RAW 0
+#define MUJ_BLOCK_LZ 1
+#define MUJ_LZ_MIN_MATCH 4
+#define MUJ_LZ_HASH_BITS 12
+#define MUJ_MAX_BLOCK_SIZE 65536 // offsets fit in 2 bytes
+
+static uint64_t muj_next_packed_id = 1;
+
+static uint32_t muj_load_4(const unsigned char* bytes)
+{
+	uint32_t value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static size_t muj_lz_put_length(unsigned char* out, size_t pos, size_t length)
+{
+	while (length >= 255)
+	{
+		out[pos++] = 255;
+		length -= 255;
+	}
+	out[pos++] = (unsigned char)length;
+	return pos;
+}
+
+static size_t muj_lz_put_sequence(unsigned char* out, size_t pos, const unsigned char* literals, size_t num_literals, size_t offset, size_t match)
+{
+	size_t token_pos = pos++;
+	unsigned token = (unsigned)((num_literals < 15 ? num_literals : 15) << 4);
+	if (num_literals >= 15)
+		pos = muj_lz_put_length(out, pos, num_literals-15);
+	memcpy(out+pos, literals, num_literals);
+	pos += num_literals;
+	if (match)
+	{
+		out[pos++] = (unsigned char)(offset & 0xFF);
+		out[pos++] = (unsigned char)(offset >> 8);
+		size_t extra = match - MUJ_LZ_MIN_MATCH;
+		token |= (unsigned)(extra < 15 ? extra : 15);
+		if (extra >= 15)
+			pos = muj_lz_put_length(out, pos, extra-15);
+	}
+	out[token_pos] = (unsigned char)token;
+	return pos;
+}
+
+// Returns 0 if the output would exceed capacity
+static size_t muj_lz_compress(const unsigned char* in, size_t length, unsigned char* out, size_t capacity)
+{
+	uint32_t positions[1 << MUJ_LZ_HASH_BITS]; // position+1 of the last 4 bytes with this hash, 0: none
+	memset(positions, 0, sizeof(positions));
+	size_t anchor = 0;
+	size_t pos = 0;
+	size_t i = 0;
+	while (i + MUJ_LZ_MIN_MATCH <= length)
+	{
+		uint32_t sequence = muj_load_4(in+i);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - MUJ_LZ_HASH_BITS);
+		size_t candidate = positions[hash];
+		positions[hash] = (uint32_t)(i+1);
+		if (candidate == 0 || muj_load_4(in+candidate-1) != sequence)
+		{
+			i++;
+			continue;
+		}
+		candidate--;
+		size_t match = MUJ_LZ_MIN_MATCH;
+		while (i+match < length && in[candidate+match] == in[i+match])
+			match++;
+		size_t num_literals = i - anchor;
+		if (pos + num_literals + num_literals/255 + match/255 + 8 > capacity)
+			return 0;
+		pos = muj_lz_put_sequence(out, pos, in+anchor, num_literals, i-candidate, match);
+		i += match;
+		anchor = i;
+	}
+	size_t num_literals = length - anchor;
+	if (pos + num_literals + num_literals/255 + 2 > capacity)
+		return 0;
+	return muj_lz_put_sequence(out, pos, in+anchor, num_literals, 0, 0);
+}
+
+static bool muj_lz_get_length(const unsigned char* in, size_t length, size_t* pos, size_t* value)
+{
+	unsigned char byte;
+	do
+	{
+		if (*pos >= length)
+			return false;
+		byte = in[(*pos)++];
+		*value += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// false if the input is malformed or doesn't decompress to exactly out_length bytes
+static bool muj_lz_decompress(const unsigned char* in, size_t length, unsigned char* out, size_t out_length)
+{
+	size_t i = 0;
+	size_t pos = 0;
+	while (i < length)
+	{
+		unsigned token = in[i++];
+		size_t num_literals = token >> 4;
+		if (num_literals == 15 && !muj_lz_get_length(in, length, &i, &num_literals))
+			return false;
+		if (num_literals > length - i || num_literals > out_length - pos)
+			return false;
+		memcpy(out+pos, in+i, num_literals);
+		pos += num_literals;
+		i += num_literals;
+		if (i == length)
+			break;
+		if (length - i < 2)
+			return false;
+		size_t offset = (size_t)in[i] | ((size_t)in[i+1] << 8);
+		i += 2;
+		size_t match = (token & 15) + MUJ_LZ_MIN_MATCH;
+		if ((token & 15) == 15 && !muj_lz_get_length(in, length, &i, &match))
+			return false;
+		if (offset == 0 || offset > pos || match > out_length - pos)
+			return false;
+		for( size_t m=0; m<match; m++, pos++) // may overlap
+			out[pos] = out[pos-offset];
+	}
+	return pos == out_length;
+}
+
+static size_t muj_packed_block_length(size_t block, muj_packed_document packed)
+{
+	size_t begin = block * packed.block_size;
+	size_t size = packed.json_size;
+	if (block >= packed.num_json_blocks)
+	{
+		begin = (block - packed.num_json_blocks) * packed.block_size;
+		size = packed.table_size_in_indices * sizeof(MUJ_INDEX);
+	}
+	return (size - begin < packed.block_size) ? size - begin : packed.block_size;
+}
+
+muj_packed_document muj_pack_document(muj_document document, size_t block_size)
+{
+	muj_packed_document packed;
+	memset(&packed, 0, sizeof(packed));
+	block_size = (block_size == 0 || block_size > MUJ_MAX_BLOCK_SIZE) ? MUJ_MAX_BLOCK_SIZE : block_size & ~(size_t)7;
+	if (block_size == 0)
+		return packed;
+	packed.block_size = block_size;
+	packed.json_size = *document.json.json_write_pos;
+	packed.table_size_in_indices = *document.table.current_write_pos;
+	size_t table_bytes = packed.table_size_in_indices * sizeof(MUJ_INDEX);
+	packed.num_json_blocks = (packed.json_size + block_size-1) / block_size;
+	packed.num_table_blocks = (table_bytes + block_size-1) / block_size;
+	size_t num_blocks = packed.num_json_blocks + packed.num_table_blocks;
+	
+	// Compressed into the worst case size, which is then shrunk
+	size_t capacity = packed.json_size + table_bytes + num_blocks;
+	packed.data = (char*)muj_alloc_buffer(capacity ? capacity : 1);
+	packed.block_ends = (size_t*)MUJSON_MALLOC((num_blocks ? num_blocks : 1) * sizeof(size_t));
+	MUJ_INDEX* deltas = (MUJ_INDEX*)MUJSON_MALLOC(block_size);
+	if (packed.data == NULL || packed.block_ends == NULL || deltas == NULL)
+	{
+		MUJSON_FREE(deltas);
+		muj_free_packed_document(packed);
+		memset(&packed, 0, sizeof(packed));
+		return packed;
+	}
+	size_t pos = 0;
+	for( size_t block=0; block<num_blocks; block++)
+	{
+		size_t length = muj_packed_block_length(block, packed);
+		const unsigned char* in = (const unsigned char*)document.json.json_target + block*block_size;
+		if (block >= packed.num_json_blocks)
+		{
+			const MUJ_INDEX* indices = (const MUJ_INDEX*)((const char*)document.table.table + (block - packed.num_json_blocks)*block_size);
+			size_t num_indices = length / sizeof(MUJ_INDEX);
+			for( size_t i=0; i<num_indices; i++)
+				deltas[i] = (i < 2) ? indices[i] : indices[i] - indices[i-2];
+			in = (const unsigned char*)deltas;
+		}
+		unsigned char* out = (unsigned char*)packed.data + pos;
+		size_t compressed = muj_lz_compress(in, length, out+1, length); // only if it's smaller
+		if (compressed)
+		{
+			out[0] = MUJ_BLOCK_LZ;
+			pos += 1 + compressed;
+		}
+		else
+		{
+			out[0] = MUJ_BLOCK_RAW;
+			memcpy(out+1, in, length);
+			pos += 1 + length;
+		}
+		packed.block_ends[block] = pos;
+	}
+	MUJSON_FREE(deltas);
+	char* shrunk = (char*)muj_shrink_buffer(packed.data, pos ? pos : 1);
+	if (shrunk)
+		packed.data = shrunk;
+	packed.id = muj_next_packed_id++;
+	return packed;
+}
+
+void muj_free_packed_document(muj_packed_document packed)
+{
+	if (packed.data)
+		muj_free_buffer(packed.data);
+	MUJSON_FREE(packed.block_ends);
+}
+
+size_t muj_packed_document_size(muj_packed_document packed)
+{
+	size_t num_blocks = packed.num_json_blocks + packed.num_table_blocks;
+	return (num_blocks ? packed.block_ends[num_blocks-1] : 0) + num_blocks * sizeof(size_t);
+}
+
+muj_block_cache muj_allocate_block_cache(size_t num_slots, size_t block_size)
+{
+	muj_block_cache cache;
+	memset(&cache, 0, sizeof(cache));
+	cache.memory = (char*)MUJSON_MALLOC(num_slots * block_size);
+	cache.slots = (muj_block_cache_slot*)MUJSON_MALLOC(num_slots * sizeof(muj_block_cache_slot));
+	if (cache.memory == NULL || cache.slots == NULL)
+	{
+		muj_free_block_cache(cache);
+		memset(&cache, 0, sizeof(cache));
+		return cache;
+	}
+	memset(cache.slots, 0, num_slots * sizeof(muj_block_cache_slot));
+	cache.num_slots = num_slots;
+	cache.block_size = block_size;
+	return cache;
+}
+
+void muj_free_block_cache(muj_block_cache cache)
+{
+	MUJSON_FREE(cache.memory);
+	MUJSON_FREE(cache.slots);
+}
+
+// The decompressed block, valid until the next block is loaded into the cache
+static const char* muj_packed_get_block(size_t block, muj_packed_document packed, muj_block_cache* cache)
+{
+	MUJSON_ASSERT(cache->num_slots > 0 && cache->block_size >= packed.block_size);
+	MUJSON_ASSERT(block < packed.num_json_blocks + packed.num_table_blocks);
+	cache->clock++;
+	size_t victim = 0;
+	for( size_t s=0; s<cache->num_slots; s++)
+	{
+		muj_block_cache_slot* slot = &cache->slots[s];
+		if (slot->owner == packed.id && slot->block == block)
+		{
+			slot->last_use = cache->clock;
+			cache->hits++;
+			return cache->memory + s*cache->block_size;
+		}
+		if (slot->last_use < cache->slots[victim].last_use)
+			victim = s;
+	}
+	cache->misses++;
+	char* out = cache->memory + victim*cache->block_size;
+	size_t begin = block ? packed.block_ends[block-1] : 0;
+	const unsigned char* in = (const unsigned char*)packed.data + begin;
+	size_t in_length = packed.block_ends[block] - begin - 1;
+	size_t length = muj_packed_block_length(block, packed);
+	if (in[0] == MUJ_BLOCK_RAW)
+		memcpy(out, in+1, length);
+	else if (!muj_lz_decompress(in+1, in_length, (unsigned char*)out, length))
+	{
+		MUJSON_ASSERT(!"Corrupt packed block");
+		memset(out, 0, length);
+	}
+	if (block >= packed.num_json_blocks)
+	{
+		MUJ_INDEX* indices = (MUJ_INDEX*)out;
+		size_t num_indices = length / sizeof(MUJ_INDEX);
+		for( size_t i=2; i<num_indices; i++)
+			indices[i] += indices[i-2];
+	}
+	cache->slots[victim].owner = packed.id;
+	cache->slots[victim].block = block;
+	cache->slots[victim].last_use = cache->clock;
+	return out;
+}
+
+static MUJ_INDEX muj_packed_get_index(MUJ_INDEX index, muj_packed_document packed, muj_block_cache* cache)
+{
+	MUJSON_ASSERT(index < packed.table_size_in_indices);
+	size_t offset = (size_t)index * sizeof(MUJ_INDEX);
+	const char* block = muj_packed_get_block(packed.num_json_blocks + offset/packed.block_size, packed, cache);
+	MUJ_INDEX value;
+	memcpy(&value, block + offset%packed.block_size, sizeof(value));
+	return value;
+}
+
+// Reads the json a byte at a time, keeping the current block
+typedef struct
+{
+	const char* block;
+	size_t begin;
+	size_t end;
+} muj_packed_cursor;
+
+static char muj_packed_get_byte(size_t offset, muj_packed_cursor* cursor, muj_packed_document packed, muj_block_cache* cache)
+{
+	if (offset >= packed.json_size)
+		return 0;
+	if (cursor->block == NULL || offset < cursor->begin || offset >= cursor->end)
+	{
+		size_t block = offset / packed.block_size;
+		cursor->block = muj_packed_get_block(block, packed, cache);
+		cursor->begin = block * packed.block_size;
+		cursor->end = cursor->begin + muj_packed_block_length(block, packed);
+	}
+	return cursor->block[offset - cursor->begin];
+}
+
+static void muj_packed_copy_json(char* target, size_t offset, size_t length, muj_packed_document packed, muj_block_cache* cache)
+{
+	while (length > 0)
+	{
+		size_t block = offset / packed.block_size;
+		size_t in_block = offset % packed.block_size;
+		size_t run = muj_packed_block_length(block, packed) - in_block;
+		run = (run < length) ? run : length;
+		memcpy(target, muj_packed_get_block(block, packed, cache) + in_block, run);
+		target += run;
+		offset += run;
+		length -= run;
+	}
+}
+
+// Offset after the closing quote of the string at offset
+static size_t muj_packed_skip_string(size_t offset, muj_packed_cursor* cursor, muj_packed_document packed, muj_block_cache* cache)
+{
+	size_t i = offset+1;
+	while (i < packed.json_size)
+	{
+		char byte = muj_packed_get_byte(i, cursor, packed, cache);
+		if (byte == '"')
+			break;
+		i += (byte == '\\')?2:1;
+	}
+	return i+1;
+}
+
+// Same as get_value_end
+static size_t muj_packed_value_end(MUJ_INDEX index, muj_packed_document packed, muj_block_cache* cache)
+{
+	if (index == 0)
+		return packed.json_size;
+	MUJ_INDEX skip = muj_packed_get_index(index+1, packed, cache);
+	if (skip != 0)
+		return muj_packed_get_index(skip, packed, cache);
+	
+	muj_packed_cursor cursor = {NULL, 0, 0};
+	size_t end = packed.json_size;
+	size_t i = muj_packed_get_index(index, packed, cache);
+	size_t depth = 0;
+	do
+	{
+		char byte = muj_packed_get_byte(i++, &cursor, packed, cache);
+		switch(byte)
+		{
+			case '{': case '[':
+				depth++;
+				break;
+			case '}': case ']':
+				depth--;
+				break;
+			case '"':
+				i = muj_packed_skip_string(i-1, &cursor, packed, cache);
+				break;
+			case '+': case '-':
+				while (i < end && isByteNumber(muj_packed_get_byte(i, &cursor, packed, cache), false))
+					i++;
+				break;
+			default: // constants are a single byte
+				break;
+		}
+	} while (depth > 0 && i < end);
+	return i;
+}
+
+muj_type muj_packed_get_type(MUJ_INDEX index, muj_packed_document packed, muj_block_cache* cache)
+{
+	muj_packed_cursor cursor = {NULL, 0, 0};
+	return muj_type_of_identifier(muj_packed_get_byte(muj_packed_get_index(index, packed, cache), &cursor, packed, cache));
+}
+
+static bool muj_packed_is_empty(MUJ_INDEX container, muj_packed_document packed, muj_block_cache* cache)
+{
+	muj_packed_cursor cursor = {NULL, 0, 0};
+	char byte = muj_packed_get_byte(muj_packed_get_index(container, packed, cache)+1, &cursor, packed, cache);
+	return (byte == '}' || byte == ']');
+}
+
+// Compares like muj_compare_string, on a copy of the key in a one entry document
+static bool muj_packed_compare_key(MUJ_INDEX key, const char* comparison, muj_packed_document packed, muj_block_cache* cache)
+{
+	muj_packed_cursor cursor = {NULL, 0, 0};
+	size_t begin = muj_packed_get_index(key, packed, cache);
+	size_t length = muj_packed_skip_string(begin, &cursor, packed, cache) - begin;
+	if (begin + length > packed.json_size)
+		return false;
+	char local[256];
+	char* copy = (length <= sizeof(local)) ? local : (char*)MUJSON_MALLOC(length);
+	if (copy == NULL)
+		return false;
+	muj_packed_copy_json(copy, begin, length, packed, cache);
+	
+	MUJ_INDEX entry[2] = {0, 0};
+	size_t write_pos = length;
+	muj_document document;
+	memset(&document, 0, sizeof(document));
+	document.json.json_target = copy;
+	document.json.json_write_pos = &write_pos;
+	document.json.json_max_size = length;
+	document.table.table = entry;
+	document.table.table_size_in_indices = 2;
+	bool equal = muj_compare_string(0, comparison, document);
+	if (copy != local)
+		MUJSON_FREE(copy);
+	return equal;
+}
+
+MUJ_INDEX muj_packed_find_value_of_key_in_object(MUJ_INDEX object, const char* key, muj_packed_document packed, muj_block_cache* cache)
+{
+	if (muj_packed_get_type(object, packed, cache) != MUJ_TYPE_OBJECT || muj_packed_is_empty(object, packed, cache))
+		return 0;
+	for( MUJ_INDEX child = object+2;; )
+	{
+		if (muj_packed_compare_key(child, key, packed, cache))
+			return child+2;
+		child = muj_packed_get_index(child+3, packed, cache);
+		if (child == 0)
+			return 0;
+	}
+}
+
+MUJ_INDEX muj_packed_get_element_from_array(MUJ_INDEX array, size_t index, muj_packed_document packed, muj_block_cache* cache)
+{
+	if (muj_packed_get_type(array, packed, cache) != MUJ_TYPE_ARRAY || muj_packed_is_empty(array, packed, cache))
+		return 0;
+	MUJ_INDEX child = array+2;
+	for( size_t i=0; i<index && child != 0; i++)
+		child = muj_packed_get_index(child+1, packed, cache);
+	return child;
+}
+
+muj_document muj_unpack_value(MUJ_INDEX value, muj_packed_document packed, muj_block_cache* cache)
+{
+	muj_document out;
+	memset(&out, 0, sizeof(out));
+	if (packed.data == NULL || value >= packed.table_size_in_indices)
+		return out;
+	size_t begin = muj_packed_get_index(value, packed, cache);
+	size_t length = muj_packed_value_end(value, packed, cache) - begin;
+	muj_compressed_json json = muj_allocate_compressed_json(length);
+	if (json.json_target == NULL)
+		return out;
+	muj_packed_copy_json(json.json_target, begin, length, packed, cache);
+	json.json_target[length] = 0;
+	*json.json_write_pos = length;
+	*json.table_size = muj_count_table_size(json.json_target, length);
+	muj_document_table table = muj_allocate_document_table(json);
+	if (table.table == NULL)
+	{
+		muj_free_compressed_json(json);
+		return out;
+	}
+	out = muj_make_document(json, table);
+	muj_phase2(out);
+	return out;
+}
+
+// Images
+// A document as one block of memory that is used in place. The header is followed by the compressed json with its
+// terminating 0, the table, the optional container_sizes, escape_free and the optional type_tags, each 8 byte
+// aligned. Only builds with the same MUJ_INDEX, size_t and byte order can read an image.
+
+#if defined(MUJSON_SHM_DOCUMENTS) || defined(MUJSON_MAP_SIDECARS)
+
+#define MUJ_IMAGE_MAGIC 0x474d494e4f534a4dull // "MJSONIMG" little endian
+#define MUJ_IMAGE_VERSION 1
+#define MUJ_IMAGE_CONTAINER_SIZES 1
+#define MUJ_IMAGE_TYPE_TAGS 2
+
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t index_size;
+	uint32_t size_size;
+	uint64_t image_size;
+	size_t json_size; // the document's json_write_pos points here
+	size_t json_read_pos; // where phase 2 ended, so json_size
+	size_t table_size_in_indices; // current_write_pos and table_size
+} muj_image_header;
+
+typedef struct
+{
+	size_t json;
+	size_t table;
+	size_t container_sizes;
+	size_t escape_free;
+	size_t type_tags;
+	size_t end;
+} muj_image_layout;
+
+static size_t muj_align_image(size_t offset)
+{
+	return (offset + 7) & ~(size_t)7;
+}
+
+static muj_image_layout muj_get_image_layout(size_t json_size, size_t indices, uint32_t flags)
+{
+	muj_image_layout layout;
+	layout.json = muj_align_image(sizeof(muj_image_header));
+	layout.table = muj_align_image(layout.json + json_size + 1);
+	layout.container_sizes = muj_align_image(layout.table + indices * sizeof(MUJ_INDEX));
+	layout.escape_free = muj_align_image(layout.container_sizes + ((flags & MUJ_IMAGE_CONTAINER_SIZES) ? indices * sizeof(MUJ_INDEX) : 0));
+	layout.type_tags = muj_align_image(layout.escape_free + (indices/2 + 7)/8);
+	layout.end = muj_align_image(layout.type_tags + ((flags & MUJ_IMAGE_TYPE_TAGS) ? (indices/2 + 1)/2 : 0));
+	return layout;
+}
+
+static uint32_t muj_get_image_flags(muj_document document)
+{
+	return (document.table.container_sizes ? MUJ_IMAGE_CONTAINER_SIZES : 0) | (document.table.type_tags ? MUJ_IMAGE_TYPE_TAGS : 0);
+}
+
+static size_t muj_get_image_size(muj_document document)
+{
+	return muj_get_image_layout(*document.json.json_write_pos, *document.table.current_write_pos, muj_get_image_flags(document)).end;
+}
+
+// Writes length bytes at offset into the image
+typedef bool (*muj_image_writer)(void* context, size_t offset, const void* bytes, size_t length);
+
+// Emits everything but the padding, which has to be 0 already. The document has to be through phase 2.
+static bool muj_emit_image(muj_document document, muj_image_writer write, void* context)
+{
+	size_t json_size = *document.json.json_write_pos;
+	size_t indices = *document.table.current_write_pos;
+	uint32_t flags = muj_get_image_flags(document);
+	muj_image_layout layout = muj_get_image_layout(json_size, indices, flags);
+	
+	muj_image_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MUJ_IMAGE_MAGIC;
+	header.version = MUJ_IMAGE_VERSION;
+	header.flags = flags;
+	header.index_size = sizeof(MUJ_INDEX);
+	header.size_size = sizeof(size_t);
+	header.image_size = layout.end;
+	header.json_size = json_size;
+	header.json_read_pos = json_size;
+	header.table_size_in_indices = indices;
+	bool written = write(context, 0, &header, sizeof(header));
+	written = written && write(context, layout.json, document.json.json_target, json_size);
+	written = written && write(context, layout.table, document.table.table, indices * sizeof(MUJ_INDEX));
+	if (flags & MUJ_IMAGE_CONTAINER_SIZES)
+		written = written && write(context, layout.container_sizes, document.table.container_sizes, indices * sizeof(MUJ_INDEX));
+	written = written && write(context, layout.escape_free, document.table.escape_free, (indices/2 + 7)/8);
+	if (flags & MUJ_IMAGE_TYPE_TAGS)
+		written = written && write(context, layout.type_tags, document.table.type_tags, (indices/2 + 1)/2);
+	return written;
+}
+
+static bool muj_write_image_to_memory(void* context, size_t offset, const void* bytes, size_t length)
+{
+	memcpy((char*)context + offset, bytes, length);
+	return true;
+}
+
+// Writes muj_get_image_size bytes
+static void muj_write_image(char* image, muj_document document)
+{
+	memset(image, 0, muj_get_image_size(document));
+	muj_emit_image(document, muj_write_image_to_memory, image);
+}
+
+// A document that points into the image, json.json_target is NULL if it isn't a complete image. The table isn't
+// checked against the json, the image has to come from muj_write_image.
+static muj_document muj_get_image_document(char* image, size_t size)
+{
+	muj_document document;
+	memset(&document, 0, sizeof(document));
+	muj_image_header* header = (muj_image_header*)image;
+	if (size < sizeof(muj_image_header) || header->magic != MUJ_IMAGE_MAGIC || header->version != MUJ_IMAGE_VERSION
+		|| header->index_size != sizeof(MUJ_INDEX) || header->size_size != sizeof(size_t))
+		return document;
+	muj_image_layout layout = muj_get_image_layout(header->json_size, header->table_size_in_indices, header->flags);
+	if (header->image_size != layout.end || layout.end > size || layout.end < header->json_size || image[layout.json + header->json_size] != 0)
+		return document;
+	
+	document.json.json_target = image + layout.json;
+	document.json.json_max_size = header->json_size + 1;
+	document.json.json_write_pos = &header->json_size;
+	document.json.json_read_pos = &header->json_read_pos;
+	document.json.table_size = &header->table_size_in_indices;
+	document.json.record_container_sizes = (header->flags & MUJ_IMAGE_CONTAINER_SIZES) != 0;
+	document.json.record_type_tags = (header->flags & MUJ_IMAGE_TYPE_TAGS) != 0;
+	document.table.table = (MUJ_INDEX*)(image + layout.table);
+	document.table.container_sizes = document.json.record_container_sizes ? (MUJ_INDEX*)(image + layout.container_sizes) : NULL;
+	document.table.escape_free = (unsigned char*)image + layout.escape_free;
+	document.table.type_tags = document.json.record_type_tags ? (unsigned char*)image + layout.type_tags : NULL;
+	document.table.current_write_pos = &header->table_size_in_indices;
+	document.table.table_size_in_indices = header->table_size_in_indices;
+	return document;
+}
+#endif
+
+// Shared documents
+// The name is a segment with a generation counter, generation g is published in the segment "name.g".
+
+#ifdef MUJSON_SHM_DOCUMENTS
+#define MUJ_SHARED_NAME_MAX 256
+#define MUJ_SHARED_ATTACH_ATTEMPTS 8
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MUJ_ATOMIC_LOAD(x) __atomic_load_n(x, __ATOMIC_ACQUIRE)
+#define MUJ_ATOMIC_STORE(x, value) __atomic_store_n(x, value, __ATOMIC_RELEASE)
+#else
+#define MUJ_ATOMIC_LOAD(x) (*(volatile uint64_t*)(x)) // aligned 64 bit accesses, no ordering
+#define MUJ_ATOMIC_STORE(x, value) (*(volatile uint64_t*)(x) = (value))
+#endif
+
+typedef struct
+{
+	uint64_t generation; // 0: nothing published
+} muj_shared_control;
+
+static bool muj_get_generation_name(char* target, const char* name, uint64_t generation)
+{
+	int length = snprintf(target, MUJ_SHARED_NAME_MAX, "%s.%llu", name, (unsigned long long)generation);
+	return length > 0 && length < MUJ_SHARED_NAME_MAX;
+}
+
+// NULL if there is no such name (and create is false)
+static muj_shared_control* muj_map_shared_control(const char* name, bool create)
+{
+	int file = shm_open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (file < 0)
+		return NULL;
+	struct stat status;
+	bool sized = (fstat(file, &status) == 0 && status.st_size >= (off_t)sizeof(muj_shared_control));
+	if (!sized && create)
+		sized = (ftruncate(file, sizeof(muj_shared_control)) == 0); // zero filled, generation 0
+	void* control = MAP_FAILED;
+	if (sized)
+		control = mmap(NULL, sizeof(muj_shared_control), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	return (control == MAP_FAILED) ? NULL : (muj_shared_control*)control;
+}
+
+bool muj_publish_shared_document(const char* name, muj_document document)
+{
+	if (document.json.json_target == NULL || document.table.table == NULL)
+		return false;
+	muj_shared_control* control = muj_map_shared_control(name, true);
+	if (control == NULL)
+		return false;
+	uint64_t previous = MUJ_ATOMIC_LOAD(&control->generation);
+	char generation_name[MUJ_SHARED_NAME_MAX];
+	int file = -1;
+	if (muj_get_generation_name(generation_name, name, previous+1))
+	{
+		shm_unlink(generation_name); // left over by a publisher that didn't finish
+		file = shm_open(generation_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	size_t size = muj_get_image_size(document);
+	void* image = MAP_FAILED;
+	if (file >= 0 && ftruncate(file, (off_t)size) == 0)
+		image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (file >= 0)
+		close(file);
+	bool published = (image != MAP_FAILED);
+	if (published)
+	{
+		muj_write_image((char*)image, document);
+		munmap(image, size);
+		MUJ_ATOMIC_STORE(&control->generation, previous+1); // the image is complete before anyone can open it
+		if (previous != 0 && muj_get_generation_name(generation_name, name, previous))
+			shm_unlink(generation_name);
+	}
+	else if (file >= 0)
+		shm_unlink(generation_name);
+	munmap(control, sizeof(muj_shared_control));
+	return published;
+}
+
+muj_shared_document muj_attach_shared_document(const char* name)
+{
+	muj_shared_document shared;
+	memset(&shared, 0, sizeof(shared));
+	muj_shared_control* control = muj_map_shared_control(name, false);
+	if (control == NULL)
+		return shared;
+	// A publish unlinks the previous generation, which can happen between reading the generation and opening it
+	for( int attempt=0; attempt<MUJ_SHARED_ATTACH_ATTEMPTS && shared.image == NULL; attempt++)
+	{
+		uint64_t generation = MUJ_ATOMIC_LOAD(&control->generation);
+		char generation_name[MUJ_SHARED_NAME_MAX];
+		if (generation == 0 || !muj_get_generation_name(generation_name, name, generation))
+			break;
+		int file = shm_open(generation_name, O_RDONLY, 0);
+		if (file < 0)
+			continue;
+		struct stat status;
+		if (fstat(file, &status) == 0 && status.st_size > 0)
+		{
+			void* image = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0);
+			if (image != MAP_FAILED)
+			{
+				shared.image = image;
+				shared.image_size = (size_t)status.st_size;
+				shared.generation = generation;
+			}
+		}
+		close(file);
+	}
+	if (shared.image)
+		shared.document = muj_get_image_document((char*)shared.image, shared.image_size);
+	if (shared.document.json.json_target == NULL)
+	{
+		if (shared.image)
+			munmap(shared.image, shared.image_size);
+		munmap(control, sizeof(muj_shared_control));
+		memset(&shared, 0, sizeof(shared));
+		return shared;
+	}
+	shared.control = control;
+	return shared;
+}
+
+bool muj_is_shared_document_current(muj_shared_document shared)
+{
+	return shared.control && MUJ_ATOMIC_LOAD(&((muj_shared_control*)shared.control)->generation) == shared.generation;
+}
+
+void muj_detach_shared_document(muj_shared_document shared)
+{
+	if (shared.image)
+		munmap(shared.image, shared.image_size);
+	if (shared.control)
+		munmap(shared.control, sizeof(muj_shared_control));
+}
+
+void muj_unpublish_shared_document(const char* name)
+{
+	muj_shared_control* control = muj_map_shared_control(name, false);
+	if (control == NULL)
+		return;
+	char generation_name[MUJ_SHARED_NAME_MAX];
+	uint64_t generation = MUJ_ATOMIC_LOAD(&control->generation);
+	if (generation != 0 && muj_get_generation_name(generation_name, name, generation))
+		shm_unlink(generation_name);
+	munmap(control, sizeof(muj_shared_control));
+	shm_unlink(name);
+}
+#else
+bool muj_publish_shared_document(const char* name, muj_document document)
+{
+	MUJ_UNUSED(name);
+	MUJ_UNUSED(document);
+	return false;
+}
+
+muj_shared_document muj_attach_shared_document(const char* name)
+{
+	MUJ_UNUSED(name);
+	muj_shared_document shared;
+	memset(&shared, 0, sizeof(shared));
+	return shared;
+}
+
+bool muj_is_shared_document_current(muj_shared_document shared)
+{
+	MUJ_UNUSED(shared);
+	return false;
+}
+
+void muj_detach_shared_document(muj_shared_document shared)
+{
+	MUJ_UNUSED(shared);
+}
+
+void muj_unpublish_shared_document(const char* name)
+{
+	MUJ_UNUSED(name);
+}
+#endif
+
+// Sidecar files
+// A muj_sidecar_header that tells which json file the image after it was made from.
+
+#ifdef MUJSON_MAP_SIDECARS
+#define MUJ_SIDECAR_MAGIC 0x5844494e4f534a4dull // "MJSONIDX" little endian
+#define MUJ_SIDECAR_HASH_BYTES 65536
+#define MUJ_SIDECAR_PATH_MAX 4096
+
+#ifdef __APPLE__
+#define MUJ_MTIME_NANOSECONDS(status) ((status).st_mtimespec.tv_nsec)
+#else
+#define MUJ_MTIME_NANOSECONDS(status) ((status).st_mtim.tv_nsec)
+#endif
+
+typedef struct
+{
+	uint64_t magic;
+	uint64_t source_size;
+	int64_t source_seconds; // modification time
+	int64_t source_nanoseconds;
+	uint64_t source_hash; // of the size and the first and last MUJ_SIDECAR_HASH_BYTES
+	uint64_t reserved[3]; // keeps the image 64 byte aligned
+} muj_sidecar_header;
+
+static bool muj_get_sidecar_path(char* target, const char* json_path, const char* sidecar_path)
+{
+	int length = sidecar_path ? snprintf(target, MUJ_SIDECAR_PATH_MAX, "%s", sidecar_path) : snprintf(target, MUJ_SIDECAR_PATH_MAX, "%s.muj", json_path);
+	return length > 0 && length < MUJ_SIDECAR_PATH_MAX;
+}
+
+// The header a sidecar of the json file has to have, false if the json file can't be read
+static bool muj_get_sidecar_header(const char* json_path, muj_sidecar_header* header)
+{
+	int file = open(json_path, O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat status;
+	bool read = (fstat(file, &status) == 0);
+	memset(header, 0, sizeof(*header));
+	header->magic = MUJ_SIDECAR_MAGIC;
+	off_t offsets[2] = {0, 0}; // of the first and last MUJ_SIDECAR_HASH_BYTES
+	if (read)
+	{
+		header->source_size = (uint64_t)status.st_size;
+		header->source_seconds = (int64_t)status.st_mtime;
+		header->source_nanoseconds = (int64_t)MUJ_MTIME_NANOSECONDS(status);
+		if (status.st_size > MUJ_SIDECAR_HASH_BYTES)
+			offsets[1] = status.st_size - MUJ_SIDECAR_HASH_BYTES;
+	}
+	// Hashing all of a large file would take about as long as parsing it, the size and time catch most changes
+	char* sample = read ? (char*)MUJSON_MALLOC(MUJ_SIDECAR_HASH_BYTES) : NULL;
+	uint64_t hash = muj_hash_bytes(MUJ_HASH_OFFSET, (const char*)&header->source_size, sizeof(header->source_size));
+	read = (sample != NULL);
+	for( int i=0; i<2 && read; i++)
+	{
+		ssize_t length = pread(file, sample, MUJ_SIDECAR_HASH_BYTES, offsets[i]);
+		read = (length >= 0);
+		if (read)
+			hash = muj_hash_bytes(hash, sample, (size_t)length);
+	}
+	MUJSON_FREE(sample);
+	close(file);
+	header->source_hash = hash;
+	return read;
+}
+
+typedef struct
+{
+	int file;
+	off_t base;
+} muj_sidecar_writer;
+
+static bool muj_write_image_to_file(void* context, size_t offset, const void* bytes, size_t length)
+{
+	muj_sidecar_writer* writer = (muj_sidecar_writer*)context;
+	const char* pos = (const char*)bytes;
+	while (length > 0) // large writes can be partial
+	{
+		ssize_t written = pwrite(writer->file, pos, length, writer->base + (off_t)offset);
+		if (written <= 0)
+			return false;
+		pos += written;
+		offset += (size_t)written;
+		length -= (size_t)written;
+	}
+	return true;
+}
+
+bool muj_write_sidecar(const char* json_path, const char* sidecar_path, muj_document document)
+{
+	char path[MUJ_SIDECAR_PATH_MAX];
+	char temporary[MUJ_SIDECAR_PATH_MAX];
+	muj_sidecar_header header;
+	if (document.json.json_target == NULL || document.table.table == NULL || !muj_get_sidecar_path(path, json_path, sidecar_path)
+		|| !muj_get_sidecar_header(json_path, &header))
+		return false;
+	int length = snprintf(temporary, MUJ_SIDECAR_PATH_MAX, "%s.%ld.tmp", path, (long)getpid());
+	if (length <= 0 || length >= MUJ_SIDECAR_PATH_MAX)
+		return false;
+	
+	// Written rather than mapped, a full disk is then an error instead of a signal
+	int file = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file < 0)
+		return false;
+	size_t size = sizeof(muj_sidecar_header) + muj_get_image_size(document);
+	muj_sidecar_writer header_writer = {file, 0};
+	muj_sidecar_writer image_writer = {file, (off_t)sizeof(muj_sidecar_header)};
+	bool written = (ftruncate(file, (off_t)size) == 0); // the padding reads as 0
+	written = written && muj_write_image_to_file(&header_writer, 0, &header, sizeof(header));
+	written = written && muj_emit_image(document, muj_write_image_to_file, &image_writer);
+	written = (close(file) == 0) && written;
+	written = written && rename(temporary, path) == 0;
+	if (!written)
+		unlink(temporary);
+	return written;
+}
+
+muj_mapped_document muj_open_sidecar(const char* json_path, const char* sidecar_path)
+{
+	muj_mapped_document mapped;
+	memset(&mapped, 0, sizeof(mapped));
+	char path[MUJ_SIDECAR_PATH_MAX];
+	muj_sidecar_header expected;
+	if (!muj_get_sidecar_path(path, json_path, sidecar_path) || !muj_get_sidecar_header(json_path, &expected))
+		return mapped;
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+		return mapped;
+	struct stat status;
+	void* mapping = MAP_FAILED;
+	size_t size = 0;
+	if (fstat(file, &status) == 0 && status.st_size > (off_t)sizeof(muj_sidecar_header))
+	{
+		size = (size_t)status.st_size;
+		mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+	}
+	close(file);
+	if (mapping == MAP_FAILED)
+		return mapped;
+	if (memcmp(mapping, &expected, sizeof(expected)) == 0)
+		mapped.document = muj_get_image_document((char*)mapping + sizeof(muj_sidecar_header), size - sizeof(muj_sidecar_header));
+	if (mapped.document.json.json_target == NULL)
+	{
+		munmap(mapping, size);
+		return mapped;
+	}
+	mapped.mapping = mapping;
+	mapped.mapping_size = size;
+	return mapped;
+}
+
+void muj_close_mapped_document(muj_mapped_document mapped)
+{
+	if (mapped.mapping)
+		munmap(mapped.mapping, mapped.mapping_size);
+	else if (mapped.document.json.json_target)
+	{
+		muj_free_compressed_json(mapped.document.json);
+		muj_free_document_table(mapped.document.table);
+	}
+}
+#else
+bool muj_write_sidecar(const char* json_path, const char* sidecar_path, muj_document document)
+{
+	MUJ_UNUSED(json_path);
+	MUJ_UNUSED(sidecar_path);
+	MUJ_UNUSED(document);
+	return false;
+}
+
+muj_mapped_document muj_open_sidecar(const char* json_path, const char* sidecar_path)
+{
+	MUJ_UNUSED(json_path);
+	MUJ_UNUSED(sidecar_path);
+	muj_mapped_document mapped;
+	memset(&mapped, 0, sizeof(mapped));
+	return mapped;
+}
+
+void muj_close_mapped_document(muj_mapped_document mapped)
+{
+	if (mapped.document.json.json_target)
+	{
+		muj_free_compressed_json(mapped.document.json);
+		muj_free_document_table(mapped.document.table);
+	}
+}
+#endif
+
+#ifndef MUJSON_NO_HIGH_LEVEL_FUNCTIONS
+muj_mapped_document muj_load_document_with_sidecar(const char* json_path, const char* sidecar_path, bool record_indexes)
+{
+	muj_mapped_document mapped = muj_open_sidecar(json_path, sidecar_path);
+	if (mapped.document.json.json_target)
+		return mapped;
+	FILE* f = fopen(json_path, "rb");
+	if (f == NULL)
+		return mapped;
+	muj_compressed_json target = muj_allocate_compressed_json((size_t)file_size(f));
+	if (target.json_target == NULL)
+	{
+		fclose(f);
+		return mapped;
+	}
+	target.record_container_sizes = record_indexes;
+	target.record_type_tags = record_indexes;
+	muj_source source;
+	source.file = f;
+	muj_problem_state saved = muj_save_problem(); // an unread problem from before isn't one of this parse
+	muj_phase1(source, target);
+	fclose(f);
+	target = muj_shrink_compressed_json(target);
+	muj_document_table table = muj_allocate_document_table(target);
+	if (table.table == NULL)
+	{
+		muj_free_compressed_json(target);
+		muj_restore_problem(saved);
+		return mapped;
+	}
+	mapped.document = muj_make_document(target, table);
+	muj_phase2(mapped.document);
+	
+	// Only complete documents are worth keeping, the problem stays for muj_get_last_error
+	bool complete = (muj_get_error().code == MUJ_ERROR_NONE);
+	muj_restore_problem(saved);
+	if (!complete || !muj_write_sidecar(json_path, sidecar_path, mapped.document))
+		return mapped;
+	muj_mapped_document sidecar = muj_open_sidecar(json_path, sidecar_path);
+	if (sidecar.document.json.json_target == NULL)
+		return mapped;
+	muj_close_mapped_document(mapped);
+	return sidecar;
+}
+#endif
+
 #if 0
 
 void print_string(MUJ_INDEX string, muj_document document)
@@ -1,7 +1,13 @@
 #include <mujson.hpp>
 
+#include <algorithm>
 #include <iostream>
 
+// The intrinsics are C++ declarations; mujson.c including them again inside extern "C" is then a no-op
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
 extern "C"
 {
 
@@ -25,50 +31,231 @@ bool muj_peek_byte(muj_source source, char* byte)
 	return true;
 }
 
+size_t muj_read_bytes(muj_source source, char* target, size_t length)
+{
+	source.file->read(target, (std::streamsize)length);
+	return (size_t)source.file->gcount();
+}
+
+long muj_tell_source(muj_source source)
+{
+	source.file->clear(); // Problems are often found at the end of the stream
+	return (long)source.file->tellg();
+}
+
+bool muj_seek_source(muj_source source, long position)
+{
+	source.file->clear();
+	return !source.file->seekg(position).fail();
+}
+
 }
 
 namespace MUJSON_NAMESPACE
 {
 	
-Reader::Reader()
+DocumentContainer::DocumentContainer()
+	: jsonCapacity(0)
+	, tableCapacity(0)
+	, references(0)
 {
 	memset(&document, 0, sizeof(document));
+	muj_init_arena(&arena, 4096);
 }
 
-Reader::~Reader()
+DocumentContainer::~DocumentContainer()
 {
 	muj_free_compressed_json(document.json);
 	muj_free_document_table(document.table);
+	muj_free_arena(&arena);
 }
 
-bool Reader::parse(std::istream& inStream, Value& root)
+bool DocumentContainer::decodedBefore(const DecodedString& decoded, MUJ_INDEX string)
+{
+	return decoded.string < string;
+}
+
+muj_string_view DocumentContainer::getStringView(MUJ_INDEX string)
+{
+	if (muj_is_string_escape_free(string, document))
+		return muj_get_string_view(string, document, NULL);
+	std::vector<DecodedString>::const_iterator found = std::lower_bound(decodedStrings.begin(), decodedStrings.end(), string, decodedBefore);
+	if (found == decodedStrings.end() || found->string != string)
+		return muj_get_string_view(string, document, NULL); // parse failed before decoding, data is NULL
+	return found->view;
+}
+
+// One arena allocation for all of them, views and member traversal then only read
+void DocumentContainer::decodeEscapedStrings()
+{
+	size_t length = 0;
+	for (MUJ_INDEX string = 0; string < document.table.table_size_in_indices; string += 2)
+	{
+		if (!muj_is_string(string, document) || muj_is_string_escape_free(string, document))
+			continue;
+		DecodedString decoded;
+		decoded.string = string;
+		decoded.view = muj_get_string_view(string, document, NULL);
+		length += decoded.view.length;
+		decodedStrings.push_back(decoded);
+	}
+	char* target = length ? muj_arena_alloc(&arena, length) : NULL;
+	for (size_t i = 0; i < decodedStrings.size(); i++)
+	{
+		decodedStrings[i].view.data = target;
+		if (target)
+		{
+			muj_copy_string(target, decodedStrings[i].string, document);
+			target += decodedStrings[i].view.length;
+		}
+	}
+}
+
+bool DocumentContainer::parse(std::istream& inStream, Value& root)
 {
 	std::streampos position = inStream.tellg();
 	inStream.seekg(0, std::ios_base::end);
 	size_t originalJsonSize = inStream.tellg();
 	inStream.seekg(position);
 	
-	std::cout << "Json size: " << originalJsonSize << std::endl;
-	
-	document.json = muj_allocate_compressed_json(originalJsonSize);
+	muj_reset_arena(&arena);
+	decodedStrings.clear();
+	if (jsonCapacity < originalJsonSize+1)
+	{
+		muj_free_compressed_json(document.json);
+		document.json = muj_allocate_compressed_json(originalJsonSize);
+#ifdef MUJSON_CONTAINER_SIZES
+		document.json.record_container_sizes = true; // Object and Array get their size without walking the children
+#endif
+		// Values reached by lookups are type checked in random order, where a tag in the table avoids a load
+		// from the compressed json, for 1 byte per 2 values (1/16 of the table)
+		document.json.record_type_tags = true;
+		jsonCapacity = document.json.json_max_size;
+	}
+	else
+	{
+		document.json.json_max_size = originalJsonSize+1;
+		*document.json.json_write_pos = 0;
+		*document.json.json_read_pos = 0;
+		*document.json.table_size = 0;
+	}
 	
 	muj_source source;
 	source.file = &inStream;
 	
 	muj_phase1(source, document.json);
 	
-	document.table = muj_allocate_document_table(document.json);
+	size_t indices = *document.json.table_size;
+	if (document.table.table == 0 || tableCapacity < indices)
+	{
+		muj_free_document_table(document.table);
+		document.table = muj_allocate_document_table(document.json);
+		tableCapacity = document.table.table_size_in_indices;
+	}
+	else
+	{
+		document.table.table_size_in_indices = indices;
+		*document.table.current_write_pos = 0;
+		memset(document.table.escape_free, 0, (indices/2 + 7)/8);
+		if (document.table.type_tags)
+			memset(document.table.type_tags, 0, (indices/2 + 1)/2);
+	}
 	
 	if (muj_get_last_error())
 		return false;
 		
 	muj_phase2(document);
+	if (!muj_get_last_error())
+		decodeEscapedStrings();
 	
 	root = Value(*this, 0);
 	
 	return !(muj_get_last_error());
 }
 
+Document::Document(DocumentContainer* _container)
+	: container(_container)
+{
+	container->references++;
+}
+
+Document::Document(const Document& other)
+	: container(other.container)
+{
+	if (container)
+		container->references++;
+}
+
+Document::~Document()
+{
+	if (container && --container->references == 0)
+		delete container;
+}
+
+Value Document::getRoot() const
+{
+	MUJSON_ASSERT(container);
+	return Value(*container, 0);
+}
+
+void Document::shrink()
+{
+	if (!container)
+		return;
+	container->document.json = muj_shrink_compressed_json(container->document.json);
+	container->jsonCapacity = container->document.json.json_max_size;
+}
+
+muj_document Document::getDocument() const
+{
+	if (container)
+		return container->getDocument();
+	muj_document out;
+	memset(&out, 0, sizeof(out));
+	return out;
+}
+
+Reader::Reader()
+	: spare(0)
+{
+}
+
+Reader::~Reader()
+{
+	delete spare;
+}
+
+void Reader::swap(Reader& other)
+{
+	document.swap(other.document);
+	DocumentContainer* spare_ = spare;
+	spare = other.spare;
+	other.spare = spare_;
+}
+
+bool Reader::parse(std::istream& inStream, Value& root)
+{
+	if (!document.empty() && document.container->references > 1)
+		document = Document(); // Shared, leave it to the other owners
+	if (document.empty())
+	{
+		document = Document(spare ? spare : new DocumentContainer());
+		spare = 0;
+	}
+	return document.container->parse(inStream, root);
+}
+
+void Reader::reset()
+{
+	if (!document.empty() && document.container->references == 1 && !spare)
+	{
+		spare = document.container;
+		spare->references = 0;
+		document.container = 0;
+	}
+	document = Document();
+}
+
 Value Value::operator[](const char* name) const
 {
 	return Value( *document, muj_find_value_of_key_in_object(index, const_cast<char*>(name), document->getDocument()));
@@ -107,14 +294,30 @@ long Value::asLong() const
 	return muj_get_long(index, document->getDocument());
 }
 	
-std::string Value::asString() const
+static std::string copyString(MUJ_INDEX index, muj_document document)
 {
+	muj_string_view view = muj_get_string_view(index, document, NULL);
+	if (view.data)
+		return std::string(view.data, view.length);
 	std::string out;
-	out.resize(muj_get_string_length_excluding_null(index, document->getDocument()));
-	muj_copy_string(&out[0], index, document->getDocument());
+	out.resize(view.length);
+	muj_copy_string(&out[0], index, document);
 	return out;
 }
 
+std::string Value::asString() const
+{
+	return copyString(index, document->getDocument());
+}
+
+#if __cplusplus >= 201703L
+std::string_view Value::asStringView() const
+{
+	muj_string_view view = document->getStringView(index);
+	return std::string_view(view.data, view.data ? view.length : 0);
+}
+#endif
+
 bool Value::isArray() const
 {
 	return muj_is_array(index, document->getDocument());
@@ -184,9 +387,7 @@ Object::Object(const Value& value)
 		keys.resize(size);
 		for( unsigned i=0; i<keyValuePairs.size(); i++)
 		{
-			MUJ_INDEX key = keyValuePairs[i].key;
-			keys[i].resize(muj_get_string_length_excluding_null(key, document->getDocument()));
-			muj_copy_string(&keys[i][0], key, document->getDocument());
+			keys[i] = copyString(keyValuePairs[i].key, document->getDocument());
 		}
 	}
 }
@@ -12,6 +12,8 @@
 
 #ifdef MUJSON_USE_CPP_INTERFACE
 #define MUJSON_MANUAL_STREAM
+#define MUJSON_MANUAL_STREAM_POSITIONS
+#define MUJSON_MANUAL_STREAM_READ_BYTES
 #define MUJSON_NO_HIGH_LEVEL_FUNCTIONS
 #endif
 
@@ -50,18 +52,74 @@ typedef struct
 	MUJ_INDEX value;
 } muj_key_value_pair;
 
+// Deepest nesting of objects and arrays phase 2 accepts
+#ifndef MUJSON_MAX_DEPTH
+#define MUJSON_MAX_DEPTH 1024
+#endif
+
+#define MUJ_SHAPE_MAX_DEPTH 8
+#define MUJ_SHAPE_MAX_KEYS 64
+#define MUJ_SHAPE_MAX_BYTES 1024
+
+typedef struct
+{
+	char bytes[MUJ_SHAPE_MAX_BYTES]; // compressed keys (with quotes) of the last object at this depth, back to back
+	uint16_t ends[MUJ_SHAPE_MAX_KEYS];
+	uint64_t colon_follows; // bit per key: the ':' came right after the key in the source
+	size_t num_keys;
+	size_t cursor; // next expected key
+} muj_shape;
+
+// Optional key order cache for phase 1, can be reused over documents (NDJSON). Initialize with muj_init_shape_cache.
+typedef struct
+{
+	muj_shape levels[MUJ_SHAPE_MAX_DEPTH];
+	size_t depth;
+	size_t hits; // keys that matched the cached shape
+	size_t misses;
+} muj_shape_cache;
+
+typedef double (*muj_clock_function)(void* user_data); // wall time in seconds
+
+// Counters for finding out where time goes. Only filled if mujson.c is compiled with MUJSON_INSTRUMENT, otherwise
+// they stay 0 and nothing is counted. Initialize with muj_init_stats, can be shared by several documents.
+typedef struct
+{
+	size_t phase1_bytes_read; // source bytes, 0 for manual streams that can't tell their position
+	size_t phase1_bytes_written; // compressed bytes
+	size_t phase2_bytes_read;
+	size_t phase2_indices_written; // table indices, two per value
+	size_t lookups; // muj_find_value_of_key_in_object, muj_find_value_of_key_id and muj_get_element_from_array
+	size_t lookup_hops; // steps over the skip chain in lookups and in counts without container_sizes
+	size_t number_parses; // muj_get_long, muj_get_double and muj_get_int64
+	size_t string_copies; // strings decoded by muj_copy_string and by muj_get_string_view into the arena
+	size_t string_bytes_copied;
+	double phase1_seconds; // only measured with a clock
+	double phase2_seconds;
+	muj_clock_function clock; // Optional, NULL by default
+	void* clock_user_data;
+} muj_stats;
+
 typedef struct
 {
-	char* json_target;
+	char* json_target; // json_max_size bytes and one more, see muj_phase2
 	size_t json_max_size;
 	size_t* json_write_pos;
 	size_t* json_read_pos;
 	size_t* table_size;
+	bool validate_utf8; // Phase 1 fails on strings with invalid UTF-8 or escapes or raw control characters, false by default
+	muj_shape_cache* shape_cache; // Optional, NULL by default
+	bool record_container_sizes; // Tables allocated for this json get container_sizes, false by default
+	bool record_type_tags; // Tables allocated for this json get type_tags, false by default
+	muj_stats* stats; // Optional, NULL by default, see muj_stats
 } muj_compressed_json;
 
 typedef struct
 {
 	MUJ_INDEX* table;
+	unsigned char* escape_free; // One bit per table entry pair (index/2), set by phase 2 for strings without escapes
+	MUJ_INDEX* container_sizes; // Optional, indexed like the table: child count at [container], subtree end at [container+1]
+	unsigned char* type_tags; // Optional, 4 bits per table entry pair (index/2, low nibble first): muj_type | MUJ_TYPE_EMPTY
 	size_t* current_write_pos;
 	size_t table_size_in_indices;
 } muj_document_table;
@@ -72,6 +130,178 @@ typedef struct
 	muj_document_table table;
 } muj_document;
 
+// Type tags let type checks skip the load from the compressed json. Only muj_phase2 fills them, entries without a
+// tag (MUJ_TYPE_UNKNOWN) are looked up in the compressed json.
+typedef enum
+{
+	MUJ_TYPE_UNKNOWN,
+	MUJ_TYPE_OBJECT,
+	MUJ_TYPE_ARRAY,
+	MUJ_TYPE_STRING, // keys too
+	MUJ_TYPE_NUMBER,
+	MUJ_TYPE_NULL,
+	MUJ_TYPE_TRUE,
+	MUJ_TYPE_FALSE
+} muj_type;
+#define MUJ_TYPE_EMPTY 8 // tag bit for objects and arrays without children
+
+typedef enum
+{
+	MUJ_EDIT_SET_VALUE,
+	MUJ_EDIT_INSERT_KEY,
+	MUJ_EDIT_DELETE_KEY,
+	MUJ_EDIT_APPEND_ELEMENT,
+	MUJ_EDIT_INSERT_ELEMENT,
+	MUJ_EDIT_DELETE_ELEMENT
+} muj_edit_type;
+
+typedef enum
+{
+	MUJ_VALUE_TEXT, // standard json
+	MUJ_VALUE_COMPRESSED, // compressed json, for example a value of another document
+	MUJ_VALUE_COMPRESSED_WITHOUT_NULLS // compressed json of which null object members are dropped (merge patch)
+} muj_value_format;
+
+typedef struct
+{
+	muj_edit_type type;
+	MUJ_INDEX index; // The value, object, key or array (element edits) the edit applies to
+	size_t begin; // Range in the compressed json that is replaced (begin == end: insertion)
+	size_t end;
+	const char* key;
+	size_t key_length;
+	const char* value;
+	size_t value_length;
+	muj_value_format value_format;
+} muj_edit;
+
+// Copy-on-write edits on top of a read-only document. The document and the
+// strings passed to the edit functions are referenced, not copied.
+typedef struct
+{
+	muj_document document;
+	muj_edit* edits;
+	size_t* num_edits;
+	size_t max_edits;
+} muj_overlay;
+
+typedef struct
+{
+	const char* data; // not null terminated, NULL if the string had to be decoded and there was no memory
+	size_t length;
+} muj_string_view;
+
+typedef struct muj_arena_block
+{
+	struct muj_arena_block* previous;
+	size_t size;
+	size_t used;
+} muj_arena_block;
+
+// Memory for decoded strings. Grows in blocks and is freed at once.
+typedef struct
+{
+	muj_arena_block* current;
+	size_t block_size;
+} muj_arena;
+
+// Optional, computed after phase 2 by muj_compute_subtree_hashes
+typedef struct
+{
+	uint64_t* hashes; // one per value or key: hashes[index/2]
+	size_t num_hashes;
+} muj_subtree_hashes;
+
+typedef struct
+{
+	MUJ_INDEX subtree;
+	MUJ_INDEX first; // the first subtree in the document with the same content
+} muj_duplicate;
+
+#define MUJ_NO_KEY_ID ((MUJ_INDEX)-1)
+
+// Optional, computed after phase 2 by muj_intern_keys
+typedef struct
+{
+	MUJ_INDEX* ids; // per table entry pair: ids[key/2] is the id of the key
+	MUJ_INDEX* keys; // per id: the first key in the document with that id
+	MUJ_INDEX* slots; // hash set of ids+1
+	size_t num_slots;
+	size_t num_keys;
+	size_t num_entries;
+} muj_key_dictionary;
+
+typedef enum
+{
+	MUJ_COLUMN_INT64, // integers only, numbers with a fraction or exponent are null
+	MUJ_COLUMN_DOUBLE,
+	MUJ_COLUMN_BOOL,
+	MUJ_COLUMN_STRING
+} muj_column_type;
+
+// A column in the Apache Arrow memory layout. Missing values and values of another type are null.
+typedef struct
+{
+	const char* field; // set by the caller: the key as written in the json, without quotes
+	muj_column_type type; // set by the caller
+	size_t length; // number of rows
+	size_t null_count;
+	uint8_t* validity; // bit per row (LSB first), set if the row has a value
+	void* values; // int64_t or double per row, a bit per row for booleans, length+1 int32_t offsets into data for strings
+	char* data; // strings: decoded UTF-8
+	size_t data_size;
+} muj_column;
+
+// A document compressed at rest, see muj_pack_document
+typedef struct
+{
+	char* data; // compressed blocks back to back, NULL if out of memory
+	size_t* block_ends; // end of each block in data, the json blocks and then the table blocks
+	size_t block_size; // uncompressed
+	size_t num_json_blocks;
+	size_t num_table_blocks;
+	size_t json_size;
+	size_t table_size_in_indices;
+	uint64_t id; // tells the documents in a cache apart
+} muj_packed_document;
+
+typedef struct
+{
+	uint64_t owner; // id of the packed document, 0 if the slot is empty
+	size_t block;
+	uint64_t last_use;
+} muj_block_cache_slot;
+
+// Decompressed blocks, least recently used ones are replaced. Can be shared by packed documents with the same block size.
+typedef struct
+{
+	char* memory; // num_slots blocks, NULL if out of memory
+	muj_block_cache_slot* slots;
+	size_t num_slots;
+	size_t block_size;
+	uint64_t clock;
+	size_t hits;
+	size_t misses;
+} muj_block_cache;
+
+// A document published in shared memory, mapped read-only: don't run phase 2 on it or edit it
+typedef struct
+{
+	muj_document document; // json.json_target is NULL if nothing could be attached
+	void* image;
+	size_t image_size;
+	void* control; // the generation counter of the name
+	uint64_t generation; // of this image
+} muj_shared_document;
+
+// A document loaded from a sidecar file, mapped read-only: don't run phase 2 on it or edit it
+typedef struct
+{
+	muj_document document; // json.json_target is NULL if nothing could be loaded
+	void* mapping; // NULL if the document was parsed because the sidecar couldn't be written
+	size_t mapping_size;
+} muj_mapped_document;
+
 #ifndef MUJSON_NO_HIGH_LEVEL_FUNCTIONS
 muj_document muj_load_document_from_file(FILE* f);
 void muj_unload_document(muj_document document);
@@ -105,21 +335,84 @@ static bool muj_peek_byte(muj_source source, char* byte)
 	return success;
 }
 
+// Reads up to length bytes, returns how many. Manual streams that provide the positions below can define
+// MUJSON_MANUAL_STREAM_READ_BYTES and provide this too, phase 1 then reads the keys a shape cache expects at once.
+static size_t muj_read_bytes(muj_source source, char* target, size_t length)
+{
+	return fread(target, 1, length, source.file);
+}
+
+// Only used to locate problems in phase 1. Manual streams define MUJSON_MANUAL_STREAM_POSITIONS to provide these.
+static long muj_tell_source(muj_source source)
+{
+	return ftell(source.file);
+}
+
+static bool muj_seek_source(muj_source source, long position)
+{
+	return fseek(source.file, position, SEEK_SET) == 0;
+}
+
 #endif
 
+typedef enum
+{
+	MUJ_ERROR_NONE,
+	MUJ_ERROR_EOF, // the input ended inside a value
+	MUJ_ERROR_UNEXPECTED_BYTE,
+	MUJ_ERROR_INVALID_STRING, // invalid UTF-8, escape or raw control character, see validate_utf8
+	MUJ_ERROR_TARGET_TOO_SMALL,
+	MUJ_ERROR_TABLE_TOO_SMALL,
+	MUJ_ERROR_OUT_OF_BOUNDS, // phase 2 read past the compressed json
+	MUJ_ERROR_MAX_DEPTH
+} muj_error_code;
+
+#define MUJ_UNKNOWN_POSITION ((size_t)-1)
+
+typedef struct
+{
+	muj_error_code code;
+	int phase; // 1 or 2
+	const char* message; // the string muj_get_last_error returns
+	size_t offset; // phase 1: bytes read from the source, phase 2: position in the compressed json
+	size_t line; // phase 1, from 1, 0 if the source can't seek
+	size_t column; // in bytes, from 1, of the next byte in the source
+	int expected; // byte, -1 if any
+	int found; // byte, -1 at the end of the input or if not applicable
+} muj_error;
+
+// mujson never prints. Problems are kept until muj_get_last_error and passed to the log function if there is one.
+typedef void (*muj_log_function)(const muj_error* error, void* user_data);
+void muj_set_log_function(muj_log_function log, void* user_data);
+muj_error muj_get_error(void); // code MUJ_ERROR_NONE if there was no problem since the last muj_get_last_error
+
 const char* muj_get_last_error();
 size_t muj_get_string_length(MUJ_INDEX string, muj_document document);
-void muj_copy_string(char* target, MUJ_INDEX string, muj_document document);
+void muj_copy_string(char* target, MUJ_INDEX string, muj_document document); // decodes escapes to UTF-8, no null terminator
+bool muj_compare_string(MUJ_INDEX string, const char* comparison, muj_document document); // comparison is null terminated UTF-8
+// Strings without escapes are viewed directly in the compressed json, others are decoded into the arena (may be NULL:
+// then data is NULL for strings with escapes). Every call decodes again and takes new arena memory, so keep the view
+// (or reset the arena) when the same string is viewed repeatedly.
+muj_string_view muj_get_string_view(MUJ_INDEX string, muj_document document, muj_arena* arena);
+bool muj_is_string_escape_free(MUJ_INDEX string, muj_document document);
+void muj_init_arena(muj_arena* arena, size_t block_size);
+void muj_free_arena(muj_arena* arena);
+void muj_reset_arena(muj_arena* arena); // Keeps the newest block for reuse
+char* muj_arena_alloc(muj_arena* arena, size_t size);
 size_t muj_object_count_number_of_children(MUJ_INDEX object, muj_document document);
 size_t muj_array_count_number_of_elements(MUJ_INDEX array, muj_document document);
+// Index after the last table entry of value and everything in it. O(1) for containers with container_sizes.
+MUJ_INDEX muj_get_subtree_end(MUJ_INDEX value, muj_document document);
 void muj_object_copy_children(muj_key_value_pair* children, MUJ_INDEX object, muj_document document);
 void muj_array_copy_elements(MUJ_INDEX* children, MUJ_INDEX array, muj_document document);
 MUJ_INDEX muj_get_root_object(muj_document_table table);
 long muj_get_long(MUJ_INDEX number, muj_document document);
 double muj_get_double(MUJ_INDEX number, muj_document document);
-MUJ_INDEX muj_find_value_of_key_in_object(MUJ_INDEX object, char* key, muj_document document); // slow if used more than once
+bool muj_get_int64(MUJ_INDEX number, muj_document document, int64_t* out); // false if it has a fraction or exponent, or doesn't fit
+MUJ_INDEX muj_find_value_of_key_in_object(MUJ_INDEX object, const char* key, muj_document document); // slow if used more than once
 MUJ_INDEX muj_get_element_from_array(MUJ_INDEX array, size_t index, muj_document document); // slow if used more than once
 
+muj_type muj_get_type(MUJ_INDEX index, muj_document document);
 bool muj_is_object(MUJ_INDEX index, muj_document document);
 bool muj_is_array(MUJ_INDEX index, muj_document document);
 bool muj_is_string(MUJ_INDEX index, muj_document document);
@@ -136,14 +429,137 @@ muj_document_table muj_allocate_document_table(muj_compressed_json what_for);
 void muj_free_document_table(muj_document_table table);
 muj_compressed_json muj_allocate_compressed_json(size_t uncompressedSizeInBytes);
 void muj_free_compressed_json(muj_compressed_json json);
+// Gives back what phase 1 didn't use: after phase 1, *json_write_pos is the compressed size and the allocation is
+// the size of the input. Returns json unchanged if out of memory. Pointers into the old json_target are invalid after.
+muj_compressed_json muj_shrink_compressed_json(muj_compressed_json json);
 muj_document muj_make_document(muj_compressed_json json, muj_document_table table);
 
+// Large buffers, only with MUJSON_LARGE_BUFFERS on Linux (ignored otherwise): compressed json and tables of at least
+// min_size bytes are mapped instead of allocated with MUJSON_MALLOC. With huge_pages they get MAP_HUGETLB pages if the
+// system has them reserved and transparent huge pages if not. With a numa_node they are placed on that node, for
+// example the one of the thread that will query the document. Mapping falls back to MUJSON_MALLOC if it fails.
+typedef struct
+{
+	size_t min_size; // 0: never map, the default
+	bool huge_pages;
+	int numa_node; // -1: wherever the memory is first touched, the default
+} muj_large_buffers;
+void muj_set_large_buffers(muj_large_buffers settings); // applies to buffers allocated after the call
+int muj_get_numa_node(void); // of the calling thread, -1 if unknown
+
 void muj_phase1(muj_source source, muj_compressed_json target);
+void muj_init_shape_cache(muj_shape_cache* cache);
+void muj_init_stats(muj_stats* stats);
+// Writes a 0 byte at json_target[*json_write_pos] as a sentinel, so the buffer needs one writable byte past the
+// compressed json (json_max_size+1 bytes in all). muj_allocate_compressed_json reserves it; a buffer set up by hand
+// must too. muj_phase2_recursive only reads the compressed json.
 void muj_phase2( muj_document document);
+void muj_phase2_recursive(muj_document document);
 
 // Generic usage functions
 char* muj_alloc_string_copy_target(MUJ_INDEX string, muj_document document);
 char* muj_alloc_string_copy_target_and_copy(MUJ_INDEX string, muj_document document);
 void muj_free_string_copy_target(char* string);
 
+// Writes the document as standard minified json in one linear pass over the compressed json.
+// Returns the length of the minified json. Writes at most target_size bytes (no null terminator),
+// so call with a NULL target and size 0 first to get the required size. Returns 0 if out of memory.
+size_t muj_write_minified(char* target, size_t target_size, muj_document document);
+
+// Overlay: edits cost proportional to the edits, the document itself is never modified.
+// Values are standard json text, keys are the json string contents without the quotes.
+// The edit functions return false if the overlay is full (or the key to delete doesn't exist).
+muj_overlay muj_allocate_overlay(muj_document document, size_t max_edits);
+void muj_free_overlay(muj_overlay overlay);
+void muj_reset_overlay(muj_overlay overlay);
+bool muj_overlay_set_value(muj_overlay overlay, MUJ_INDEX value, const char* json);
+bool muj_overlay_insert_key(muj_overlay overlay, MUJ_INDEX object, const char* key, const char* json); // appended at the end of the object
+bool muj_overlay_delete_key(muj_overlay overlay, MUJ_INDEX object, const char* key);
+bool muj_overlay_append_element(muj_overlay overlay, MUJ_INDEX array, const char* json);
+bool muj_overlay_insert_element(muj_overlay overlay, MUJ_INDEX array, size_t before, const char* json);
+bool muj_overlay_delete_element(muj_overlay overlay, MUJ_INDEX array, size_t at);
+// Streams the original document with the edits spliced in as minified json, same semantics as muj_write_minified.
+size_t muj_overlay_write_minified(char* target, size_t target_size, muj_overlay overlay);
+// Streams the original document with the edits spliced in into a new compressed document and runs phase 2 on it.
+// json.json_target is NULL if out of memory. Free with muj_free_compressed_json and muj_free_document_table.
+muj_document muj_overlay_make_document(muj_overlay overlay);
+
+// Patching: applies a RFC 6902 json patch or a RFC 7386 merge patch (both parsed with mujson) to source,
+// producing a new document in result. The source is not modified. Returns false if the patch is malformed,
+// a path doesn't exist or a test operation fails; result is then left untouched.
+// test compares structurally: {"a":1,"b":2} equals {"b":2,"a":1}, 1 equals 1.0 and strings are compared after decoding.
+bool muj_apply_json_patch(muj_document* result, muj_document source, muj_document patch);
+bool muj_apply_merge_patch(muj_document* result, muj_document source, muj_document patch);
+
+// Writes a RFC 6902 json patch that turns from into to, same output semantics as muj_write_minified.
+// Identical subtrees are skipped by comparing their compressed text, without descending into them.
+size_t muj_diff(char* target, size_t target_size, muj_document from, muj_document to);
+
+// Subtree hashes: one linear pass over the table, bottom-up. Values with the same compressed text hash the same,
+// also across documents. hashes is NULL if out of memory.
+muj_subtree_hashes muj_compute_subtree_hashes(muj_document document);
+void muj_free_subtree_hashes(muj_subtree_hashes hashes);
+uint64_t muj_subtree_hash(MUJ_INDEX index, muj_subtree_hashes hashes);
+// Deep equality: compares the hashes first, the compressed text only if they match.
+bool muj_subtree_equal(MUJ_INDEX a, muj_document document_a, muj_subtree_hashes hashes_a, MUJ_INDEX b, muj_document document_b, muj_subtree_hashes hashes_b);
+// Reports objects and arrays of at least min_length compressed bytes that are equal to an earlier one, in document order.
+// Subtrees inside a reported duplicate are not reported. Returns the number of duplicates, which can exceed
+// max_duplicates (only max_duplicates are written). Returns 0 if out of memory.
+size_t muj_find_duplicate_subtrees(muj_duplicate* duplicates, size_t max_duplicates, size_t min_length, muj_document document, muj_subtree_hashes hashes);
+
+// Key interning: gives every distinct key (compared as written, escapes included) an id from 0 to num_keys-1.
+// ids is NULL if out of memory. Keys for muj_find_key_id are the json string contents without the quotes.
+muj_key_dictionary muj_intern_keys(muj_document document);
+void muj_free_key_dictionary(muj_key_dictionary dictionary);
+MUJ_INDEX muj_get_key_id(MUJ_INDEX key, muj_key_dictionary dictionary);
+MUJ_INDEX muj_find_key_id(const char* key, muj_document document, muj_key_dictionary dictionary); // MUJ_NO_KEY_ID if not in the document
+MUJ_INDEX muj_get_key_of_id(MUJ_INDEX id, muj_key_dictionary dictionary); // for the string functions
+MUJ_INDEX muj_find_value_of_key_id(MUJ_INDEX object, MUJ_INDEX id, muj_document document, muj_key_dictionary dictionary); // integer compares only
+
+// Columnar extraction: fills the columns from the objects in array with a single walk over the table.
+// Returns false if out of memory (the columns are then freed). Buffers are 8 byte aligned and padded.
+bool muj_extract_columns(muj_column* columns, size_t num_columns, MUJ_INDEX array, muj_document document);
+void muj_free_columns(muj_column* columns, size_t num_columns);
+
+// Compression at rest: a packed document holds the compressed json and the table of a document in blocks, each
+// compressed with a small built-in LZ77 codec. Reading decompresses only the blocks it touches, into a block cache,
+// so finding a value and unpacking it costs about its size. Indices are the ones of the original document.
+// block_size is rounded down to a multiple of 8 and at most 65536 (0: 65536). data is NULL if out of memory.
+muj_packed_document muj_pack_document(muj_document document, size_t block_size);
+void muj_free_packed_document(muj_packed_document packed);
+size_t muj_packed_document_size(muj_packed_document packed); // bytes held
+muj_block_cache muj_allocate_block_cache(size_t num_slots, size_t block_size);
+void muj_free_block_cache(muj_block_cache cache);
+muj_type muj_packed_get_type(MUJ_INDEX index, muj_packed_document packed, muj_block_cache* cache);
+MUJ_INDEX muj_packed_find_value_of_key_in_object(MUJ_INDEX object, const char* key, muj_packed_document packed, muj_block_cache* cache);
+MUJ_INDEX muj_packed_get_element_from_array(MUJ_INDEX array, size_t index, muj_packed_document packed, muj_block_cache* cache);
+// A standalone document with a copy of value at the root (index 0 for the whole document). json.json_target is NULL
+// if out of memory. Free with muj_free_compressed_json and muj_free_document_table.
+muj_document muj_unpack_value(MUJ_INDEX value, muj_packed_document packed, muj_block_cache* cache);
+
+// Shared documents, only with MUJSON_SHARED_DOCUMENTS on POSIX systems (publishing fails otherwise, link with -lrt on
+// older glibc). The table entries are offsets, so a document can be copied as is into a shared memory segment and used
+// from there by other processes without parsing. Each publish makes a new generation in its own segment and then
+// switches the name over to it, processes that are attached to the old one keep it until they detach. name is a
+// shared memory object name ("/name"). Only one process at a time may publish a name.
+bool muj_publish_shared_document(const char* name, muj_document document);
+muj_shared_document muj_attach_shared_document(const char* name); // the current generation
+bool muj_is_shared_document_current(muj_shared_document shared); // false after a newer generation was published
+void muj_detach_shared_document(muj_shared_document shared);
+void muj_unpublish_shared_document(const char* name); // attached processes keep their generation
+
+// Sidecar files, only with MUJSON_SIDECAR_FILES on POSIX systems (writing and opening fail otherwise). A sidecar holds
+// what phase 1 and 2 made of a json file, with container_sizes and type_tags if the document has them, so later opens
+// map it instead of parsing. It is only used while the json file has the same size, modification time and hash of its
+// first and last 64 KB, and is written to a temporary file that is then renamed, so readers never see half of one.
+// sidecar_path NULL: json_path with ".muj" appended.
+bool muj_write_sidecar(const char* json_path, const char* sidecar_path, muj_document document);
+muj_mapped_document muj_open_sidecar(const char* json_path, const char* sidecar_path); // nothing if missing or out of date
+void muj_close_mapped_document(muj_mapped_document mapped);
+#ifndef MUJSON_NO_HIGH_LEVEL_FUNCTIONS
+// Opens the sidecar, or parses the json file (with container_sizes and type_tags if record_indexes) and writes one.
+// If the sidecar can't be written, the parsed document is returned.
+muj_mapped_document muj_load_document_with_sidecar(const char* json_path, const char* sidecar_path, bool record_indexes);
+#endif
+
 #endif // MUJSON_H_INCLUDED
@@ -6,9 +6,14 @@
 #error Please globally define MUJSON_USE_CPP_INTERFACE in order to use it. 
 #endif
 
+#include <cstddef>
 #include <iosfwd>
+#include <iterator>
 #include <string>
 #include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 extern "C"
 {
@@ -20,6 +25,9 @@ typedef struct
 
 extern bool muj_read_byte(muj_source source, char* byte);
 extern bool muj_peek_byte(muj_source source, char* byte);
+extern size_t muj_read_bytes(muj_source source, char* target, size_t length);
+extern long muj_tell_source(muj_source source);
+extern bool muj_seek_source(muj_source source, long position);
 	
 #include <mujson.h>
 
@@ -29,27 +37,109 @@ extern bool muj_peek_byte(muj_source source, char* byte);
 #define MUJSON_NAMESPACE Json
 #endif
 
+// Define MUJSON_CONTAINER_SIZES (when compiling mujson.cpp) to record container_sizes, so Object and Array get their
+// size without walking the children. It costs a second table as large as the first, so it is off by default.
+
 namespace MUJSON_NAMESPACE
 {
 	
 class Value;
+class Elements;
+class Members;
 	
+/// The buffers of a parsed document. Shared through an intrusive, non-atomic reference count: a document can be
+/// handed to another thread, but not used from two threads while references are added or dropped.
 class DocumentContainer
 {
 public:
 	muj_document getDocument() const {return document;}
-protected:
+	muj_arena* getArena() {return &arena;}
+	/// Strings with escapes are decoded into the arena by parse, so views (and member traversal) don't allocate
+	muj_string_view getStringView(MUJ_INDEX string);
+private:
+	DocumentContainer();
+	~DocumentContainer();
+	DocumentContainer(const DocumentContainer&);
+	DocumentContainer& operator=(const DocumentContainer&);
+	
+	bool parse(std::istream& inStream, Value& root);
+	void decodeEscapedStrings();
+	
+	struct DecodedString
+	{
+		MUJ_INDEX string;
+		muj_string_view view;
+	};
+	static bool decodedBefore(const DecodedString& decoded, MUJ_INDEX string);
+	
 	muj_document document;
+	muj_arena arena; // Decoded strings with escapes, lives as long as the document
+	std::vector<DecodedString> decodedStrings; // Only strings with escapes, sorted by table index, views into the arena
+	size_t jsonCapacity; // json_max_size of the allocation, in bytes
+	size_t tableCapacity; // table_size_in_indices of the allocation
+	size_t references;
+	
+	friend class Document;
+	friend class Reader;
+};
+
+/// Keeps a parsed document alive. Values point into it and stay valid as long as a Document or the Reader that parsed
+/// it refers to it.
+class Document
+{
+public:
+	Document() : container(0) {}
+	Document(const Document& other);
+	~Document();
+	Document& operator=(Document other) {swap(other); return *this;}
+#if __cplusplus >= 201103L
+	Document(Document&& other) noexcept : container(other.container) {other.container = 0;}
+#endif
+	void swap(Document& other) {DocumentContainer* container_ = container; container = other.container; other.container = container_;}
+	
+	bool empty() const {return container == 0;}
+	Value getRoot() const;
+	muj_document getDocument() const;
+	/// Frees the unused part of the compressed json buffer, for documents that are kept around. Values stay valid,
+	/// string views that point into the compressed json don't.
+	void shrink();
+private:
+	explicit Document(DocumentContainer* _container);
+	
+	DocumentContainer* container;
+	
+	friend class Reader;
 };
 
+/// Movable, not copyable. Parsing again reuses the buffers of the previous document unless it is still shared, so
+/// keep one Reader per thread around instead of making one per message.
 class Reader
-	: public DocumentContainer
 {
 public:
 	Reader();
 	~Reader();
+#if __cplusplus >= 201103L
+	Reader(Reader&& other) noexcept : document(static_cast<Document&&>(other.document)), spare(other.spare) {other.spare = 0;}
+	Reader& operator=(Reader&& other) noexcept {swap(other); return *this;}
+#endif
+	void swap(Reader& other);
+	
 	/// Parses directly from an istream. Mind that this will malloc the size of the remainder of the stream (+1 byte)
+	/// Values from an earlier parse are invalidated, unless their document was shared.
 	bool parse(std::istream& inStream, Value& root);
+	/// Lets go of the parsed document, keeping the buffers for the next parse if nothing else shares it
+	void reset();
+	/// The parsed document, kept alive independently of this Reader
+	Document share() const {return document;}
+	
+	muj_document getDocument() const {return document.getDocument();}
+	muj_arena* getArena() {return document.empty() ? 0 : document.container->getArena();}
+private:
+	Reader(const Reader&);
+	Reader& operator=(const Reader&);
+	
+	Document document;
+	DocumentContainer* spare; // buffers kept by reset()
 };
 
 class Value
@@ -68,6 +158,10 @@ public:
 	int asInt() const;
 	long asLong() const;
 	std::string asString() const;
+#if __cplusplus >= 201703L
+	/// Points into the document. Strings with escapes are decoded once (on the first call) into memory owned by the document.
+	std::string_view asStringView() const;
+#endif
 	
 	bool isArray() const;
 	bool isObject() const;
@@ -78,6 +172,14 @@ public:
 	bool isTrue() const;
 	bool isFalse() const;
 	bool isNull() const;
+	
+	/// Iterate without allocating: for( Json::Value element : value.elements()) ... Empty for non-arrays.
+	Elements elements() const;
+	/// Iterate without allocating: for( Json::Member member : value.members()) ... Empty for non-objects.
+	Members members() const;
+	
+	MUJ_INDEX getIndex() const {return index;}
+	muj_document getDocument() const {return document->getDocument();}
 	private:
 
 	DocumentContainer* document;
@@ -85,7 +187,10 @@ public:
 	
 	friend class Object;
 	friend class Array;
-	friend class Reader;
+	friend class Document;
+	friend class DocumentContainer;
+	friend class ElementIterator;
+	friend class MemberIterator;
 	
 	Value(DocumentContainer& _document, MUJ_INDEX _index) : document(&_document), index(_index) {}
 };
@@ -130,4 +235,99 @@ private:
 	DocumentContainer* document;
 };
 
+struct Member
+{
+	muj_string_view key; // Points into the document, keys with escapes were decoded into the document's arena by parse
+	Value value;
+#if __cplusplus >= 201703L
+	std::string_view keyView() const {return std::string_view(key.data, key.length);}
+#endif
+};
+
+/// Follows the skip chain of an array, 0 is past the last element.
+class ElementIterator
+{
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef Value value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef void pointer;
+	typedef Value reference;
+	
+	ElementIterator() : document(0), index(0) {}
+	ElementIterator(DocumentContainer* _document, MUJ_INDEX _index) : document(_document), index(_index) {}
+	
+	Value operator*() const {return Value(*document, index);}
+	ElementIterator& operator++() {index = document->getDocument().table.table[index+1]; return *this;}
+	ElementIterator operator++(int) {ElementIterator out = *this; ++*this; return out;}
+	bool operator==(const ElementIterator& other) const {return index == other.index;}
+	bool operator!=(const ElementIterator& other) const {return index != other.index;}
+private:
+	DocumentContainer* document;
+	MUJ_INDEX index;
+};
+
+/// Follows the keys of an object, 0 is past the last member.
+class MemberIterator
+{
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef Member value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef void pointer;
+	typedef Member reference;
+	
+	MemberIterator() : document(0), key(0) {}
+	MemberIterator(DocumentContainer* _document, MUJ_INDEX _key) : document(_document), key(_key) {}
+	
+	Member operator*() const
+	{
+		Member out;
+		out.key = document->getStringView(key);
+		out.value = Value(*document, key+2);
+		return out;
+	}
+	MemberIterator& operator++() {key = document->getDocument().table.table[key+3]; return *this;}
+	MemberIterator operator++(int) {MemberIterator out = *this; ++*this; return out;}
+	bool operator==(const MemberIterator& other) const {return key == other.key;}
+	bool operator!=(const MemberIterator& other) const {return key != other.key;}
+private:
+	DocumentContainer* document;
+	MUJ_INDEX key;
+};
+
+class Elements
+{
+public:
+	Elements(DocumentContainer* _document, MUJ_INDEX _first) : first(_document, _first), last(_document, 0) {}
+	ElementIterator begin() const {return first;}
+	ElementIterator end() const {return last;}
+private:
+	ElementIterator first;
+	ElementIterator last;
+};
+
+class Members
+{
+public:
+	Members(DocumentContainer* _document, MUJ_INDEX _first) : first(_document, _first), last(_document, 0) {}
+	MemberIterator begin() const {return first;}
+	MemberIterator end() const {return last;}
+private:
+	MemberIterator first;
+	MemberIterator last;
+};
+
+inline Elements Value::elements() const
+{
+	bool any = document && isArray() && !muj_is_array_empty(index, document->getDocument());
+	return Elements(document, any ? index+2 : 0);
+}
+
+inline Members Value::members() const
+{
+	bool any = document && isObject() && !muj_is_object_empty(index, document->getDocument());
+	return Members(document, any ? index+2 : 0);
+}
+
 } // MUJSON_NAMESPACE
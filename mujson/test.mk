@@ -28,7 +28,7 @@ LibraryPathSwitch      :=-L
 PreprocessorSwitch     :=-D
 SourceSwitch           :=-c 
 OutputFile             :=$(IntermediateDirectory)/$(ProjectName)
-Preprocessors          :=
+Preprocessors          :=$(PreprocessorSwitch)MUJSON_INSTRUMENT $(PreprocessorSwitch)MUJSON_SHARED_DOCUMENTS $(PreprocessorSwitch)MUJSON_SIDECAR_FILES
 ObjectSwitch           :=-o 
 ArchiveOutputSwitch    := 
 PreprocessOnlySwitch   :=-E 
@@ -39,7 +39,7 @@ LinkOptions            :=
 IncludePath            :=  $(IncludeSwitch). $(IncludeSwitch). $(IncludeSwitch)../ 
 IncludePCH             := 
 RcIncludePath          := 
-Libs                   := 
+Libs                   := $(LibrarySwitch)rt 
 ArLibs                 :=  
 LibPath                := $(LibraryPathSwitch). 
 
@@ -0,0 +1,306 @@
+#pragma once
+
+// Compile-time binding of C++ structs to json objects. Requires C++14.
+//
+// Describe the fields of a struct once:
+//
+//	struct Point { int x; double y; std::string name; };
+//
+//	template<> struct Json::Bind::Describe<Point>
+//	{
+//		static constexpr auto fields() { return std::make_tuple(Json::Bind::field("x", &Point::x), Json::Bind::field("y", &Point::y), Json::Bind::field("name", &Point::name)); }
+//	};
+//
+// and decode an object with a single walk over its members:
+//
+//	Point point;
+//	Json::Bind::Result result = Json::Bind::decode(point, value);
+//
+// Keys are dispatched to fields through a perfect hash that is computed at compile time, so every member costs one
+// hash and one compare. Field names are compared to the keys as written in the json (escapes are not decoded).
+// Supported field types: bool, integers, floating point, std::string, std::vector of those and described structs.
+
+#include <mujson.hpp>
+
+#include <cstring>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus < 201402L
+#error mujson_bind.hpp requires C++14
+#endif
+
+namespace MUJSON_NAMESPACE
+{
+namespace Bind
+{
+
+template<class Struct>
+struct Describe; // Specialize with a static constexpr fields() returning a tuple of field()s
+
+template<class Struct, class Member>
+struct Field
+{
+	const char* name;
+	size_t length;
+	Member Struct::*member;
+};
+
+template<class Struct, class Member, size_t N>
+constexpr Field<Struct, Member> field(const char (&name)[N], Member Struct::*member)
+{
+	return Field<Struct, Member>{name, N-1, member};
+}
+
+/// Fields are reported as bits in field order. Nothing is allocated to report problems.
+struct Result
+{
+	uint64_t missing = 0; // fields without a member in the object
+	uint64_t invalid = 0; // fields of which the value has the wrong type (or doesn't fit)
+	size_t numExtra = 0; // members without a field
+	MUJ_INDEX firstExtra = 0; // key of the first one, for the muj string functions
+	bool notAnObject = false;
+
+	bool ok() const {return !notAnObject && missing == 0 && invalid == 0 && numExtra == 0;}
+};
+
+namespace detail
+{
+
+struct Name
+{
+	const char* text;
+	size_t length;
+};
+
+constexpr uint32_t hash(const char* key, size_t length, uint32_t seed)
+{
+	uint32_t out = 2166136261u ^ (seed * 0x9E3779B9u);
+	for( size_t i=0; i<length; i++)
+	{
+		out ^= (unsigned char)key[i];
+		out *= 16777619u;
+	}
+	return out ^ (out >> 15);
+}
+
+template<size_t N>
+struct Names
+{
+	Name names[N];
+};
+
+template<size_t N>
+constexpr size_t tableSize()
+{
+	size_t size = 1;
+	while (size < N*2)
+		size *= 2;
+	return size;
+}
+
+template<size_t N>
+struct Slots
+{
+	unsigned char slots[tableSize<N>()]; // field index+1, 0: empty
+};
+
+constexpr uint32_t noSeed = 0xFFFFFFFFu;
+
+template<size_t N>
+constexpr uint32_t findSeed(const Names<N>& names)
+{
+	for( uint32_t seed=0; seed<4096; seed++)
+	{
+		bool used[tableSize<N>()] = {};
+		bool collision = false;
+		for( size_t i=0; i<N && !collision; i++)
+		{
+			size_t slot = hash(names.names[i].text, names.names[i].length, seed) & (tableSize<N>()-1);
+			collision = used[slot];
+			used[slot] = true;
+		}
+		if (!collision)
+			return seed;
+	}
+	return noSeed;
+}
+
+template<size_t N>
+constexpr Slots<N> makeSlots(const Names<N>& names, uint32_t seed)
+{
+	Slots<N> out = {};
+	for( size_t i=0; i<N; i++)
+		out.slots[hash(names.names[i].text, names.names[i].length, seed) & (tableSize<N>()-1)] = (unsigned char)(i+1);
+	return out;
+}
+
+template<class Tuple, size_t... I>
+constexpr Names<sizeof...(I)> makeNames(const Tuple& fields, std::index_sequence<I...>)
+{
+	return Names<sizeof...(I)>{{Name{std::get<I>(fields).name, std::get<I>(fields).length}...}};
+}
+
+template<class Struct>
+struct Binding
+{
+	typedef decltype(Describe<Struct>::fields()) Fields;
+	static constexpr size_t count = std::tuple_size<Fields>::value;
+	static_assert(count > 0 && count <= 64, "A described struct needs 1 to 64 fields");
+	static constexpr Names<count> names = makeNames(Describe<Struct>::fields(), std::make_index_sequence<count>());
+	static constexpr uint32_t seed = findSeed(names);
+	static_assert(seed != noSeed, "No perfect hash found, are there duplicate field names?");
+	static constexpr Slots<count> slots = makeSlots(names, seed);
+};
+
+template<class Struct> constexpr size_t Binding<Struct>::count;
+template<class Struct> constexpr Names<Binding<Struct>::count> Binding<Struct>::names;
+template<class Struct> constexpr uint32_t Binding<Struct>::seed;
+template<class Struct> constexpr Slots<Binding<Struct>::count> Binding<Struct>::slots;
+
+inline bool decodeValue(bool& out, MUJ_INDEX value, muj_document document);
+inline bool decodeValue(std::string& out, MUJ_INDEX value, muj_document document);
+template<class T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type decodeValue(T& out, MUJ_INDEX value, muj_document document);
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type decodeValue(T& out, MUJ_INDEX value, muj_document document);
+template<class T>
+bool decodeValue(std::vector<T>& out, MUJ_INDEX value, muj_document document);
+template<class T>
+typename std::enable_if<std::is_class<T>::value, bool>::type decodeValue(T& out, MUJ_INDEX value, muj_document document);
+
+template<class Struct, size_t I>
+bool decodeField(Struct& out, MUJ_INDEX value, muj_document document)
+{
+	return decodeValue(out.*(std::get<I>(Describe<Struct>::fields()).member), value, document);
+}
+
+template<class Struct, size_t... I>
+bool dispatch(size_t field, Struct& out, MUJ_INDEX value, muj_document document, std::index_sequence<I...>)
+{
+	typedef bool (*Decoder)(Struct&, MUJ_INDEX, muj_document);
+	static const Decoder decoders[] = {&decodeField<Struct, I>...};
+	return decoders[field](out, value, document);
+}
+
+} // detail
+
+/// Decodes object into out with a single walk over its members. Fields without a member keep their value.
+template<class Struct>
+Result decode(Struct& out, MUJ_INDEX object, muj_document document)
+{
+	typedef detail::Binding<Struct> Binding;
+	Result result;
+	if (!muj_is_object(object, document))
+	{
+		result.notAnObject = true;
+		return result;
+	}
+	result.missing = (Binding::count == 64) ? ~(uint64_t)0 : (((uint64_t)1 << Binding::count) - 1);
+	if (muj_is_object_empty(object, document))
+		return result;
+	const MUJ_INDEX* table = document.table.table;
+	for( MUJ_INDEX key = object+2;; key = table[key+3])
+	{
+		const char* name = &document.json.json_target[table[key]+1];
+		size_t length = table[key+2] - table[key] - 2; // the value starts right after the key
+		size_t slot = detail::hash(name, length, Binding::seed) & (sizeof(Binding::slots.slots)-1);
+		size_t field = Binding::slots.slots[slot];
+		if (field != 0 && Binding::names.names[field-1].length == length && memcmp(Binding::names.names[field-1].text, name, length) == 0)
+		{
+			uint64_t bit = (uint64_t)1 << (field-1);
+			result.missing &= ~bit;
+			if (!detail::dispatch(field-1, out, key+2, document, std::make_index_sequence<Binding::count>()))
+				result.invalid |= bit;
+		}
+		else if (result.numExtra++ == 0)
+			result.firstExtra = key;
+		if (table[key+3] == 0)
+			break;
+	}
+	return result;
+}
+
+template<class Struct>
+Result decode(Struct& out, const Value& value)
+{
+	return decode(out, value.getIndex(), value.getDocument());
+}
+
+namespace detail
+{
+
+inline bool decodeValue(bool& out, MUJ_INDEX value, muj_document document)
+{
+	if (!muj_is_boolean(value, document))
+		return false;
+	out = muj_is_true(value, document);
+	return true;
+}
+
+inline bool decodeValue(std::string& out, MUJ_INDEX value, muj_document document)
+{
+	if (!muj_is_string(value, document))
+		return false;
+	muj_string_view view = muj_get_string_view(value, document, NULL);
+	if (view.data)
+		out.assign(view.data, view.length);
+	else
+	{
+		out.resize(view.length);
+		muj_copy_string(&out[0], value, document);
+	}
+	return true;
+}
+
+template<class T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type decodeValue(T& out, MUJ_INDEX value, muj_document document)
+{
+	int64_t number;
+	if (!muj_is_number(value, document) || !muj_get_int64(value, document, &number))
+		return false;
+	if (std::is_unsigned<T>::value ? (number < 0 || (uint64_t)number > (uint64_t)std::numeric_limits<T>::max())
+		: (number < (int64_t)std::numeric_limits<T>::min() || number > (int64_t)std::numeric_limits<T>::max()))
+		return false;
+	out = (T)number;
+	return true;
+}
+
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type decodeValue(T& out, MUJ_INDEX value, muj_document document)
+{
+	if (!muj_is_number(value, document))
+		return false;
+	out = (T)muj_get_double(value, document);
+	return true;
+}
+
+template<class T>
+bool decodeValue(std::vector<T>& out, MUJ_INDEX value, muj_document document)
+{
+	if (!muj_is_array(value, document))
+		return false;
+	out.resize(muj_array_count_number_of_elements(value, document));
+	bool success = true;
+	MUJ_INDEX element = value+2;
+	for( size_t i=0; i<out.size(); i++)
+	{
+		success &= decodeValue(out[i], element, document);
+		element = document.table.table[element+1];
+	}
+	return success;
+}
+
+template<class T>
+typename std::enable_if<std::is_class<T>::value, bool>::type decodeValue(T& out, MUJ_INDEX value, muj_document document)
+{
+	Result result = decode(out, value, document);
+	return !result.notAnObject && result.missing == 0 && result.invalid == 0; // extra members are fine in nested structs
+}
+
+} // detail
+
+} // Bind
+} // MUJSON_NAMESPACE
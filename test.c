@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include <mujson.h>
 
@@ -85,6 +87,16 @@ muj_document load_file(char* filename)
 	return document;
 }
 
+muj_document load_string(const char* json)
+{
+	FILE* f = tmpfile();
+	fputs(json, f);
+	rewind(f);
+	muj_document document = muj_load_document_from_file(f);
+	fclose(f);
+	return document;
+}
+
 void test_file(char* filename)
 {
 	printf("Testing %s...\n", filename);
@@ -124,6 +136,627 @@ void test_doubles()
 	muj_unload_document(document);
 }
 
+void test_unicode(char* filename, bool validate)
+{
+	printf("Testing unicode %s%s...\n", filename, validate?" (validating)":"");
+	
+	FILE* f = fopen(filename, "ro");
+	muj_compressed_json target = muj_allocate_compressed_json(file_size(f));
+	target.validate_utf8 = validate;
+	muj_source source;
+	source.file = f;
+	muj_phase1(source, target);
+	fclose(f);
+	if (muj_get_last_error() != 0)
+	{
+		printf("Rejected.\n");
+		muj_free_compressed_json(target);
+		return;
+	}
+	muj_document_table table = muj_allocate_document_table(target);
+	muj_document document = muj_make_document(target, table);
+	muj_phase2(document);
+	
+	MUJ_INDEX string = muj_get_root_object(document.table);
+	if (muj_is_array(string, document))
+		string = muj_get_element_from_array(string, 0, document);
+	else if (muj_is_object(string, document))
+	{
+		muj_key_value_pair children[muj_object_count_number_of_children(string, document)];
+		muj_object_copy_children(children, string, document);
+		string = children[0].value;
+	}
+	size_t length = muj_get_string_length(string, document)-1;
+	char decoded[length+1]; decoded[length] = 0;
+	muj_copy_string(decoded, string, document);
+	printf("Decoded:");
+	for( size_t i=0; i<length; i++)
+		printf(" %02x", (unsigned char)decoded[i]);
+	printf("\n");
+	printf("Compares equal: %s\n", muj_compare_string(string, decoded, document) ? "yes" : "no");
+	
+	muj_unload_document(document);
+}
+
+void test_string_views(char* filename)
+{
+	printf("Testing string views %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	muj_arena arena;
+	muj_init_arena(&arena, 64);
+	MUJ_INDEX array = muj_get_root_object(document.table);
+	size_t num_strings = muj_array_count_number_of_elements(array, document);
+	MUJ_INDEX strings[num_strings];
+	muj_array_copy_elements(strings, array, document);
+	for( size_t i=0; i<num_strings; i++)
+	{
+		muj_string_view view = muj_get_string_view(strings[i], document, &arena);
+		bool in_document = (view.data > document.json.json_target && view.data < document.json.json_target + document.json.json_max_size);
+		printf("%s, %s: %.*s\n", muj_is_string_escape_free(strings[i], document) ? "escape free" : "escapes", in_document ? "in document" : "decoded", (int)view.length, view.data);
+	}
+	muj_free_arena(&arena);
+	muj_unload_document(document);
+}
+
+void test_key_interning(char* filename)
+{
+	printf("Testing key interning %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	muj_key_dictionary dictionary = muj_intern_keys(document);
+	printf("Distinct keys: %d\n", (int)dictionary.num_keys);
+	for( MUJ_INDEX id=0; id<dictionary.num_keys; id++)
+	{
+		MUJ_INDEX key = muj_get_key_of_id(id, dictionary);
+		size_t length = muj_get_string_length(key, document);
+		char name[length]; name[length-1] = 0;
+		muj_copy_string(name, key, document);
+		printf("%d: %s\n", (int)id, name);
+	}
+	
+	MUJ_INDEX name_id = muj_find_key_id("name", document, dictionary);
+	printf("Missing key: %s\n", muj_find_key_id("missing", document, dictionary) == MUJ_NO_KEY_ID ? "not found" : "found");
+	MUJ_INDEX array = muj_get_root_object(document.table);
+	size_t num_records = muj_array_count_number_of_elements(array, document);
+	MUJ_INDEX records[num_records];
+	muj_array_copy_elements(records, array, document);
+	for( size_t i=0; i<num_records; i++)
+	{
+		MUJ_INDEX name = muj_find_value_of_key_id(records[i], name_id, document, dictionary);
+		printf("Name: %s\n", name == muj_find_value_of_key_in_object(records[i], "name", document) ? "matches" : "differs");
+	}
+	
+	muj_free_key_dictionary(dictionary);
+	muj_unload_document(document);
+}
+
+void test_columns(const char* json)
+{
+	printf("Testing columns %s...\n", json);
+	
+	muj_document document = load_string(json);
+	muj_column columns[5];
+	columns[0].field = "id"; columns[0].type = MUJ_COLUMN_INT64;
+	columns[1].field = "score"; columns[1].type = MUJ_COLUMN_DOUBLE;
+	columns[2].field = "active"; columns[2].type = MUJ_COLUMN_BOOL;
+	columns[3].field = "name"; columns[3].type = MUJ_COLUMN_STRING;
+	columns[4].field = "missing"; columns[4].type = MUJ_COLUMN_INT64;
+	if (!muj_extract_columns(columns, 5, muj_get_root_object(document.table), document))
+		printf("Extraction failed.\n");
+	for( size_t row=0; row<columns[0].length; row++)
+	{
+		printf("Row %d:", (int)row);
+		for( size_t c=0; c<5; c++)
+		{
+			muj_column column = columns[c];
+			if (!((column.validity[row/8] >> (row%8)) & 1))
+			{
+				printf(" null");
+				continue;
+			}
+			int32_t* offsets = (int32_t*)column.values;
+			switch(column.type)
+			{
+				case MUJ_COLUMN_INT64: printf(" %lld", (long long)((int64_t*)column.values)[row]); break;
+				case MUJ_COLUMN_DOUBLE: printf(" %g", ((double*)column.values)[row]); break;
+				case MUJ_COLUMN_BOOL: printf(" %s", ((((uint8_t*)column.values)[row/8] >> (row%8)) & 1) ? "true" : "false"); break;
+				case MUJ_COLUMN_STRING: printf(" %.*s", (int)(offsets[row+1]-offsets[row]), &column.data[offsets[row]]); break;
+			}
+		}
+		printf("\n");
+	}
+	printf("Null counts: %d %d %d %d %d\n", (int)columns[0].null_count, (int)columns[1].null_count, (int)columns[2].null_count, (int)columns[3].null_count, (int)columns[4].null_count);
+	
+	muj_free_columns(columns, 5);
+	muj_unload_document(document);
+}
+
+void test_shape_cache(const char** records, size_t num_records)
+{
+	printf("Testing shape cache...\n");
+	
+	muj_shape_cache cache;
+	muj_init_shape_cache(&cache);
+	for( size_t i=0; i<num_records; i++)
+	{
+		FILE* f = tmpfile();
+		fputs(records[i], f);
+		rewind(f);
+		muj_compressed_json target = muj_allocate_compressed_json(strlen(records[i]));
+		target.shape_cache = &cache;
+		muj_source source;
+		source.file = f;
+		muj_phase1(source, target);
+		fclose(f);
+		muj_document_table table = muj_allocate_document_table(target);
+		muj_document document = muj_make_document(target, table);
+		muj_phase2(document);
+		
+		muj_document reference = load_string(records[i]);
+		bool same = (*document.json.json_write_pos == *reference.json.json_write_pos && memcmp(document.json.json_target, reference.json.json_target, *reference.json.json_write_pos) == 0);
+		printf("Record %d: %s, hits %d, misses %d\n", (int)i, same ? "same" : "different", (int)cache.hits, (int)cache.misses);
+		muj_unload_document(reference);
+		muj_unload_document(document);
+	}
+}
+
+void test_minified(char* filename)
+{
+	printf("Testing minified %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	
+	size_t minified_size = muj_write_minified(NULL, 0, document);
+	char minified[minified_size+1]; minified[minified_size] = 0;
+	muj_write_minified(minified, minified_size, document);
+	
+	printf("JSON: %s\n", minified);
+	
+	muj_unload_document(document);
+}
+
+void test_overlay()
+{
+	char* filename = "../../test/nulls_and_bools.json";
+	printf("Testing overlay...\n");
+	
+	muj_document document = load_file(filename);
+	muj_overlay overlay = muj_allocate_overlay(document, 4);
+	
+	MUJ_INDEX root = muj_get_root_object(document.table);
+	muj_overlay_set_value(overlay, muj_find_value_of_key_in_object(root, "null", document), "\"not null\"");
+	muj_overlay_delete_key(overlay, root, "boolean, true");
+	muj_overlay_insert_key(overlay, root, "added", "[1,2,{}]");
+	
+	size_t size = muj_overlay_write_minified(NULL, 0, overlay);
+	char minified[size+1]; minified[size] = 0;
+	muj_overlay_write_minified(minified, size, overlay);
+	printf("JSON: %s\n", minified);
+	
+	muj_free_overlay(overlay);
+	muj_unload_document(document);
+}
+
+void print_minified(muj_document document)
+{
+	size_t size = muj_write_minified(NULL, 0, document);
+	char minified[size+1]; minified[size] = 0;
+	muj_write_minified(minified, size, document);
+	printf("JSON: %s\n", minified);
+}
+
+void test_patch(const char* source_json, const char* patch_json, bool merge)
+{
+	printf("Testing %s %s...\n", merge?"merge patch":"patch", patch_json);
+	
+	muj_document source = load_string(source_json);
+	muj_document patch = load_string(patch_json);
+	muj_document result;
+	bool success = merge?muj_apply_merge_patch(&result, source, patch):muj_apply_json_patch(&result, source, patch);
+	if (success)
+	{
+		print_minified(result);
+		muj_unload_document(result);
+	}
+	else
+		printf("Patch failed.\n");
+	
+	muj_unload_document(patch);
+	muj_unload_document(source);
+}
+
+void test_diff(const char* from_json, const char* to_json)
+{
+	printf("Testing diff %s -> %s...\n", from_json, to_json);
+	
+	muj_document from = load_string(from_json);
+	muj_document to = load_string(to_json);
+	size_t size = muj_diff(NULL, 0, from, to);
+	char diff[size+1]; diff[size] = 0;
+	muj_diff(diff, size, from, to);
+	printf("Patch: %s\n", diff);
+	
+	muj_document patch = load_string(diff);
+	muj_document result;
+	if (muj_apply_json_patch(&result, from, patch))
+	{
+		print_minified(result);
+		muj_unload_document(result);
+	}
+	else
+		printf("Patch failed.\n");
+	
+	muj_unload_document(patch);
+	muj_unload_document(to);
+	muj_unload_document(from);
+}
+
+void test_subtree_hashes(const char* json)
+{
+	printf("Testing subtree hashes %s...\n", json);
+	
+	muj_document document = load_string(json);
+	muj_subtree_hashes hashes = muj_compute_subtree_hashes(document);
+	muj_duplicate duplicates[8];
+	size_t num_duplicates = muj_find_duplicate_subtrees(duplicates, 8, 3, document, hashes);
+	printf("Duplicates: %d\n", (int)num_duplicates);
+	for( size_t i=0; i<num_duplicates && i<8; i++)
+	{
+		MUJ_INDEX subtree = duplicates[i].subtree;
+		MUJ_INDEX first = duplicates[i].first;
+		printf("%d equals %d: %s\n", (int)subtree, (int)first, muj_subtree_hash(subtree, hashes) == muj_subtree_hash(first, hashes) ? "same hash" : "different hash");
+	}
+	
+	muj_document copy = load_string(json);
+	muj_subtree_hashes copy_hashes = muj_compute_subtree_hashes(copy);
+	MUJ_INDEX root = muj_get_root_object(document.table);
+	printf("Equal to a copy: %s\n", muj_subtree_equal(root, document, hashes, root, copy, copy_hashes) ? "yes" : "no");
+	
+	muj_free_subtree_hashes(copy_hashes);
+	muj_unload_document(copy);
+	muj_free_subtree_hashes(hashes);
+	muj_unload_document(document);
+}
+
+void log_problem(const muj_error* error, void* user_data)
+{
+	MUJ_UNUSED(user_data);
+	printf("mujson: code %d, phase %d, offset %d, line %d, column %d, expected %d, found %d: %s", (int)error->code, error->phase,
+		error->offset == MUJ_UNKNOWN_POSITION ? -1 : (int)error->offset, (int)error->line, (int)error->column, error->expected, error->found, error->message);
+}
+
+void test_error(const char* json)
+{
+	printf("Testing error in %s...\n", json);
+	
+	muj_set_log_function(NULL, NULL);
+	muj_document document = load_string(json);
+	muj_error error = muj_get_error();
+	printf("Code %d, phase %d, line %d, column %d, expected '%c', found '%c'\n", (int)error.code, error.phase, (int)error.line, (int)error.column,
+		error.expected < 0 ? '?' : error.expected, error.found < 0 ? '?' : error.found);
+	muj_get_last_error();
+	muj_unload_document(document);
+	muj_set_log_function(log_problem, NULL);
+}
+
+void test_phase2_recursive(char* filename)
+{
+	printf("Testing recursive phase 2 %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	if (muj_get_last_error() != 0)
+	{
+		muj_unload_document(document);
+		return;
+	}
+	muj_document_table table = muj_allocate_document_table(document.json);
+	*document.json.json_read_pos = 0;
+	muj_document recursive = muj_make_document(document.json, table);
+	muj_phase2_recursive(recursive);
+	
+	size_t size = *table.current_write_pos;
+	bool same = (size == *document.table.current_write_pos && memcmp(table.table, document.table.table, size*sizeof(MUJ_INDEX)) == 0);
+	for( size_t i=0; i<size; i+=2)
+		same = same && (muj_is_string_escape_free((MUJ_INDEX)i, recursive) == muj_is_string_escape_free((MUJ_INDEX)i, document));
+	printf("Tables %s.\n", same ? "same" : "different");
+	
+	muj_free_document_table(table);
+	muj_unload_document(document);
+}
+
+void test_container_sizes(char* filename, bool recursive)
+{
+	printf("Testing container sizes %s%s...\n", filename, recursive?" (recursive phase 2)":"");
+	
+	FILE* f = fopen(filename, "ro");
+	muj_compressed_json target = muj_allocate_compressed_json(file_size(f));
+	target.record_container_sizes = true;
+	muj_source source;
+	source.file = f;
+	muj_phase1(source, target);
+	fclose(f);
+	muj_document document = muj_make_document(target, muj_allocate_document_table(target));
+	if (recursive)
+		muj_phase2_recursive(document);
+	else
+		muj_phase2(document);
+	
+	muj_document walked = document;
+	walked.table.container_sizes = NULL;
+	bool same = true;
+	size_t num_containers = 0;
+	for( MUJ_INDEX i=0; i<*document.table.current_write_pos; i+=2)
+	{
+		if (muj_is_object(i, document))
+			same = same && muj_object_count_number_of_children(i, document) == muj_object_count_number_of_children(i, walked);
+		else if (muj_is_array(i, document))
+			same = same && muj_array_count_number_of_elements(i, document) == muj_array_count_number_of_elements(i, walked);
+		else
+			continue;
+		same = same && muj_get_subtree_end(i, document) == muj_get_subtree_end(i, walked);
+		num_containers++;
+	}
+	MUJ_INDEX root = muj_get_root_object(document.table);
+	printf("%d containers, root has %d children and ends at %d, %s\n", (int)num_containers,
+		(int)(muj_is_object(root, document) ? muj_object_count_number_of_children(root, document) : muj_array_count_number_of_elements(root, document)),
+		(int)muj_get_subtree_end(root, document), same ? "same as walking" : "different from walking");
+	
+	muj_unload_document(document);
+}
+
+void test_type_tags(char* filename)
+{
+	printf("Testing type tags %s...\n", filename);
+	
+	FILE* f = fopen(filename, "ro");
+	muj_compressed_json target = muj_allocate_compressed_json(file_size(f));
+	target.record_type_tags = true;
+	muj_source source;
+	source.file = f;
+	muj_phase1(source, target);
+	fclose(f);
+	muj_document document = muj_make_document(target, muj_allocate_document_table(target));
+	muj_phase2(document);
+	
+	muj_document untagged = document;
+	untagged.table.type_tags = NULL;
+	bool same = true;
+	size_t num_types[MUJ_TYPE_FALSE+1] = {0};
+	for( MUJ_INDEX i=0; i<*document.table.current_write_pos; i+=2)
+	{
+		muj_type type = muj_get_type(i, document);
+		num_types[type]++;
+		same = same && type == muj_get_type(i, untagged) && muj_is_constant(i, document) == muj_is_constant(i, untagged);
+		if (type == MUJ_TYPE_OBJECT)
+			same = same && muj_is_object_empty(i, document) == muj_is_object_empty(i, untagged);
+		else if (type == MUJ_TYPE_ARRAY)
+			same = same && muj_is_array_empty(i, document) == muj_is_array_empty(i, untagged);
+	}
+	printf("%d objects, %d arrays, %d strings, %d numbers, %d constants, %s\n", (int)num_types[MUJ_TYPE_OBJECT], (int)num_types[MUJ_TYPE_ARRAY],
+		(int)num_types[MUJ_TYPE_STRING], (int)num_types[MUJ_TYPE_NUMBER],
+		(int)(num_types[MUJ_TYPE_NULL] + num_types[MUJ_TYPE_TRUE] + num_types[MUJ_TYPE_FALSE]), same ? "same as untagged" : "different from untagged");
+	
+	muj_unload_document(document);
+}
+
+void test_shrink(char* filename)
+{
+	printf("Testing shrink %s...\n", filename);
+	
+	FILE* f = fopen(filename, "ro");
+	muj_compressed_json target = muj_allocate_compressed_json(file_size(f));
+	muj_source source;
+	source.file = f;
+	muj_phase1(source, target);
+	fclose(f);
+	size_t allocated = target.json_max_size;
+	target = muj_shrink_compressed_json(target);
+	muj_document document = muj_make_document(target, muj_allocate_document_table(target));
+	muj_phase2_recursive(document); // bounds checked against json_max_size
+	
+	size_t minified_size = muj_write_minified(NULL, 0, document);
+	char minified[minified_size+1]; minified[minified_size] = 0;
+	muj_write_minified(minified, minified_size, document);
+	printf("%d of %d bytes left, %s: %s\n", (int)target.json_max_size, (int)allocated, muj_get_last_error() ? "error" : "no error", minified);
+	
+	muj_unload_document(document);
+}
+
+// Navigating the packed document through a small cache and unpacking has to give back the same json
+void test_packed(char* filename)
+{
+	printf("Testing packed %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	muj_packed_document packed = muj_pack_document(document, 256);
+	muj_block_cache cache = muj_allocate_block_cache(4, 256);
+	printf("%d packed bytes for %d bytes of json and table\n", (int)muj_packed_document_size(packed),
+		(int)(*document.json.json_write_pos + *document.table.current_write_pos*sizeof(MUJ_INDEX)));
+	
+	muj_document unpacked = muj_unpack_value(0, packed, &cache);
+	size_t minified_size = muj_write_minified(NULL, 0, document);
+	char* minified = (char*)malloc(minified_size);
+	char* unpacked_minified = (char*)malloc(minified_size);
+	muj_write_minified(minified, minified_size, document);
+	bool same = muj_write_minified(NULL, 0, unpacked) == minified_size;
+	same = same && muj_write_minified(unpacked_minified, minified_size, unpacked) == minified_size && memcmp(minified, unpacked_minified, minified_size) == 0;
+	printf("%s\n", same ? "Same as original" : "Different from original");
+	free(minified);
+	free(unpacked_minified);
+	muj_unload_document(unpacked);
+	
+	MUJ_INDEX element = muj_packed_get_element_from_array(0, 3, packed, &cache);
+	MUJ_INDEX value = muj_packed_find_value_of_key_in_object(element, "friends", packed, &cache);
+	muj_document friends = muj_unpack_value(value, packed, &cache);
+	size_t friends_size = muj_write_minified(NULL, 0, friends);
+	char friends_minified[friends_size+1]; friends_minified[friends_size] = 0;
+	muj_write_minified(friends_minified, friends_size, friends);
+	printf("Element 3 friends: %s\n", friends_minified);
+	printf("Missing key: %d, missing element: %d\n", (int)muj_packed_find_value_of_key_in_object(element, "nope", packed, &cache),
+		(int)muj_packed_get_element_from_array(0, 1000000, packed, &cache));
+	printf("%d hits, %d misses\n", (int)cache.hits, (int)cache.misses);
+	muj_unload_document(friends);
+	
+	muj_free_block_cache(cache);
+	muj_free_packed_document(packed);
+	muj_unload_document(document);
+}
+
+// Attached in the same process here, which reads the same segments as another process would
+void test_shared_document(char* filename)
+{
+	printf("Testing shared document %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	if (!muj_publish_shared_document("/mujson_test", document))
+	{
+		printf("Not published (needs MUJSON_SHARED_DOCUMENTS)\n");
+		muj_unload_document(document);
+		return;
+	}
+	muj_shared_document shared = muj_attach_shared_document("/mujson_test");
+	size_t minified_size = muj_write_minified(NULL, 0, document);
+	char* minified = (char*)malloc(minified_size);
+	char* shared_minified = (char*)malloc(minified_size);
+	muj_write_minified(minified, minified_size, document);
+	bool same = shared.document.json.json_target && muj_write_minified(shared_minified, minified_size, shared.document) == minified_size;
+	same = same && memcmp(minified, shared_minified, minified_size) == 0;
+	MUJ_INDEX value = muj_find_value_of_key_in_object(muj_get_element_from_array(0, 3, shared.document), "name", shared.document);
+	char* name = muj_alloc_string_copy_target_and_copy(value, shared.document);
+	printf("%s, element 3 name: %s, current: %d\n", same ? "Same as original" : "Different from original", name, (int)muj_is_shared_document_current(shared));
+	muj_free_string_copy_target(name);
+	free(minified);
+	free(shared_minified);
+	
+	muj_publish_shared_document("/mujson_test", document);
+	muj_shared_document reloaded = muj_attach_shared_document("/mujson_test");
+	printf("After publishing again: current %d, reloaded generation is newer %d\n", (int)muj_is_shared_document_current(shared),
+		(int)(reloaded.generation == shared.generation+1));
+	muj_detach_shared_document(reloaded);
+	muj_detach_shared_document(shared);
+	muj_unpublish_shared_document("/mujson_test");
+	printf("Attach after unpublishing: %s\n", muj_attach_shared_document("/mujson_test").document.json.json_target ? "attached" : "nothing");
+	muj_unload_document(document);
+}
+
+// The sidecar goes into the working directory rather than next to the test files
+void test_sidecar(char* filename, char* other_filename)
+{
+	printf("Testing sidecar %s...\n", filename);
+	
+	remove("mujson_test.muj");
+	muj_set_log_function(NULL, NULL);
+	muj_unload_document(load_string("[1, 2\n}")); // a problem nobody read yet doesn't stop the sidecar
+	muj_set_log_function(log_problem, NULL);
+	muj_mapped_document first = muj_load_document_with_sidecar(filename, "mujson_test.muj", true);
+	muj_mapped_document second = muj_load_document_with_sidecar(filename, "mujson_test.muj", true);
+	printf("First load %s, second load %s, earlier problem %s\n", first.mapping ? "mapped" : "parsed", second.mapping ? "mapped" : "parsed",
+		muj_get_last_error() ? "kept" : "lost");
+	
+	muj_document document = load_file(filename);
+	size_t minified_size = muj_write_minified(NULL, 0, document);
+	char* minified = (char*)malloc(minified_size);
+	char* sidecar_minified = (char*)malloc(minified_size);
+	muj_write_minified(minified, minified_size, document);
+	bool same = second.document.json.json_target && muj_write_minified(sidecar_minified, minified_size, second.document) == minified_size;
+	same = same && memcmp(minified, sidecar_minified, minified_size) == 0;
+	printf("%s, root has %d children, type tags %s\n", same ? "Same as original" : "Different from original",
+		(int)muj_array_count_number_of_elements(0, second.document), second.document.table.type_tags ? "kept" : "missing");
+	free(minified);
+	free(sidecar_minified);
+	
+	muj_mapped_document other = muj_open_sidecar(other_filename, "mujson_test.muj");
+	printf("Sidecar for %s: %s\n", other_filename, other.document.json.json_target ? "used" : "out of date");
+	muj_close_mapped_document(other);
+	muj_close_mapped_document(second);
+	muj_close_mapped_document(first);
+	muj_unload_document(document);
+	remove("mujson_test.muj");
+}
+
+// Mapped (with MUJSON_LARGE_BUFFERS on Linux) or not, the document has to be the same
+void test_large_buffers(char* filename)
+{
+	printf("Testing large buffers %s...\n", filename);
+	
+	muj_document document = load_file(filename);
+	muj_large_buffers large = {1, true, muj_get_numa_node()};
+	muj_set_large_buffers(large);
+	muj_document mapped = load_file(filename);
+	muj_large_buffers off = {0, false, -1};
+	muj_set_large_buffers(off);
+	
+	bool same = (*document.json.json_write_pos == *mapped.json.json_write_pos) && (*document.table.current_write_pos == *mapped.table.current_write_pos);
+	same = same && memcmp(document.json.json_target, mapped.json.json_target, *document.json.json_write_pos) == 0;
+	same = same && memcmp(document.table.table, mapped.table.table, *document.table.current_write_pos*sizeof(MUJ_INDEX)) == 0;
+	printf("%s\n", same ? "Same as allocated" : "Different from allocated");
+	
+	muj_unload_document(mapped);
+	muj_unload_document(document);
+}
+
+double test_clock(void* user_data)
+{
+	double* ticks = (double*)user_data;
+	return (*ticks)++;
+}
+
+// test.project compiles with MUJSON_INSTRUMENT, without it every counter stays 0
+void test_stats(char* filename)
+{
+	printf("Testing stats %s...\n", filename);
+	
+	double ticks = 0;
+	muj_stats stats;
+	muj_init_stats(&stats);
+	stats.clock = test_clock;
+	stats.clock_user_data = &ticks;
+	FILE* f = fopen(filename, "ro");
+	muj_compressed_json target = muj_allocate_compressed_json(file_size(f));
+	target.stats = &stats;
+	muj_source source;
+	source.file = f;
+	muj_phase1(source, target);
+	fclose(f);
+	muj_document document = muj_make_document(target, muj_allocate_document_table(target));
+	muj_phase2(document);
+	
+	MUJ_INDEX root = muj_get_root_object(document.table);
+	if (muj_is_object(root, document))
+		muj_find_value_of_key_in_object(root, "no such key", document);
+	else if (muj_is_array(root, document))
+		muj_get_element_from_array(root, muj_array_count_number_of_elements(root, document)-1, document);
+	for( MUJ_INDEX i=0; i<*document.table.current_write_pos; i+=2)
+	{
+		if (muj_is_number(i, document))
+			muj_get_double(i, document);
+		else if (muj_is_string(i, document))
+			free(muj_alloc_string_copy_target_and_copy(i, document));
+	}
+	printf("phase 1: %d read, %d written, %d ticks\n", (int)stats.phase1_bytes_read, (int)stats.phase1_bytes_written, (int)stats.phase1_seconds);
+	printf("phase 2: %d read, %d indices, %d ticks\n", (int)stats.phase2_bytes_read, (int)stats.phase2_indices_written, (int)stats.phase2_seconds);
+	printf("%d lookups, %d hops, %d numbers, %d strings (%d bytes)\n", (int)stats.lookups, (int)stats.lookup_hops,
+		(int)stats.number_parses, (int)stats.string_copies, (int)stats.string_bytes_copied);
+	
+	muj_unload_document(document);
+}
+
+void test_max_depth(size_t depth)
+{
+	printf("Testing depth %d...\n", (int)depth);
+	
+	char* json = (char*)malloc(depth*2+1);
+	memset(json, '[', depth);
+	memset(json+depth, ']', depth);
+	json[depth*2] = 0;
+	muj_document document = load_string(json);
+	const char* error = muj_get_last_error();
+	printf("%s\n", error ? error : "Success.");
+	muj_unload_document(document);
+	free(json);
+}
+
 void test()
 {
 	size_t numFiles = sizeof(files) / sizeof(char*);
@@ -133,10 +766,83 @@ void test()
 		test_file(file);
 	}
 	test_doubles();	
+	test_phase2_recursive("../../test/regular.json");
+	test_phase2_recursive("../../test/deep_arrays.json");
+	test_phase2_recursive("../../test/string_with_escapes.json");
+	test_phase2_recursive("../../test/difficult_json_c_test_case.json");
+	test_phase2_recursive("../../test/lonely_number.json");
+	test_container_sizes("../../test/regular.json", false);
+	test_container_sizes("../../test/deep_arrays.json", false);
+	test_container_sizes("../../test/nulls_and_bools.json", false);
+	test_container_sizes("../../test/regular.json", true);
+	test_container_sizes("../../test/deep_arrays.json", true);
+	test_type_tags("../../test/regular.json");
+	test_type_tags("../../test/nulls_and_bools.json");
+	test_type_tags("../../test/deep_arrays.json");
+	test_large_buffers("../../test/regular.json");
+	test_shrink("../../test/nulls_and_bools.json");
+	test_shrink("../../test/doubles.json");
+	test_packed("../../test/regular.json");
+	test_shared_document("../../test/regular.json");
+	test_sidecar("../../test/regular.json", "../../test/doubles.json");
+	test_stats("../../test/regular.json");
+	test_stats("../../test/doubles.json");
+	test_error("{\n\t\"a\": [1, 2],\n\t\"b\" true\n}");
+	test_error("[1, 2\n}");
+	test_max_depth(MUJSON_MAX_DEPTH);
+	test_max_depth(MUJSON_MAX_DEPTH+1);
+	test_minified("../../test/doubles.json");
+	test_minified("../../test/string_with_escapes.json");
+	test_minified("../../test/nulls_and_bools.json");
+	test_minified("../../test/regular.json");
+	test_unicode("../../test/codepoints_from_unicode_org.json", true);
+	test_unicode("../../test/isolated_surrogate_marker.json", false);
+	test_unicode("../../test/isolated_surrogate_marker.json", true);
+	test_unicode("../../test/invalid_utf8.json", true);
+	test_unicode("../../test/string_with_invalid_newline.json", true);
+	test_unicode("../../test/three_byte_utf8.json", true);
+	test_unicode("../../test/four_byte_utf8.json", true);
+	test_unicode("../../test/string_with_escapes.json", true);
+	test_unicode("../../test/escaped_bulgarian.json", true);
+	test_unicode("../../test/unescaped_bulgarian.json", true);
+	test_string_views("../../test/string_with_escapes.json");
+	test_key_interning("../../test/regular.json");
+	test_columns("[{\"id\": 1, \"score\": 2.5, \"active\": true, \"name\": \"a\"}, {\"score\": -1e2, \"id\": -9223372036854775808, \"name\": \"b\\u00e9\", \"active\": false}, {\"id\": 1.5, \"score\": null, \"name\": 3}, 7, {\"id\": 4, \"active\": false, \"name\": \"\"}]");
+	const char* records[] = {
+		"{\"id\": 1, \"name\": \"a\", \"pos\": {\"x\": 1, \"y\": 2}}",
+		"{\"id\": 2, \"name\": \"b\", \"pos\": {\"x\": 3, \"y\": 4}}",
+		"{\"id\": 3, \"nam\": \"c\", \"pos\": {\"x\": 5, \"y\": 6}}",
+		"{\"id\": 4, \"na\\\"me\": \"d\", \"pos\": {\"y\": 7, \"x\": 8}}",
+		"[{\"id\": 5, \"name\": \"e\"}, {\"id\": 6, \"name\": \"f\", \"extra\": []}, {\"id\": 7, \"name\": \"g\"}]",
+		"{\"id\" : 8, \"name\": \"h\", \"pos\": {\"x\": 9, \"y\": 10}}", // the ':' no longer follows the key
+		"{\"id\": 9, \"name\":\"i\", \"pos\": {\"x\": 11, \"y\": 12}}"
+	};
+	test_shape_cache(records, 7);
+	test_overlay();
+	test_patch("{\"foo\": \"bar\"}", "[{\"op\": \"add\", \"path\": \"/baz\", \"value\": \"qux\"}]", false);
+	test_patch("{\"foo\": [\"bar\", \"baz\"]}", "[{\"op\": \"add\", \"path\": \"/foo/1\", \"value\": \"qux\"}, {\"op\": \"add\", \"path\": \"/foo/-\", \"value\": 1e-3}]", false);
+	test_patch("{\"baz\": \"qux\", \"foo\": \"bar\"}", "[{\"op\": \"remove\", \"path\": \"/baz\"}, {\"op\": \"replace\", \"path\": \"/foo\", \"value\": {\"a\": [true]}}, {\"op\": \"add\", \"path\": \"/foo/a/0\", \"value\": null}]", false);
+	test_patch("{\"foo\": {\"bar\": \"baz\", \"waldo\": \"fred\"}, \"qux\": {\"corge\": \"grault\"}}", "[{\"op\": \"move\", \"from\": \"/foo/waldo\", \"path\": \"/qux/thud\"}]", false);
+	test_patch("{\"foo\": [\"all\", \"grass\", \"cows\", \"eat\"]}", "[{\"op\": \"move\", \"from\": \"/foo/1\", \"path\": \"/foo/3\"}]", false);
+	test_patch("{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}", "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"qux\"}, {\"op\": \"test\", \"path\": \"/foo/1\", \"value\": 2}]", false);
+	test_patch("{\"baz\": \"qux\"}", "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"bar\"}]", false);
+	test_patch("{\"a\": {\"b\": 1, \"c\": [2, \"\\u0041\"]}, \"n\": 1}", "[{\"op\": \"test\", \"path\": \"/a\", \"value\": {\"c\": [2.0, \"A\"], \"b\": 1}}, {\"op\": \"test\", \"path\": \"/n\", \"value\": 10e-1}]", false);
+	test_patch("{\"a\": {\"b\": 1, \"c\": 2}}", "[{\"op\": \"test\", \"path\": \"/a\", \"value\": {\"c\": 2, \"d\": 1}}]", false);
+	test_patch("{\"l\": [1, 2, 3, 4]}", "[{\"op\": \"add\", \"path\": \"/l/0\", \"value\": \"x\"}, {\"op\": \"remove\", \"path\": \"/l/2\"}, {\"op\": \"add\", \"path\": \"/l/-\", \"value\": 5}, {\"op\": \"replace\", \"path\": \"/l/3\", \"value\": 9}, {\"op\": \"add\", \"path\": \"/l/5\", \"value\": 6}, {\"op\": \"test\", \"path\": \"/l/1\", \"value\": 1}, {\"op\": \"remove\", \"path\": \"/l/0\"}]", false);
+	test_patch("{\"foo\": \"bar\"}", "[{\"op\": \"add\", \"path\": \"/child\", \"value\": {\"grandchild\": {}}}, {\"op\": \"copy\", \"from\": \"/foo\", \"path\": \"/child/grandchild/foo\"}]", false);
+	test_patch("{\"a\": \"b\", \"c\": {\"d\": \"e\", \"f\": \"g\"}}", "{\"a\": \"z\", \"c\": {\"f\": null}}", true);
+	test_patch("{\"title\": \"Goodbye!\", \"tags\": [\"example\", \"sample\"], \"content\": \"text\"}", "{\"title\": \"Hello!\", \"phoneNumber\": \"+01-555\", \"author\": {\"givenName\": \"John\", \"familyName\": null}, \"tags\": [\"example\"]}", true);
+	test_diff("{\"a\": 1, \"b\": [1, 2, 3], \"c\": {\"d\": true}}", "{\"a\": 1, \"b\": [1, 2, 3], \"c\": {\"d\": true}}");
+	test_diff("{\"a\": 1, \"b\": {\"x/y\": \"z\", \"t~\": null}, \"c\": \"gone\"}", "{\"a\": 2.5e-3, \"b\": {\"x/y\": \"w\", \"t~\": null}, \"d\": [false]}");
+	test_diff("{\"list\": [1, 2, 3, 4, 5]}", "{\"list\": [1, 2, 7, 8, 4, 5]}");
+	test_diff("{\"list\": [1, 2, 3, 4, 5], \"deep\": [{\"k\": [0]}]}", "{\"list\": [1, 5], \"deep\": [{\"k\": [0, 1]}]}");
+	test_diff("[1, {\"a\": 2}]", "\"text\"");
+	test_subtree_hashes("{\"a\": {\"x\": [1, 2], \"y\": {}}, \"b\": {\"x\": [1, 2], \"y\": {}}, \"c\": [[1, 2], {\"x\": [1, 2]}], \"d\": {\"y\": {}, \"x\": [1, 2]}}");
 }
 
 int main()
 {
+	muj_set_log_function(log_problem, NULL);
 	test();
 	char c;
 	scanf("%c", &c);
@@ -1,7 +1,115 @@
 #include <mujson.hpp>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <cassert>
+#if __cplusplus >= 201402L
+#include <mujson_bind.hpp>
+
+struct Friend
+{
+	long id;
+	std::string name;
+};
+
+struct Person
+{
+	int id;
+	std::string name;
+	bool isActive;
+	double latitude;
+	std::vector<std::string> tags;
+	std::vector<Friend> friends;
+	int missing;
+};
+
+template<> struct Json::Bind::Describe<Friend>
+{
+	static constexpr auto fields() {return std::make_tuple(Json::Bind::field("id", &Friend::id), Json::Bind::field("name", &Friend::name));}
+};
+
+template<> struct Json::Bind::Describe<Person>
+{
+	static constexpr auto fields()
+	{
+		return std::make_tuple(Json::Bind::field("id", &Person::id), Json::Bind::field("name", &Person::name), Json::Bind::field("isActive", &Person::isActive),
+			Json::Bind::field("latitude", &Person::latitude), Json::Bind::field("tags", &Person::tags), Json::Bind::field("friends", &Person::friends),
+			Json::Bind::field("missing", &Person::missing));
+	}
+};
+
+static void testBinding(const Json::Value& value)
+{
+	Person person;
+	Json::Bind::Result result = Json::Bind::decode(person, value);
+	std::cout << "Bound: " << person.id << " " << person.name << " " << person.isActive << " " << person.latitude << " " << person.tags.size() << " tags, friend " << person.friends[0].name
+		<< " (missing " << result.missing << ", invalid " << result.invalid << ", extra " << result.numExtra << ")" << std::endl;
+}
+#endif
+
+static size_t countValues(const Json::Value& value)
+{
+	size_t count = 1;
+	Json::Elements elements = value.elements();
+	for( Json::ElementIterator i = elements.begin(); i != elements.end(); ++i)
+		count += countValues(*i);
+	Json::Members members = value.members();
+	for( Json::MemberIterator i = members.begin(); i != members.end(); ++i)
+		count += countValues((*i).value);
+	return count;
+}
+
+static void testOwnership()
+{
+	Json::Document shared;
+	{
+		Json::Reader reader;
+		Json::Value root;
+		std::ifstream first("../../test/nulls_and_bools.json", std::ios::binary);
+		reader.parse(first, root);
+		const char* buffer = reader.getDocument().json.json_target;
+		reader.reset();
+		std::ifstream second("../../test/simple.json", std::ios::binary);
+		reader.parse(second, root);
+		std::cout << "Buffers reused: " << (reader.getDocument().json.json_target == buffer) << std::endl;
+		shared = reader.share();
+		std::ifstream third("../../test/nulls_and_bools.json", std::ios::binary);
+		reader.parse(third, root);
+		std::cout << "Shared document kept: " << (shared.getDocument().json.json_target != reader.getDocument().json.json_target) << std::endl;
+#if __cplusplus >= 201103L
+		std::vector<Json::Reader> pool;
+		pool.push_back(std::move(reader));
+		std::cout << "Moved reader: " << root.isObject() << " " << Json::Object(root).size() << std::endl;
+#endif
+	}
+	size_t capacity = shared.getDocument().json.json_max_size;
+	shared.shrink();
+	Json::Value root = shared.getRoot();
+	std::cout << "Outlived the reader: " << root.isObject() << " " << Json::Object(root).size() << std::endl;
+	std::cout << "Shrunk: " << (shared.getDocument().json.json_max_size < capacity) << std::endl;
+}
+
+#if __cplusplus >= 201703L
+static void testStringViews()
+{
+	Json::Reader reader;
+	Json::Value root;
+	std::ifstream file("../../test/string_with_escapes.json", std::ios::binary);
+	reader.parse(file, root);
+	Json::Array strings(root);
+	size_t used = reader.getArena()->current->used;
+	bool same = (strings[0].asStringView().data() == strings[0].asStringView().data());
+	strings[1].asStringView();
+	std::cout << "String views decoded by parse: " << same << " " << (reader.getArena()->current->used == used) << std::endl;
+	
+	std::istringstream object("{\"k\\u00e9y\": 1}");
+	reader.parse(object, root);
+	Json::Members members = root.members();
+	used = reader.getArena()->current->used;
+	const char* key = (*members.begin()).key.data;
+	std::cout << "Keys decoded by parse: " << (key == (*members.begin()).key.data) << " " << (reader.getArena()->current->used == used) << " " << (*members.begin()).keyView() << std::endl;
+}
+#endif
 
 int main(int argc, char **argv)
 {
@@ -16,6 +124,7 @@ int main(int argc, char **argv)
 	if (root.isArray())
 	{
 		std::cout << "Root is array." << std::endl;
+		std::cout << "Values: " << countValues(root) << std::endl;
 		
 		Json::Array rootArray(root);
 		
@@ -25,12 +134,21 @@ int main(int argc, char **argv)
 			if (val.isObject())
 			{
 				std::cout << "Element: " << val["name"].asString() << std::endl;
+#if __cplusplus >= 201402L
+				testBinding(val);
+#endif
+#if __cplusplus >= 201703L
+				assert(val["name"].asStringView() == val["name"].asString());
+#endif
 				Json::Object valObject(val);
-				for( unsigned j=0; j < valObject.size(); j++)
+				Json::MemberIterator member = val.members().begin();
+				for( unsigned j=0; j < valObject.size(); j++, ++member)
 				{
 					Json::KeyValuePair kvp = valObject[j];
 					std::cout << kvp.key << " : " << (kvp.value.isString()?kvp.value.asString():"") << std::endl;
+					assert(kvp.key == std::string((*member).key.data, (*member).key.length) && kvp.value.getIndex() == (*member).value.getIndex());
 				}
+				assert(member == val.members().end());
 			}
 		}
 	}
@@ -39,6 +157,11 @@ int main(int argc, char **argv)
 		std::cout << "Root is not array." << std::endl;
 	}
 	
+	testOwnership();
+#if __cplusplus >= 201703L
+	testStringViews();
+#endif
+	
 	std::cin.ignore();
 	
 	return 0;